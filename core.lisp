@@ -159,9 +159,13 @@
 
 (define
     (- . lst)
-        (define rest (cdr lst))
+        (define (sub acc rest)
+            (if (cons? rest)
+                (sub (+ acc (* -1 (car rest))) (cdr rest))
+                acc
+            ))
         (if
-            (cons? rest) (+ (car lst) (* -1 (car rest)))
+            (cons? (cdr lst)) (sub (car lst) (cdr lst))
             (* -1 (car lst))
         ))
 
@@ -180,11 +184,21 @@
        ))
 
 (define append
-    (lambda (lhs rhs)
-        (if (null? lhs)
-            rhs
-            (cons (car lhs) (append (cdr lhs) rhs))
-        )
+    (lambda lists
+        (define (append2 lhs rhs)
+            (if (null? lhs)
+                rhs
+                (cons (car lhs) (append2 (cdr lhs) rhs))
+            ))
+        (define (impl ls)
+            (if (null? ls)
+                null
+                (if (null? (cdr ls))
+                    (car ls)
+                    (append2 (car ls) (impl (cdr ls)))
+                )
+            ))
+        (impl lists)
     )
 )
 
@@ -0,0 +1,43 @@
+#ifndef LISP_AST_OPTIMIZER_H
+#define LISP_AST_OPTIMIZER_H
+
+#include "evaluator.h"
+#include <ostream>
+
+struct PrimitiveOp;
+
+// What the AST optimizer rewrote, summed over the expressions it ran on.
+struct AstOptimizerStats
+{
+    // Applications of primitive ops to literals replaced with their value.
+    size_t constantsFolded{};
+    // Ifs with a literal predicate replaced with the branch taken.
+    size_t branchesRemoved{};
+    // Sequences spliced into the enclosing sequence, or replaced with their single action.
+    size_t sequencesFlattened{};
+    AstOptimizerStats& operator+=(AstOptimizerStats const& other);
+};
+
+std::ostream& operator<<(std::ostream& o, AstOptimizerStats const& stats);
+
+// Simplifies a parsed expression before compiling it, with the semantics of the VM: the primitive ops are the
+// ones the compiler emits inline, and folding follows the fixnum and double arithmetic of the VM.
+// Subexpressions left as they are are shared with expr, the rewritten ones are new nodes.
+class AstOptimizer
+{
+    AstOptimizerStats& mStats;
+    // Names bound by the enclosing lambdas, parameters and internal definitions: like the compiler, only applications
+    // of unbound or global names are primitive ops.
+    std::vector<SymbolId> mLocals{};
+    void addDefinitions(ExprPtr const& expr);
+    PrimitiveOp const* primitive(ExprPtr const& op) const;
+    ExprPtr application(Application const& app, ExprPtr const& expr);
+    std::vector<ExprPtr> actions(std::vector<ExprPtr> const& actions);
+public:
+    explicit AstOptimizer(AstOptimizerStats& stats)
+    : mStats{stats}
+    {}
+    ExprPtr optimize(ExprPtr const& expr);
+};
+
+#endif // LISP_AST_OPTIMIZER_H
@@ -0,0 +1,173 @@
+#ifndef LISP_BYTECODE_H
+#define LISP_BYTECODE_H
+
+#include "vm.h"
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+namespace vm
+{
+// FNV-1a hash of bytes, continuing hash.
+uint64_t fnv1a(std::string_view bytes, uint64_t hash = 0xCBF29CE484222325ULL);
+
+// Hash of the op codes by number and name: code written by a build only runs on a build with the same op codes.
+uint64_t opCodesHash();
+
+// Encoding of code and values to bytes, shared by the bytecode files and the images of the compiler.
+// Integers are little-endian, strings and sequences are prefixed with their size.
+// Symbols are indices in a table of names, and function symbols indices in a table of functions, both gathered while
+// writing and stored ahead of what refers to them.
+class ByteWriter
+{
+    std::string mBytes{};
+    std::unordered_map<SymbolId, size_t> mSymbolToIndex{};
+    std::vector<SymbolId> mSymbols{};
+    std::unordered_map<FunctionSymbol const*, size_t> mFunctionToIndex{};
+    std::vector<FunctionSymbol const*> mFunctions{};
+    // Encoded function symbols, by index.
+    std::vector<std::string> mFunctionBytes{};
+public:
+    template <typename T>
+    void integer(T value)
+    {
+        static_assert(std::is_unsigned_v<T>);
+        for (size_t i = 0; i < sizeof(T); ++i)
+        {
+            mBytes.push_back(static_cast<char>(value & 0xFFU));
+            value = static_cast<T>(value >> 4 >> 4);
+        }
+    }
+    void size(size_t value);
+    void flag(bool value)
+    {
+        integer(uint8_t{value});
+    }
+    template <typename Tag>
+    void tag(Tag value)
+    {
+        integer(static_cast<uint8_t>(value));
+    }
+    void real(double value);
+    void raw(std::string_view bytes)
+    {
+        mBytes.append(bytes);
+    }
+    void string(std::string_view str)
+    {
+        size(str.size());
+        raw(str);
+    }
+    void symbol(SymbolId id);
+    void instructions(Instructions const& instructions);
+    void object(Object const& obj);
+    // Index of funcSym in the table of functions, added after the functions it refers to.
+    size_t function(FunctionSymbol const* funcSym);
+    // The bytes written since the last call, the tables are kept.
+    std::string release()
+    {
+        return std::exchange(mBytes, {});
+    }
+    std::string symbolTable() const;
+    std::string functionTable() const;
+    // Names of the functions of the table, optional: functions read without them are anonymous.
+    std::string functionNames() const;
+};
+
+// Reads what a ByteWriter wrote, in the same order. Throws on truncated or inconsistent bytes.
+class ByteReader
+{
+    std::string_view const mBytes;
+    size_t mPos{};
+    std::vector<SymbolId> mSymbols{};
+    std::vector<FunctionSymbol const*> mFunctions{};
+protected:
+    size_t symbolIndex();
+    SymbolId symbol(size_t index) const
+    {
+        return mSymbols[index];
+    }
+public:
+    explicit ByteReader(std::string_view bytes)
+    : mBytes{bytes}
+    {}
+    size_t position() const
+    {
+        return mPos;
+    }
+    bool atEnd() const
+    {
+        return mPos == mBytes.size();
+    }
+    std::string_view raw(size_t size);
+    template <typename T>
+    T integer()
+    {
+        auto const bytes = raw(sizeof(T));
+        T value{};
+        for (size_t i = sizeof(T); i > 0; --i)
+        {
+            value = static_cast<T>(value << 4 << 4 | static_cast<uint8_t>(bytes[i - 1]));
+        }
+        return value;
+    }
+    size_t size()
+    {
+        return integer<uint32_t>();
+    }
+    // Number of elements that follow, each at least a byte.
+    size_t count();
+    bool flag();
+    template <typename Tag>
+    Tag tag()
+    {
+        return static_cast<Tag>(integer<uint8_t>());
+    }
+    double real();
+    std::string_view string()
+    {
+        return raw(size());
+    }
+    SymbolId symbol()
+    {
+        return mSymbols[symbolIndex()];
+    }
+    Instructions instructions();
+    Object object(Heap& heap);
+    void symbolTable();
+    // The function symbols are allocated on heap, named after names when given.
+    void functionTable(Heap& heap, std::vector<std::string> const& names = {});
+    std::vector<std::string> functionNames();
+};
+
+// A .lbc file: the code of a program as compiled, to run without compiling it again.
+// A header (magic, version, hash of the op codes, checksum and size of the rest), then sections prefixed with their
+// size: symbols, function names (debug info, optional), functions, constants of the top level code and its
+// instructions.
+std::string writeByteCode(ByteCode const& code, bool debugInfo = true);
+
+// Throws when bytes are not a .lbc file of this version, were written by a build with other op codes, or are corrupt:
+// the code must only refer to locals of its frame, to globals it sets and to constants of its pool.
+ByteCode readByteCode(std::string_view bytes);
+
+// The bytes of a file, mapped in memory where the platform supports it, read otherwise.
+class MappedFile
+{
+    void* mData{};
+    size_t mSize{};
+    std::string mBuffer{};
+public:
+    // Throws when the file cannot be opened.
+    explicit MappedFile(std::string const& path);
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+    ~MappedFile();
+    std::string_view bytes() const
+    {
+        return mData ? std::string_view{static_cast<char const*>(mData), mSize} : std::string_view{mBuffer};
+    }
+};
+} // namespace vm
+
+#endif // LISP_BYTECODE_H
@@ -0,0 +1,153 @@
+#ifndef LISP_CELL_POOL_H
+#define LISP_CELL_POOL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+struct CellPoolStats
+{
+    size_t allocations{};
+    size_t deallocations{};
+    // Allocations served from the free list instead of fresh chunk memory.
+    size_t recycled{};
+    size_t cellsInUse{};
+    size_t chunks{};
+};
+
+// Pool of fixed-size cells for list cells, not thread safe (neither the evaluator nor the VM are).
+// Cells are carved out of cache-line aligned chunks by bumping a pointer, so that cells allocated one after the
+// other are packed next to each other. Freed cells go to a free list and are handed out again first.
+// Chunks are only released with the pool.
+class CellPool
+{
+public:
+    static constexpr size_t kCellAlignment = alignof(void*);
+private:
+    static constexpr size_t kCacheLine = 64;
+    static constexpr size_t kChunkSize = size_t{64} << 10;
+
+    struct FreeCell
+    {
+        FreeCell* next;
+    };
+    struct ChunkDeleter
+    {
+        void operator()(std::byte* chunk) const
+        {
+            ::operator delete(chunk, std::align_val_t{kCacheLine});
+        }
+    };
+
+    size_t const mCellSize;
+    size_t const mCellsPerChunk;
+    std::vector<std::unique_ptr<std::byte, ChunkDeleter>> mChunks{};
+    std::byte* mBump{};
+    std::byte* mBumpEnd{};
+    FreeCell* mFreeList{};
+    CellPoolStats mStats{};
+
+    void addChunk()
+    {
+        auto const chunk = static_cast<std::byte*>(::operator new(mCellsPerChunk * mCellSize, std::align_val_t{kCacheLine}));
+        mChunks.emplace_back(chunk);
+        mBump = chunk;
+        mBumpEnd = chunk + mCellsPerChunk * mCellSize;
+        ++mStats.chunks;
+    }
+public:
+    explicit CellPool(size_t cellSize)
+    : mCellSize{(std::max(cellSize, sizeof(FreeCell)) + kCellAlignment - 1) / kCellAlignment * kCellAlignment}
+    , mCellsPerChunk{kChunkSize / mCellSize}
+    {}
+    CellPool(CellPool const&) = delete;
+    CellPool& operator=(CellPool const&) = delete;
+    size_t cellSize() const
+    {
+        return mCellSize;
+    }
+    void* allocate()
+    {
+        ++mStats.allocations;
+        ++mStats.cellsInUse;
+        if (mFreeList)
+        {
+            ++mStats.recycled;
+            auto const cell = mFreeList;
+            mFreeList = cell->next;
+            return cell;
+        }
+        if (mBump == mBumpEnd)
+        {
+            addChunk();
+        }
+        auto const cell = mBump;
+        mBump += mCellSize;
+        return cell;
+    }
+    void deallocate(void* cell)
+    {
+        ++mStats.deallocations;
+        --mStats.cellsInUse;
+        mFreeList = ::new (cell) FreeCell{mFreeList};
+    }
+    CellPoolStats const& stats() const
+    {
+        return mStats;
+    }
+};
+
+// Allocator for std::allocate_shared: the object and the control block of its shared_ptr share one cell.
+// What does not fit in a cell goes to the default allocator.
+template <typename T>
+class PoolAllocator
+{
+    template <typename U>
+    friend class PoolAllocator;
+    CellPool* mPool;
+    static bool fits(size_t n, CellPool const& pool)
+    {
+        return n == 1 && sizeof(T) <= pool.cellSize() && alignof(T) <= CellPool::kCellAlignment;
+    }
+public:
+    using value_type = T;
+    explicit PoolAllocator(CellPool& pool)
+    : mPool{&pool}
+    {}
+    template <typename U>
+    PoolAllocator(PoolAllocator<U> const& other)
+    : mPool{other.mPool}
+    {}
+    T* allocate(size_t n)
+    {
+        if (!fits(n, *mPool))
+        {
+            return std::allocator<T>{}.allocate(n);
+        }
+        return static_cast<T*>(mPool->allocate());
+    }
+    void deallocate(T* ptr, size_t n)
+    {
+        if (!fits(n, *mPool))
+        {
+            std::allocator<T>{}.deallocate(ptr, n);
+            return;
+        }
+        mPool->deallocate(ptr);
+    }
+    template <typename U>
+    bool operator==(PoolAllocator<U> const& other) const
+    {
+        return mPool == other.mPool;
+    }
+    template <typename U>
+    bool operator!=(PoolAllocator<U> const& other) const
+    {
+        return mPool != other.mPool;
+    }
+};
+
+#endif // LISP_CELL_POOL_H
@@ -2,8 +2,12 @@
 #define LISP_COMPILER_H
 
 #include "vm.h"
+#include "peephole.h"
+#include "astOptimizer.h"
 #include "evaluator.h"
+#include <cstring>
 #include <optional>
+#include <stack>
 
 enum class Scope
 {
@@ -19,9 +23,15 @@ class CurrentFunctionIndex
 inline constexpr CurrentFunctionIndex currentFunctionIndex{};
 
 using VarInfo = std::pair<size_t, Scope>;
+
+class ImageWriter;
+class ImageReader;
+
 class SymbolTable
 {
-    std::map<std::string, VarInfo> mNameToVarInfo{};
+    friend ImageWriter;
+    friend ImageReader;
+    std::unordered_map<SymbolId, VarInfo> mNameToVarInfo{};
     std::vector<VarInfo> mOrigFreeVars{};
     size_t mNbDefinitions{};
     SymbolTable* mEnclosing{};
@@ -34,7 +44,7 @@ public:
     {
         return SymbolTable(this);
     }
-    auto defineFreeVar(std::string const& name, VarInfo const& orig)
+    auto defineFreeVar(SymbolId name, VarInfo const& orig)
     {
         auto freeIndex = mOrigFreeVars.size();
         mOrigFreeVars.push_back(orig);
@@ -42,7 +52,7 @@ public:
         mNameToVarInfo[name] = freeVar;
         return freeVar;
     }
-    std::optional<VarInfo> resolve(std::string const& name)
+    std::optional<VarInfo> resolve(SymbolId name)
     {
         // found
         auto const& map = mNameToVarInfo;
@@ -70,7 +80,7 @@ public:
         return {};
     }
 
-    VarInfo define(std::string const& name, Scope scope)
+    VarInfo define(SymbolId name, Scope scope)
     {
         auto const index = mNbDefinitions;
         auto const varInfo = VarInfo{index, scope};
@@ -86,7 +96,7 @@ public:
     {
         return mNbDefinitions;
     }
-    VarInfo defineCurrentFunction(std::string const& name)
+    VarInfo defineCurrentFunction(SymbolId name)
     {
         auto const varInfo = VarInfo{0, Scope::kFUNCTION_SELF_REF};
         mNameToVarInfo[name] = varInfo;
@@ -94,11 +104,168 @@ public:
     }
 };
 
+// Whether a number literal is compiled to a fixnum: integral, in int32 range and not -0.0.
+bool isFixnum(double value);
+
+// How an application of a primitive is compiled: the unary op takes a single operand, the binary op is folded
+// over two operands, or over any number of them when variadic.
+struct PrimitiveOp
+{
+    std::optional<vm::OpCode> unary;
+    std::optional<vm::OpCode> binary;
+    bool variadic;
+    // Folded from the right, (append a b c) is (append a (append b c)), instead of from the left,
+    // (- a b c) is (- (- a b) c).
+    bool rightFold{};
+    // The value without operands, empty when there must be some. When foldIdentity, it is folded with the
+    // operands too: (list a b) is (cons a (cons b '())).
+    ExprPtr identity{};
+    bool foldIdentity{};
+};
+
+// The primitive op named name, nullptr when applications of name are compiled as calls.
+PrimitiveOp const* primitiveOp(SymbolId name);
+
+// The procedure standing for the variadic primitive op named name where it is used as a value.
+vm::Builtin* makeBuiltin(SymbolId name, vm::Heap& heap);
+
+// Constant pool references emitted by the compiler and the entries stored for them, the same literal used
+// several times in a function is stored once.
+struct ConstantPoolStats
+{
+    size_t references{};
+    size_t entries{};
+};
+
+// Constants of the function being compiled, or of the top level code. Literals are stored once per pool,
+// function symbols are all distinct.
+class ConstantPool
+{
+    std::vector<vm::Object> mValues{};
+    std::unordered_map<uint64_t, size_t> mDoubleToIndex{};
+    std::unordered_map<SymbolId, size_t> mSymbolToIndex{};
+    std::unordered_map<std::string, size_t> mStringToIndex{};
+    std::unordered_map<SymbolId, size_t> mBuiltinToIndex{};
+    template <typename Map, typename Key, typename Make>
+    size_t intern(Map& map, Key const& key, Make const& make)
+    {
+        auto const [iter, inserted] = map.try_emplace(key, mValues.size());
+        if (inserted)
+        {
+            mValues.push_back(make());
+        }
+        return iter->second;
+    }
+public:
+    size_t add(double value)
+    {
+        // Keyed by bits, so that 0.0 and -0.0 stay distinct.
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return intern(mDoubleToIndex, bits, [value] { return vm::Double{value}; });
+    }
+    size_t add(vm::Symbol symbol)
+    {
+        return intern(mSymbolToIndex, symbol.value, [symbol] { return symbol; });
+    }
+    size_t add(std::string const& str, vm::Heap& constants)
+    {
+        return intern(mStringToIndex, str, [&] { return vm::Object{constants.string(str)}; });
+    }
+    size_t addBuiltin(SymbolId name, vm::Heap& constants)
+    {
+        return intern(mBuiltinToIndex, name, [&] { return vm::Object{makeBuiltin(name, constants)}; });
+    }
+    size_t add(vm::FunctionSymbol const* funcSym)
+    {
+        mValues.push_back(funcSym);
+        return mValues.size() - 1;
+    }
+    // Adds a constant read back from a pool written out, keyed as when it was compiled.
+    size_t restore(vm::Object const& constant)
+    {
+        if (constant.isDouble())
+        {
+            return add(constant.asDouble());
+        }
+        if (constant.isSymbol())
+        {
+            return add(vm::Symbol{constant.asSymbol()});
+        }
+        if (auto const strPtr = constant.as<vm::StringObject>())
+        {
+            return intern(mStringToIndex, strPtr->value, [constant] { return constant; });
+        }
+        if (auto const builtin = constant.as<vm::Builtin>())
+        {
+            return intern(mBuiltinToIndex, ::intern(builtin->name()), [constant] { return constant; });
+        }
+        auto const funcSym = constant.as<vm::FunctionSymbol>();
+        ASSERT_MSG(funcSym, constant);
+        return add(funcSym);
+    }
+    size_t size() const
+    {
+        return mValues.size();
+    }
+    auto const& values() const
+    {
+        return mValues;
+    }
+    std::vector<vm::Object> release()
+    {
+        return std::move(mValues);
+    }
+};
+
+struct CompilerOptions
+{
+    // Fold constants, remove statically dead branches and flatten sequences before compiling (AstOptimizer).
+    bool astOptimizer{true};
+    // Run the peephole optimizer over each function and over the top level code.
+    bool peephole{false};
+    // Then replace common sequences of instructions with superinstructions.
+    bool superinstructions{true};
+    // Compile the body of small global procedures in place of calls to them.
+    bool inliner{true};
+};
+
 class Compiler
 {
+    friend ImageWriter;
+    friend ImageReader;
     SymbolTable mSymbolTable{};
     vm::ByteCode mCode{};
-    using FuncInfo = std::tuple<vm::Instructions, SymbolTable>;
+    ConstantPool mConstantPool{};
+    ConstantPoolStats mConstantPoolStats{};
+    CompilerOptions mOptions{};
+    AstOptimizerStats mAstOptimizerStats{};
+    vm::PeepholeStats mPeepholeStats{};
+    // Of the last top level code returned by code(), which optimizes a copy of it.
+    mutable vm::PeepholeStats mTopLevelPeepholeStats{};
+    // Global procedure small enough to compile its body in place of a call: a single expression of literals,
+    // variables, ifs and applications, not calling itself.
+    struct InlineCandidate
+    {
+        size_t index;
+        std::vector<SymbolId> params;
+        ExprPtr body;
+        // The other globals the body refers to and their slots, it is only inlined where they resolve the same.
+        std::vector<std::pair<SymbolId, size_t>> globals;
+    };
+    // By name, of the latest definition of each global.
+    std::unordered_map<SymbolId, InlineCandidate> mInlineCandidates{};
+    // Calls being inlined, innermost last. In the body compiled, a parameter stands for the argument expression
+    // of the call, compiled in the context of the caller.
+    struct InlineFrame
+    {
+        SymbolId name;
+        InlineCandidate candidate;
+        std::vector<ExprPtr> const* args;
+    };
+    std::vector<InlineFrame> mInlineFrames{};
+    size_t mInlinedCalls{};
+    using FuncInfo = std::tuple<vm::Instructions, SymbolTable, ConstantPool>;
     std::stack<FuncInfo> mFuncStack{};
     auto& instructions()
     {
@@ -108,15 +275,55 @@ class Compiler
     {
         return mFuncStack.empty() ? mSymbolTable : std::get<1>(mFuncStack.top());
     }
+    auto& constantPool()
+    {
+        return mFuncStack.empty() ? mConstantPool : std::get<2>(mFuncStack.top());
+    }
     void emitVar(VarInfo const& varInfo);
     void emitIndex(size_t index);
-    void emitApplication(Application const& app);
-    VarInfo resolve(std::string const& name)
+    // Emits op with the index of the constant add puts in the pool of the current function.
+    template <typename Add>
+    void emitConstant(vm::OpCode op, Add const& add)
+    {
+        auto& pool = constantPool();
+        auto const size = pool.size();
+        auto const index = add(pool);
+        ++mConstantPoolStats.references;
+        mConstantPoolStats.entries += pool.size() - size;
+        instructions().push_back(op);
+        emitIndex(index);
+    }
+    void emitApplication(Application const& app, bool tail);
+    // The primitive op named name, nullptr when it is not one or a local shadows it, parameters of the bodies
+    // being inlined included. Globals do not: primitives are bound early.
+    PrimitiveOp const* primitive(SymbolId name);
+    void addInlineCandidate(SymbolId name, size_t index, LambdaBase<CompoundProcedure> const& lambda);
+    // Compiles the body of the procedure app calls in its place, false when it is not inlined.
+    bool inlineApplication(Application const& app, bool tail);
+    // The argument the variable stands for in the body being inlined.
+    ExprPtr const* inlineArgument(SymbolId name) const;
+    // Whether evaluating expr has no effects, with the innermost nbFrames inline frames in scope.
+    bool isPure(ExprPtr const& expr, size_t nbFrames) const;
+    // Size of a body to inline, empty when it is not only literals, variables, ifs and applications.
+    static std::optional<size_t> inlineSize(ExprPtr const& expr);
+    // The variables expr evaluates, operators of primitive ops excepted.
+    static void variables(ExprPtr const& expr, std::vector<SymbolId>& result);
+    enum class Reach
+    {
+        kNONE,
+        kFOUND,
+        kBLOCKED
+    };
+    // Whether evaluating expr reaches param unconditionally, before anything with effects (kFOUND).
+    static Reach firstReach(ExprPtr const& expr, SymbolId param);
+    // tail: expr is in tail position of a lambda body, its value is the return value of the function.
+    void compile(ExprPtr const& expr, bool tail);
+    VarInfo resolve(SymbolId name)
     {
         if (mFuncStack.empty())
         {
             auto varInfo = mSymbolTable.resolve(name);
-            ASSERT_MSG(varInfo, name);
+            ASSERT_MSG(varInfo, symbolName(name));
             return varInfo.value();
         }
         
@@ -126,24 +333,65 @@ class Compiler
         {
             return varInfo.value();
         }
-        FAIL_MSG("Resolve failed!", name);
+        FAIL_MSG("Resolve failed!", symbolName(name));
     }
-    VarInfo defineCurrentFunction(std::string const& name)
+    VarInfo defineCurrentFunction(SymbolId name)
     {
         ASSERT(!mFuncStack.empty());
         return symbolTable().defineCurrentFunction(name);
     }
-    VarInfo define(std::string const& name)
+    VarInfo define(SymbolId name)
     {
         auto const scope = mFuncStack.empty() ? Scope::kGLOBAL : Scope::kLOCAL;
         return symbolTable().define(name, scope);
     }
 public:
     Compiler() = default;
-    void compile(ExprPtr const& expr);
+    explicit Compiler(CompilerOptions const& options)
+    : mOptions{options}
+    {}
+    void compile(ExprPtr const& expr)
+    {
+        if (mOptions.astOptimizer)
+        {
+            compile(AstOptimizer{mAstOptimizerStats}.optimize(expr), /* tail = */ false);
+            return;
+        }
+        compile(expr, /* tail = */ false);
+    }
     vm::ByteCode code() const
     {
-        return mCode;
+        auto code = mCode;
+        code.constantPool = mConstantPool.values();
+        if (mOptions.peephole)
+        {
+            mTopLevelPeepholeStats = {};
+            vm::optimize(code.instructions, code.constantPool, mTopLevelPeepholeStats);
+        }
+        if (mOptions.superinstructions)
+        {
+            vm::selectSuperinstructions(code.instructions);
+        }
+        return code;
+    }
+    vm::PeepholeStats peepholeStats() const
+    {
+        auto stats = mPeepholeStats;
+        stats += mTopLevelPeepholeStats;
+        return stats;
+    }
+    // Calls compiled as the body of the procedure called.
+    size_t inlinedCalls() const
+    {
+        return mInlinedCalls;
+    }
+    AstOptimizerStats const& astOptimizerStats() const
+    {
+        return mAstOptimizerStats;
+    }
+    ConstantPoolStats const& constantPoolStats() const
+    {
+        return mConstantPoolStats;
     }
 };
 
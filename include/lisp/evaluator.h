@@ -2,16 +2,22 @@
 #define LISP_EVALUATOR_H
 
 #include "meta.h"
+#include "intern.h"
+#include "cellPool.h"
 #include <memory>
-#include <map>
+#include <unordered_map>
 #include <vector>
 #include <string>
 #include <sstream>
 #include <algorithm>
 #include <functional>
 #include <variant>
+#include <optional>
 
 class Compiler;
+class Analyzer;
+class AstOptimizer;
+class ImageWriter;
 
 class Expr;
 using ExprPtr = std::shared_ptr<Expr>;
@@ -20,7 +26,7 @@ class Env;
 class Variable;
 
 // bool : variadic
-using Params = std::pair<std::vector<std::string>, bool>;
+using Params = std::pair<std::vector<SymbolId>, bool>;
 
 template <typename Iter>
 ExprPtr reverseVecToCons(Iter begin, Iter end);
@@ -28,25 +34,105 @@ ExprPtr reverseVecToCons(Iter begin, Iter end);
 ExprPtr vecToCons(std::vector<ExprPtr> const& vec);
 std::vector<ExprPtr> consToVec(ExprPtr const& expr);
 
-class Env
+// Position of a variable bound in a procedure frame: the number of frames to go up and the slot in that frame.
+struct LexicalAddress
 {
-    std::map<std::string, ExprPtr> mFrame;
-    Env* mEnclosingEnvironment;
+    size_t depth;
+    size_t slot;
+};
+
+// The names bound by the procedure frames enclosing an expression, as seen by the analysis pass.
+class LexicalScope
+{
+    std::vector<SymbolId> mNames;
+    LexicalScope const* mEnclosingScope;
+public:
+    LexicalScope(std::vector<SymbolId> const& names, LexicalScope const* enclosingScope)
+    : mNames{names}
+    , mEnclosingScope{enclosingScope}
+    {}
+    std::optional<LexicalAddress> lookup(SymbolId name) const
+    {
+        size_t depth = 0;
+        for (auto scope = this; scope != nullptr; scope = scope->mEnclosingScope, ++depth)
+        {
+            auto iter = std::find(scope->mNames.rbegin(), scope->mNames.rend(), name);
+            if (iter != scope->mNames.rend())
+            {
+                return LexicalAddress{depth, static_cast<size_t>(std::distance(iter, scope->mNames.rend()) - 1)};
+            }
+        }
+        return {};
+    }
+    // Returns the slot of name in the innermost frame, adding it if needed.
+    size_t define(SymbolId name)
+    {
+        auto iter = std::find(mNames.begin(), mNames.end(), name);
+        if (iter != mNames.end())
+        {
+            return static_cast<size_t>(std::distance(mNames.begin(), iter));
+        }
+        mNames.push_back(name);
+        return mNames.size() - 1;
+    }
+    size_t size() const
+    {
+        return mNames.size();
+    }
+};
+
+// Global (and macro) frames are maps looked up by name, procedure frames are flat vectors looked up by lexical address.
+class Env : public std::enable_shared_from_this<Env>
+{
+    std::unordered_map<SymbolId, ExprPtr> mFrame;
+    std::vector<ExprPtr> mSlots;
+    // Owned: with tail calls the frames of the callers are gone before the callee body is evaluated.
+    std::shared_ptr<Env> mEnclosingEnvironment;
+    static void checkArguments(Params const& parameters, std::vector<ExprPtr> const& arguments)
+    {
+        auto const& params = parameters.first; 
+        auto const variadic = parameters.second; 
+        if (variadic)
+        {
+            ASSERT(params.size() <= arguments.size() + 1);
+        }
+        else
+        {
+            ASSERT(params.size() == arguments.size());
+        }
+    }
+    ExprPtr& slot(LexicalAddress const& address)
+    {
+        Env* env = this;
+        for (size_t i = 0; i < address.depth; ++i)
+        {
+            env = env->mEnclosingEnvironment.get();
+        }
+        return env->mSlots.at(address.slot);
+    }
 public:
     Env()
     : mFrame{}
+    , mSlots{}
     , mEnclosingEnvironment{nullptr}
     {}
-    Env(std::map<std::string, ExprPtr> frame, Env* enclosingEnvironment)
+    Env(std::unordered_map<SymbolId, ExprPtr> frame, std::shared_ptr<Env> enclosingEnvironment)
     : mFrame{frame}
+    , mSlots{}
+    , mEnclosingEnvironment{enclosingEnvironment}
+    {}
+    Env(std::vector<ExprPtr> slots, std::shared_ptr<Env> enclosingEnvironment)
+    : mFrame{}
+    , mSlots{std::move(slots)}
     , mEnclosingEnvironment{enclosingEnvironment}
     {}
     void clear()
     {
         mFrame.clear();
+        mSlots.clear();
         mEnclosingEnvironment = nullptr;
     }
-    ExprPtr lookupVariableValue(std::string const& variableName)
+    ExprPtr lookupVariableValue(SymbolId variableName)
     {
         Env* env = this;
         while (env != nullptr)
@@ -56,21 +142,49 @@ public:
             {
                 return iter->second;
             }
-            env = env->mEnclosingEnvironment;
+            env = env->mEnclosingEnvironment.get();
         }
-        throw std::runtime_error{"variable " + variableName + " not found!"};
+        throw std::runtime_error{"variable " + symbolName(variableName) + " not found!"};
+    }
+    ExprPtr lookupVariableValue(std::string const& variableName)
+    {
+        return lookupVariableValue(intern(variableName));
     }
-    ExprPtr setVariableValue(std::string const& variableName, ExprPtr value)
+    ExprPtr lookupVariableValue(LexicalAddress const& address, SymbolId variableName)
     {
-        auto iter = mFrame.find(variableName);
-        if (iter == mFrame.end())
+        auto const& value = slot(address);
+        if (!value)
         {
-            throw std::runtime_error{"call setVariableValue to undefined variables." + variableName};
+            throw std::runtime_error{"variable " + symbolName(variableName) + " not found!"};
         }
-        iter->second = value;
         return value;
     }
-    bool variableDefined(std::string const& variableName)
+    ExprPtr setVariableValue(SymbolId variableName, ExprPtr value)
+    {
+        Env* env = this;
+        while (env != nullptr)
+        {
+            auto iter = env->mFrame.find(variableName);
+            if (iter != env->mFrame.end())
+            {
+                iter->second = value;
+                return value;
+            }
+            env = env->mEnclosingEnvironment.get();
+        }
+        throw std::runtime_error{"call setVariableValue to undefined variables." + symbolName(variableName)};
+    }
+    ExprPtr setVariableValue(LexicalAddress const& address, SymbolId variableName, ExprPtr value)
+    {
+        auto& var = slot(address);
+        if (!var)
+        {
+            throw std::runtime_error{"call setVariableValue to undefined variables." + symbolName(variableName)};
+        }
+        var = value;
+        return value;
+    }
+    bool variableDefined(SymbolId variableName)
     {
         if (mFrame.count(variableName))
         {
@@ -78,28 +192,39 @@ public:
         }
         return false;
     }
-    ExprPtr defineVariable(std::string const& variableName, ExprPtr value)
+    bool variableDefined(std::string const& variableName)
+    {
+        return variableDefined(intern(variableName));
+    }
+    ExprPtr defineVariable(SymbolId variableName, ExprPtr value)
     {
         if (mFrame.count(variableName))
         {
-            throw std::runtime_error{"call defineVariable to defined variables: " + variableName};
+            throw std::runtime_error{"call defineVariable to defined variables: " + symbolName(variableName)};
         }
         mFrame.insert({variableName, value});
         return value;
     }
+    ExprPtr defineVariable(std::string const& variableName, ExprPtr value)
+    {
+        return defineVariable(intern(variableName), value);
+    }
+    ExprPtr defineVariable(size_t slotIndex, SymbolId variableName, ExprPtr value)
+    {
+        auto& var = mSlots.at(slotIndex);
+        if (var)
+        {
+            throw std::runtime_error{"call defineVariable to defined variables: " + symbolName(variableName)};
+        }
+        var = value;
+        return value;
+    }
     std::shared_ptr<Env> extend(Params const& parameters, std::vector<ExprPtr> const& arguments)
     {
-        std::map<std::string, ExprPtr> frame;
+        checkArguments(parameters, arguments);
+        std::unordered_map<SymbolId, ExprPtr> frame;
         auto const& params = parameters.first; 
         auto const variadic = parameters.second; 
-        if (variadic)
-        {
-            ASSERT(params.size() <= arguments.size() + 1);
-        }
-        else
-        {
-            ASSERT(params.size() == arguments.size());
-        }
         if (!params.empty())
         {
             for (size_t i = 0; i < params.size() - 1; ++i)
@@ -116,15 +241,54 @@ public:
             }
         }
 
-        return std::make_shared<Env>(frame, this);
+        return std::make_shared<Env>(frame, shared_from_this());
+    }
+    // Procedure frame of frameSize slots, the parameters are the first slots, the internal definitions follow.
+    std::shared_ptr<Env> extend(size_t frameSize, Params const& parameters, std::vector<ExprPtr> const& arguments)
+    {
+        checkArguments(parameters, arguments);
+        std::vector<ExprPtr> slots(frameSize);
+        auto const& params = parameters.first; 
+        auto const variadic = parameters.second; 
+        if (!params.empty())
+        {
+            std::copy(arguments.begin(), arguments.begin() + static_cast<long>(params.size()) - 1, slots.begin());
+            if (variadic)
+            {
+                slots.at(params.size() - 1) = reverseVecToCons(arguments.rbegin(), arguments.rend() - static_cast<long>(params.size()) + 1);
+            }
+            else
+            {
+                slots.at(params.size() - 1) = arguments.back();
+            }
+        }
+        return std::make_shared<Env>(std::move(slots), shared_from_this());
     }
 };
 
 
-class Expr
+// Expression whose value is the value of the expression being evaluated (it is in tail position).
+struct TailCall
+{
+    ExprPtr expr;
+    std::shared_ptr<Env> env;
+};
+
+// Self-evaluating expressions return themselves. Deriving only Expr from enable_shared_from_this keeps
+// the hierarchy single inheritance, the dynamic_casts of the evaluator stay cheap.
+class Expr : public std::enable_shared_from_this<Expr>
 {
 public:
     virtual ExprPtr eval(std::shared_ptr<Env> const& env) = 0;
+    // Either returns the value of the expression, or leaves the expression in tail position to evaluate in tail.
+    virtual ExprPtr evalStep(std::shared_ptr<Env> const& env, TailCall& /* tail */)
+    {
+        return eval(env);
+    }
+    // Resolves the variables of the expression against scope, nullptr at the top level.
+    virtual void analyze(LexicalScope* /* scope */)
+    {
+    }
     virtual std::string toString() const = 0;
     virtual bool equalTo(ExprPtr const&) const
     {
@@ -133,6 +297,25 @@ public:
     virtual ~Expr() = default;
 };
 
+// Counts a nested evaluation for its lifetime, throws once the nesting exceeds maxEvalDepth().
+class EvalDepthGuard
+{
+public:
+    EvalDepthGuard();
+    ~EvalDepthGuard();
+    EvalDepthGuard(EvalDepthGuard const&) = delete;
+    EvalDepthGuard& operator=(EvalDepthGuard const&) = delete;
+};
+
+// Evaluates expr, looping over the expressions in tail position instead of recursing into them.
+ExprPtr evalTrampoline(Expr& expr, std::shared_ptr<Env> const& env);
+
+// The analysis pass, run on a parsed expression before evaluating it.
+ExprPtr analyze(ExprPtr const& expr);
+
+size_t maxEvalDepth();
+void setMaxEvalDepth(size_t depth);
+
 template <typename Value>
 class Literal : public Expr
 {
@@ -141,9 +324,10 @@ public:
     Literal(Value value)
     : mValue{value}
     {}
+    // Literals are immutable, they evaluate to themselves.
     ExprPtr eval(std::shared_ptr<Env> const& /* env */) override
     {
-        return ExprPtr{new Literal(mValue)};
+        return shared_from_this();
     }
     std::string toString() const override
     {
@@ -178,25 +362,38 @@ inline std::string Literal<std::string>::toString() const
 
 ExprPtr true_();
 ExprPtr false_();
+// Shared numbers for the small integers, a new one otherwise.
+ExprPtr number(double value);
+// List cells of the evaluator come from consPool(), the Cons and its shared_ptr control block in one cell.
+ExprPtr makeCons(ExprPtr const& car, ExprPtr const& cdr);
+CellPool& consPool();
 
 // For meta parser only
 class RawWord : public Expr
 {
-    std::string mInternal;
+    SymbolId mInternal;
 public:
-    explicit RawWord(std::string const& name)
+    explicit RawWord(SymbolId name)
     : mInternal{name}
     {
     }
+    explicit RawWord(std::string const& name)
+    : RawWord{intern(name)}
+    {
+    }
     ExprPtr eval(std::shared_ptr<Env> const& /* env */) override
     {
         FAIL_("RawWord should never be evaluated!");
     }
     std::string toString() const override
     {
-        return mInternal;
+        return symbolName(mInternal);
+    }
+    std::string const& get() const
+    {
+        return symbolName(mInternal);
     }
-    std::string get() const
+    SymbolId id() const
     {
         return mInternal;
     }
@@ -205,13 +402,13 @@ public:
         auto theOther = dynamic_cast<RawWord*>(other.get());
         if (theOther)
         {
-            return get() == theOther->get();
+            return id() == theOther->id();
         }
         return false;
     }
 };
 
-class Symbol final : public RawWord, public std::enable_shared_from_this<Symbol>
+class Symbol final : public RawWord
 {
 public:
     using RawWord::RawWord;
@@ -256,6 +453,10 @@ public:
     {
         return ExprPtr{new Splicing{mInternal->eval(env)}};
     }
+    void analyze(LexicalScope* scope) override
+    {
+        mInternal->analyze(scope);
+    }
     std::string toString() const override
     {
         return "(Splicing: " + mInternal->toString() + ")";
@@ -284,7 +485,19 @@ public:
             vec.push_back(mCdr->eval(env));
             return vecToCons(vec);
         }
-        return ExprPtr{new Cons{mCar->eval(env), mCdr->eval(env)}};
+        auto car = mCar->eval(env);
+        auto cdr = mCdr->eval(env);
+        // Quoted data evaluates to itself.
+        if (car == mCar && cdr == mCdr)
+        {
+            return shared_from_this();
+        }
+        return makeCons(car, cdr);
+    }
+    void analyze(LexicalScope* scope) override
+    {
+        mCar->analyze(scope);
+        mCdr->analyze(scope);
     }
     std::string toString() const override
     {
@@ -331,49 +544,90 @@ ExprPtr reverseVecToCons(Iter begin, Iter end)
     auto result = null();
     for (auto i = begin; i != end; ++i)
     {
-        result = ExprPtr{new Cons{*i, result}};
+        result = makeCons(*i, result);
     }
     return result;
 }
 
 class Variable final : public Expr
 {
-    std::string mName;
+    friend Analyzer;
+    SymbolId mName;
+    std::optional<LexicalAddress> mAddress;
 public:
-    Variable(std::string const& name)
+    explicit Variable(SymbolId name)
     : mName{name}
+    , mAddress{}
+    {}
+    explicit Variable(std::string const& name)
+    : Variable{intern(name)}
     {}
     ExprPtr eval(std::shared_ptr<Env> const& env) override
     {
+        if (mAddress)
+        {
+            return env->lookupVariableValue(*mAddress, mName);
+        }
         return env->lookupVariableValue(mName);
     }
-    std::string name() const
+    void analyze(LexicalScope* scope) override
+    {
+        if (scope)
+        {
+            mAddress = scope->lookup(mName);
+        }
+    }
+    SymbolId id() const
     {
         return mName;
     }
+    std::string const& name() const
+    {
+        return symbolName(mName);
+    }
     std::string toString() const override
     {
-        return mName;
+        return symbolName(mName);
     }
 };
 
 class Assignment final : public Expr
 {
-    std::string mVariableName;
+    friend Analyzer;
+    friend AstOptimizer;
+    SymbolId mVariableName;
     std::shared_ptr<Expr> mValue;
+    std::optional<LexicalAddress> mAddress;
 public:
-    Assignment(std::string const& varName, std::shared_ptr<Expr> value)
+    Assignment(SymbolId varName, std::shared_ptr<Expr> value)
     : mVariableName{varName}
     , mValue{value}
+    , mAddress{}
+    {
+    }
+    Assignment(std::string const& varName, std::shared_ptr<Expr> value)
+    : Assignment{intern(varName), value}
     {
     }
     ExprPtr eval(std::shared_ptr<Env> const& env) override
     {
+        if (mAddress)
+        {
+            return env->setVariableValue(*mAddress, mVariableName, mValue->eval(env));
+        }
         return env->setVariableValue(mVariableName, mValue->eval(env));
     }
+    void analyze(LexicalScope* scope) override
+    {
+        if (scope)
+        {
+            mAddress = scope->lookup(mVariableName);
+        }
+        mValue->analyze(scope);
+    }
     std::string toString() const override
     {
-        return "Assignment ( " + mVariableName + " : " + mValue->toString() + " )";
+        return "Assignment ( " + symbolName(mVariableName) + " : " + mValue->toString() + " )";
     }
 };
 
@@ -382,18 +636,42 @@ class Macro;
 class Definition final : public Expr
 {
     friend Compiler;
-    std::string mVariableName;
+    friend Analyzer;
+    friend AstOptimizer;
+    SymbolId mVariableName;
     ExprPtr mValue;
+    std::optional<size_t> mSlot;
 public:
-    Definition(std::string const& varName, std::shared_ptr<Expr> value)
+    Definition(SymbolId varName, std::shared_ptr<Expr> value)
     : mVariableName{varName}
     , mValue{value}
+    , mSlot{}
+    {
+    }
+    Definition(std::string const& varName, std::shared_ptr<Expr> value)
+    : Definition{intern(varName), value}
     {
     }
     ExprPtr eval(std::shared_ptr<Env> const& env) override;
+    void analyze(LexicalScope* scope) override
+    {
+        if (scope)
+        {
+            mSlot = scope->define(mVariableName);
+        }
+        mValue->analyze(scope);
+    }
+    SymbolId id() const
+    {
+        return mVariableName;
+    }
+    ExprPtr const& value() const
+    {
+        return mValue;
+    }
     std::string toString() const override
     {
-        return "Definition ( " + mVariableName + " : " + mValue->toString() + " )";
+        return "Definition ( " + symbolName(mVariableName) + " : " + mValue->toString() + " )";
     }
 };
 
@@ -407,6 +685,9 @@ inline bool isTrue(ExprPtr expr)
 class If final : public Expr
 {
     friend Compiler;
+    friend Analyzer;
+    friend AstOptimizer;
+    friend ImageWriter;
     ExprPtr mPredicate;
     ExprPtr mConsequent;
     ExprPtr mAlternative;
@@ -418,7 +699,18 @@ public:
     {}
     ExprPtr eval(std::shared_ptr<Env> const& env) override
     {
-        return isTrue(mPredicate->eval(env)) ? mConsequent->eval(env) : mAlternative->eval(env);
+        return evalTrampoline(*this, env);
+    }
+    ExprPtr evalStep(std::shared_ptr<Env> const& env, TailCall& tail) override
+    {
+        tail = {isTrue(mPredicate->eval(env)) ? mConsequent : mAlternative, env};
+        return {};
+    }
+    void analyze(LexicalScope* scope) override
+    {
+        mPredicate->analyze(scope);
+        mConsequent->analyze(scope);
+        mAlternative->analyze(scope);
     }
     std::string toString() const override
     {
@@ -429,18 +721,43 @@ public:
 class Sequence final : public Expr
 {
     friend Compiler;
+    friend Analyzer;
+    friend AstOptimizer;
     std::vector<ExprPtr> mActions;
 public:
     Sequence(std::vector<ExprPtr> actions)
     : mActions{actions}
     {}
     ExprPtr eval(std::shared_ptr<Env> const& env) override
+    {
+        return evalTrampoline(*this, env);
+    }
+    ExprPtr evalStep(std::shared_ptr<Env> const& env, TailCall& tail) override
     {
         for (size_t i = 0; i < mActions.size() - 1; i++)
         {
             mActions.at(i)->eval(env);
         }
-        return mActions.back()->eval(env);
+        tail = {mActions.back(), env};
+        return {};
+    }
+    void analyze(LexicalScope* scope) override
+    {
+        // Give the definitions their slots first, so that they can be referred to before them.
+        if (scope)
+        {
+            for (auto const& action : mActions)
+            {
+                if (auto definition = dynamic_cast<Definition const*>(action.get()))
+                {
+                    scope->define(definition->id());
+                }
+            }
+        }
+        for (auto const& action : mActions)
+        {
+            action->analyze(scope);
+        }
     }
     std::string toString() const override
     {
@@ -459,9 +776,12 @@ template <typename ProcedureT>
 class LambdaBase : public Expr
 {
     friend Compiler;
+    friend Analyzer;
+    friend AstOptimizer;
     Params mArguments;
     std::shared_ptr<Sequence> mBody;
     std::string mName{};
+    std::optional<size_t> mFrameSize{};
 public:
     LambdaBase(Params const& arguments, std::shared_ptr<Sequence> body)
     : mArguments{arguments}
@@ -475,7 +795,18 @@ public:
     }
     ExprPtr eval(std::shared_ptr<Env> const& env) override
     {
-        return std::shared_ptr<Expr>{new ProcedureT{mBody, mArguments, env}};
+        // Not reached by the analysis pass: the lambda is at the top level.
+        if (!mFrameSize)
+        {
+            analyze(nullptr);
+        }
+        return std::shared_ptr<Expr>{new ProcedureT{mBody, mArguments, *mFrameSize, env}};
+    }
+    void analyze(LexicalScope* scope) override
+    {
+        LexicalScope bodyScope{mArguments.first, scope};
+        mBody->analyze(&bodyScope);
+        mFrameSize = bodyScope.size();
     }
 };
 
@@ -536,7 +867,7 @@ public:
     {}
     ExprPtr eval(std::shared_ptr<Env> const& /* env */) override
     {
-        return ExprPtr{new PrimitiveProcedure{mImplementation}};
+        return shared_from_this();
     }
     std::shared_ptr<Expr> apply(std::vector<std::shared_ptr<Expr>> const& args) override
     {
@@ -548,16 +879,20 @@ public:
     }
 };
 
-class CompoundProcedureBase : public Procedure, public std::enable_shared_from_this<CompoundProcedureBase>
+class CompoundProcedureBase : public Procedure
 {
+protected:
     std::shared_ptr<Sequence> mBody;
     Params mArguments;
+    size_t mFrameSize;
     std::shared_ptr<Env> mEnvironment;
+private:
     virtual std::string getClassName() const = 0;
 public:
-    CompoundProcedureBase(std::shared_ptr<Sequence> body, Params const& parameters, std::shared_ptr<Env> const& environment)
+    CompoundProcedureBase(std::shared_ptr<Sequence> body, Params const& parameters, size_t frameSize, std::shared_ptr<Env> const& environment)
     : mBody{body}
     , mArguments{parameters}
+    , mFrameSize{frameSize}
     , mEnvironment{environment}
     {}
     ExprPtr eval(std::shared_ptr<Env> const& /* env */) override
@@ -566,7 +901,12 @@ public:
     }
     std::shared_ptr<Expr> apply(std::vector<std::shared_ptr<Expr>> const& args) override
     {
-        return mBody->eval(mEnvironment->extend(mArguments, args));
+        return mBody->eval(mEnvironment->extend(mFrameSize, mArguments, args));
+    }
+    // The body to evaluate in tail position in place of apply.
+    TailCall tailApply(std::vector<std::shared_ptr<Expr>> const& args)
+    {
+        return {mBody, mEnvironment->extend(mFrameSize, mArguments, args)};
     }
     std::string toString() const override
     {
@@ -578,7 +918,7 @@ public:
             {
                 for (auto i = params.begin(); i != std::prev(params.end()); ++i)
                 {
-                    o << *i << " ";
+                    o << symbolName(*i) << " ";
                 }
                 if (variadic)
                 {
@@ -586,7 +926,7 @@ public:
                 }
                 if (params.size() >= 1)
                 {
-                    o << params.back();
+                    o << symbolName(params.back());
                 }
                 o << ", ";
             }
@@ -606,18 +946,38 @@ public:
     using CompoundProcedureBase::CompoundProcedureBase;
 };
 
+// Applies func to the atoms of expr, the lists left unchanged are shared with expr.
 template <typename Func>
 ExprPtr transform(ExprPtr const& expr, Func func)
 {
     if (auto e = dynamic_cast<Cons const*>(expr.get()))
     {
-        return ExprPtr{new Cons{transform(e->car(), func), transform(e->cdr(), func)}};
+        auto car = transform(e->car(), func);
+        auto cdr = transform(e->cdr(), func);
+        if (car == e->car() && cdr == e->cdr())
+        {
+            return expr;
+        }
+        return makeCons(car, cdr);
     }
     return func(expr);
 }
 
+// Structural hash and equality of forms: lists by their elements, atoms by type and value, other expressions by
+// identity. Numbers compare by their bits, so that 0 and -0 are different forms.
+size_t formHash(ExprPtr const& expr);
+bool sameForm(ExprPtr const& lhs, ExprPtr const& rhs);
+
 class MacroProcedure final : public CompoundProcedureBase
 {
+    // Macros are expected to be pure functions of their forms: expansions are memoized by the structural hash of the
+    // (expanded) arguments, and shared by the calls with the same forms.
+    struct Expansion
+    {
+        std::vector<ExprPtr> args;
+        ExprPtr result;
+    };
+    std::unordered_multimap<size_t, Expansion> mExpansions;
     std::string getClassName() const override
     {
         return "MacroProcedure";
@@ -625,11 +985,18 @@ class MacroProcedure final : public CompoundProcedureBase
 public:
     using CompoundProcedureBase::CompoundProcedureBase;
     ExprPtr apply(std::vector<std::shared_ptr<Expr> > const &args) override;
+    size_t nbExpansions() const
+    {
+        return mExpansions.size();
+    }
 };
 
 class Application final : public Expr
 {
     friend Compiler;
+    friend Analyzer;
+    friend AstOptimizer;
+    friend ImageWriter;
     ExprPtr mOperator;
     std::vector<ExprPtr> mOperands;
 public:
@@ -638,12 +1005,29 @@ public:
     , mOperands{params}
     {}
     ExprPtr eval(std::shared_ptr<Env> const& env) override
+    {
+        return evalTrampoline(*this, env);
+    }
+    ExprPtr evalStep(std::shared_ptr<Env> const& env, TailCall& tail) override
     {
         auto op = mOperator->eval(env);
         auto isMacroCall = dynamic_cast<MacroProcedure const*>(op.get());
         auto args = listOfValues(mOperands, env, isMacroCall);
+        if (auto compoundProc = dynamic_cast<CompoundProcedure*>(op.get()))
+        {
+            tail = compoundProc->tailApply(args);
+            return {};
+        }
         return dynamic_cast<Procedure&>(*op).apply(args);
     }
+    void analyze(LexicalScope* scope) override
+    {
+        mOperator->analyze(scope);
+        for (auto const& operand : mOperands)
+        {
+            operand->analyze(scope);
+        }
+    }
     std::string toString() const override
     {
         std::ostringstream o;
@@ -0,0 +1,86 @@
+#ifndef LISP_EXECUTOR_H
+#define LISP_EXECUTOR_H
+
+#include "evaluator.h"
+
+// The analyze-then-execute evaluator: a parsed and analyzed Expr is turned once into a tree of executors
+// specialized on its syntax, running them again does no syntactic dispatch.
+
+class Executor;
+using ExecutorPtr = std::shared_ptr<Executor const>;
+
+// Executor whose value is the value of the executor being run (it is in tail position).
+struct ExecutorTailCall
+{
+    ExecutorPtr executor;
+    std::shared_ptr<Env> env;
+};
+
+class Executor
+{
+public:
+    virtual ExprPtr execute(std::shared_ptr<Env> const& env) const = 0;
+    // Either returns the value, or leaves the executor in tail position to run in tail.
+    virtual ExprPtr executeStep(std::shared_ptr<Env> const& env, ExecutorTailCall& /* tail */) const
+    {
+        return execute(env);
+    }
+    virtual ~Executor() = default;
+};
+
+// Runs executor, looping over the executors in tail position instead of recursing into them.
+ExprPtr executeTrampoline(Executor const& executor, std::shared_ptr<Env> const& env);
+
+class Analyzer
+{
+public:
+    static ExecutorPtr analyze(ExprPtr const& expr);
+};
+
+// Runs the analysis pass on expr and builds its executor.
+ExecutorPtr makeExecutor(ExprPtr const& expr);
+
+// The procedure of an analyzed lambda, its body runs as an executor.
+class ExecutorProcedure final : public CompoundProcedureBase
+{
+    ExecutorPtr mExecutor;
+    std::string getClassName() const override
+    {
+        return "CompoundProcedure";
+    }
+public:
+    ExecutorProcedure(std::shared_ptr<Sequence> body, Params const& parameters, size_t frameSize, std::shared_ptr<Env> const& environment, ExecutorPtr executor)
+    : CompoundProcedureBase{body, parameters, frameSize, environment}
+    , mExecutor{std::move(executor)}
+    {}
+    std::shared_ptr<Expr> apply(std::vector<std::shared_ptr<Expr>> const& args) override
+    {
+        return executeTrampoline(*mExecutor, frame(args));
+    }
+    std::shared_ptr<Env> frame(std::vector<std::shared_ptr<Expr>> const& args) const
+    {
+        return mEnvironment->extend(mFrameSize, mArguments, args);
+    }
+    ExecutorPtr const& executor() const
+    {
+        return mExecutor;
+    }
+    size_t nbParams() const
+    {
+        return mArguments.first.size();
+    }
+    bool variadic() const
+    {
+        return mArguments.second;
+    }
+    size_t frameSize() const
+    {
+        return mFrameSize;
+    }
+    std::shared_ptr<Env> const& environment() const
+    {
+        return mEnvironment;
+    }
+};
+
+#endif // LISP_EXECUTOR_H
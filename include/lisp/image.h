@@ -0,0 +1,31 @@
+#ifndef LISP_IMAGE_H
+#define LISP_IMAGE_H
+
+#include "bytecode.h"
+#include "compiler.h"
+#include <optional>
+#include <string>
+#include <string_view>
+
+// A form of the prelude (core.lisp) as the samples replay it: a macro definition as read, expanding it defines
+// the macro, any other form with its macros expanded, to parse and evaluate.
+struct PreludeForm
+{
+    ExprPtr expr;
+    bool macroDefinition;
+};
+
+// Snapshot of the prelude processed by the compile sample, for the samples to start without lexing, expanding and
+// compiling it again: its forms, to rebuild the environments of the interpreter, and the state of the compiler after
+// compiling them (globals, code, constants and inline candidates).
+// An image only matches the source it was written from and the op codes of the build that wrote it, the rest of it is
+// checked against a checksum in its header.
+std::string writeImage(std::vector<PreludeForm> const& forms, Compiler const& compiler, std::string_view source);
+
+// The forms of image, empty when it does not match source. When compiler is given, a new one, it is restored too and
+// the image must also have been written with its options. Throws on a corrupt image, one that does not match its
+// checksum.
+std::optional<std::vector<PreludeForm>> readImage(std::string_view image, std::string_view source,
+                                                  Compiler* compiler = nullptr);
+
+#endif // LISP_IMAGE_H
@@ -0,0 +1,56 @@
+#ifndef LISP_INTERN_H
+#define LISP_INTERN_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+// Interned names: equal names share one small integer id, compared without looking at the characters.
+using SymbolId = uint32_t;
+
+class InternTable
+{
+    std::unordered_map<std::string, SymbolId> mNameToId{};
+    // A deque keeps the names in place while the table grows.
+    std::deque<std::string> mNames{};
+public:
+    SymbolId intern(std::string const& name)
+    {
+        auto iter = mNameToId.find(name);
+        if (iter != mNameToId.end())
+        {
+            return iter->second;
+        }
+        auto const id = static_cast<SymbolId>(mNames.size());
+        mNames.push_back(name);
+        mNameToId.emplace(name, id);
+        return id;
+    }
+    std::string const& name(SymbolId id) const
+    {
+        return mNames.at(id);
+    }
+    size_t size() const
+    {
+        return mNames.size();
+    }
+};
+
+inline InternTable& internTable()
+{
+    static InternTable table;
+    return table;
+}
+
+inline SymbolId intern(std::string const& name)
+{
+    return internTable().intern(name);
+}
+
+inline std::string const& symbolName(SymbolId id)
+{
+    return internTable().name(id);
+}
+
+#endif // LISP_INTERN_H
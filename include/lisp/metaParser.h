@@ -54,7 +54,7 @@ public:
         if (isdigit(c) || (str.size() > 1 && c == '-'))
         {
             double num = std::stod(str);
-            return ExprPtr{new Number(num)};
+            return number(num);
         }
         if (c == '"')
         {
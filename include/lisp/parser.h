@@ -6,9 +6,11 @@
 #include "lisp/evaluator.h"
 #include "lisp/lexer.h"
 #include "lisp/metaParser.h"
+#include "lisp/intern.h"
 #include <cctype>
 #include <optional>
 #include <functional>
+#include <unordered_map>
 
 inline auto parse(ExprPtr const& expr) -> ExprPtr;
 
@@ -29,23 +31,23 @@ inline auto tryDeCons(ExprPtr const& expr) -> std::optional<std::pair<ExprPtr, E
     return {};
 }
 
-inline std::optional<std::string> asString(ExprPtr const& expr)
+inline std::optional<SymbolId> asSymbolId(ExprPtr const& expr)
 {
     auto atomic = dynamic_cast<RawWord*>(expr.get());
     if (atomic)
     {
-        return atomic->toString();
+        return atomic->id();
     }
     return {};
 }
 
 inline Params parseParams(ExprPtr const& expr)
 {
-    std::vector<std::string> params;
+    std::vector<SymbolId> params;
     auto me = expr;
     if (auto e = dynamic_cast<RawWord*>(me.get()))
     {
-        params.push_back(e->get());
+        params.push_back(e->id());
         return std::make_pair(params, true);
     }
     while (me != null())
@@ -53,14 +55,14 @@ inline Params parseParams(ExprPtr const& expr)
         auto cons = dynamic_cast<Cons*>(me.get());
         if (!cons)
         {
-            auto opStr = asString(me);
-            ASSERT(opStr.has_value());
-            params.push_back(opStr.value());
+            auto opId = asSymbolId(me);
+            ASSERT(opId.has_value());
+            params.push_back(opId.value());
             return std::make_pair(params, true);
         }
-        auto opStr = asString(cons->car());
-        ASSERT(opStr.has_value());
-        params.push_back(opStr.value());
+        auto opId = asSymbolId(cons->car());
+        ASSERT(opId.has_value());
+        params.push_back(opId.value());
         me = cons->cdr();
     }
     return std::make_pair(params, false);
@@ -118,26 +120,26 @@ inline ExprPtr quasiquote(ExprPtr const& expr)
 inline ExprPtr definition(ExprPtr const& expr)
 {
     auto [car, cdr] = deCons(expr);
-    auto opStr = asString(car);
-    if (!opStr.has_value())
+    auto opId = asSymbolId(car);
+    if (!opId.has_value())
     {
         auto [carA, carD] = deCons(car);
-        auto opStr = asString(carA);
-        ASSERT(opStr.has_value());
+        auto opId = asSymbolId(carA);
+        ASSERT(opId.has_value());
         auto params = parseParams(carD);
         auto body = sequence(cdr);
         auto proc = ExprPtr{new Lambda(params, body)};
-        return ExprPtr{new Definition(opStr.value(), proc)};
+        return ExprPtr{new Definition(opId.value(), proc)};
     }
     // normal definition
     auto value = parse(listBack(cdr));
-    return ExprPtr{new Definition(opStr.value(), value)};
+    return ExprPtr{new Definition(opId.value(), value)};
 }
 
 inline ExprPtr assignment(ExprPtr const& expr)
 {
     auto [car, cdr] = deCons(expr);
-    auto var = asString(car).value();
+    auto var = asSymbolId(car).value();
     auto value = parse(listBack(cdr));
     return ExprPtr{new Assignment(var, value)};
 }
@@ -176,8 +178,9 @@ inline std::pair<ExprPtr, ExprPtr> parseCondClauses(ExprPtr const& expr, bool& h
     auto [car, cdr] = deCons(expr);
     
     ExprPtr pred;
-    auto opStr = asString(car);
-    if (opStr && opStr.value() == "else")
+    static auto const elseId = intern("else");
+    auto opId = asSymbolId(car);
+    if (opId && opId.value() == elseId)
     {
         pred = true_();
         hasNext = false;
@@ -197,37 +200,44 @@ inline ExprPtr application(ExprPtr const& car, ExprPtr const& cdr)
     return ExprPtr{new Application(op, params)};
 }
 
-inline ExprPtr tryMacroApplication(ExprPtr const& expr, std::shared_ptr<Env> const& env)
-{
-    auto cons = dynamic_cast<Cons*>(expr.get());
-    ASSERT(cons);
-    auto car = cons->car();
-    auto cdr = cons->cdr();
-    auto op = parse(car);
-    auto evaledOp = op->eval(env);
-    if (dynamic_cast<MacroProcedure const*>(evaledOp.get()))
-    {
-        std::vector<ExprPtr> params = consToVec(cdr);
-        auto result = Application(evaledOp, params).eval(env);
-        return result;
-    }
-    return expr;
-}
-
 inline ExprPtr application(ExprPtr const& expr)
 {
     auto [car, cdr] = deCons(expr);
     return application(car, cdr);
 }
 
-inline auto parseCons(std::string const& car, ExprPtr const& cdr, std::map<std::string, std::function<ExprPtr(ExprPtr)>> const& keywordToHandler) -> ExprPtr
+using SpecialFormHandler = std::function<ExprPtr(ExprPtr const&)>;
+
+// The special forms by keyword, built once. A handler parses the cdr of the form.
+inline auto& specialForms()
 {
-    auto iter = keywordToHandler.find(car);
-    if (iter != keywordToHandler.end())
+    static std::unordered_map<SymbolId, SpecialFormHandler> forms = []
     {
-        return iter->second(cdr);
-    }
-    return keywordToHandler.at("_")(cdr);
+        std::unordered_map<SymbolId, SpecialFormHandler> keywordToHandler;
+        keywordToHandler[intern("define")] = definition;
+        keywordToHandler[intern("set!")] = assignment;
+        keywordToHandler[intern("lambda")] = lambda;
+        keywordToHandler[intern("macro")] = macro;
+        keywordToHandler[intern("if")] = if_;
+        keywordToHandler[intern("begin")] = [](ExprPtr const& cdr){ return std::static_pointer_cast<Expr>(sequence(cdr));};
+        keywordToHandler[intern("quote")] = quote;
+        keywordToHandler[intern("quasiquote")] = quasiquote;
+        return keywordToHandler;
+    }();
+    return forms;
+}
+
+// Adds a special form, or replaces the handler of an existing one.
+inline void registerSpecialForm(std::string const& keyword, SpecialFormHandler handler)
+{
+    specialForms()[intern(keyword)] = std::move(handler);
+}
+
+inline SpecialFormHandler const* specialFormHandler(SymbolId keyword)
+{
+    auto const& forms = specialForms();
+    auto iter = forms.find(keyword);
+    return iter == forms.end() ? nullptr : &iter->second;
 }
 
 inline auto tryCons(ExprPtr const& expr) -> ExprPtr
@@ -239,23 +249,17 @@ inline auto tryCons(ExprPtr const& expr) -> ExprPtr
     }
     auto car = cons->car();
     auto cdr = cons->cdr();
-    auto carStr = asString(car);
-    if (!carStr.has_value())
+    auto carId = asSymbolId(car);
+    if (!carId.has_value())
     {
         // car as Cons
         return application(car, cdr);
     }
-    std::map<std::string, std::function<ExprPtr(ExprPtr)>> keywordToHandler;
-    keywordToHandler["define"] = definition;
-    keywordToHandler["set!"] = assignment;
-    keywordToHandler["lambda"] = lambda;
-    keywordToHandler["macro"] = macro;
-    keywordToHandler["if"] = if_;
-    keywordToHandler["begin"] = [](auto cdr){ return std::static_pointer_cast<Expr>(sequence(cdr));};
-    keywordToHandler["quote"] = quote;
-    keywordToHandler["quasiquote"] = quasiquote;
-    keywordToHandler["_"] = [car](auto cdr){ return application(car, cdr); };
-    return parseCons(carStr.value(), cdr, keywordToHandler);
+    if (auto handler = specialFormHandler(carId.value()))
+    {
+        return (*handler)(cdr);
+    }
+    return application(car, cdr);
 }
 
 inline auto tryParseMacroDefinitionBody(ExprPtr const& expr) -> ExprPtr
@@ -267,30 +271,32 @@ inline auto tryParseMacroDefinitionBody(ExprPtr const& expr) -> ExprPtr
     }
     auto car = cons->car();
     auto cdr = cons->cdr();
-    auto carStr = asString(car);
-    if (!carStr.has_value())
+    auto carId = asSymbolId(car);
+    if (!carId.has_value())
     {
         // do nothing
         return {};
     }
-    std::map<std::string, std::function<ExprPtr(ExprPtr)>> keywordToHandler;
-    keywordToHandler["macro"] = macro;
-    keywordToHandler["_"] = [expr](auto){ return ExprPtr{}; };
-    return parseCons(carStr.value(), cdr, keywordToHandler);
+    static auto const macroId = intern("macro");
+    if (carId.value() == macroId)
+    {
+        return macro(cdr);
+    }
+    return {};
 }
 
 inline ExprPtr macroDefinition(ExprPtr const& expr)
 {
     auto [car, cdr] = deCons(expr);
-    auto opStr = asString(car);
-    if (!opStr)
+    auto opId = asSymbolId(car);
+    if (!opId)
     {
         return {};
     }
     // normal definition
     if (auto value = tryParseMacroDefinitionBody(listBack(cdr)))
     {
-        return ExprPtr{new Definition(opStr.value(), value)};
+        return ExprPtr{new Definition(opId.value(), value)};
     }
     return {};
 }
@@ -304,16 +310,18 @@ inline auto parseMacroDefinition(ExprPtr const& expr) -> ExprPtr
     }
     auto car = cons->car();
     auto cdr = cons->cdr();
-    auto carStr = asString(car);
-    if (!carStr.has_value())
+    auto carId = asSymbolId(car);
+    if (!carId.has_value())
     {
         // do nothing
         return {};
     }
-    std::map<std::string, std::function<ExprPtr(ExprPtr)>> keywordToHandler;
-    keywordToHandler["define"] = macroDefinition;
-    keywordToHandler["_"] = [expr](auto){ return ExprPtr{}; };
-    return parseCons(carStr.value(), cdr, keywordToHandler);
+    static auto const defineId = intern("define");
+    if (carId.value() == defineId)
+    {
+        return macroDefinition(cdr);
+    }
+    return {};
 }
 
 inline auto tryMacroCall(ExprPtr const& expr, std::shared_ptr<Env> const& env) -> ExprPtr
@@ -325,15 +333,20 @@ inline auto tryMacroCall(ExprPtr const& expr, std::shared_ptr<Env> const& env) -
     }
     auto car = cons->car();
     auto cdr = cons->cdr();
-    auto carStr = asString(car);
-    if (!carStr.has_value())
+    auto carId = asSymbolId(car);
+    if (!carId.has_value())
     {
         // do nothing
         return expr;
     }
-    if (env->variableDefined(carStr.value()))
+    // The head is looked up in the frame of env, without parsing and evaluating it.
+    if (env->variableDefined(carId.value()))
     {
-        return tryMacroApplication(expr, env);
+        auto const op = env->lookupVariableValue(carId.value());
+        if (auto macro = dynamic_cast<MacroProcedure*>(op.get()))
+        {
+            return macro->apply(listOfValues(consToVec(cdr), env, true));
+        }
     }
     return expr;
 }
@@ -346,7 +359,7 @@ inline auto parse(ExprPtr const& expr) -> ExprPtr
     }
     if (auto e = dynamic_cast<RawWord const*>(expr.get()))
     {
-        return ExprPtr{new Variable{e->toString()}};
+        return ExprPtr{new Variable{e->id()}};
     }
     return expr;
 }
@@ -355,7 +368,7 @@ inline auto atomicToQuoted(ExprPtr const& expr)
 {
     if (auto word = dynamic_cast<RawWord const*>(expr.get()))
     {
-        return ExprPtr{new Symbol{word->get()}};
+        return ExprPtr{new Symbol{word->id()}};
     }
     if (dynamic_cast<Variable const*>(expr.get()))
     {
@@ -383,15 +396,18 @@ inline auto consToQuoted(ExprPtr const& expr, std::optional<int32_t> quasiquoteL
     ASSERT(cons);
     auto car = cons->car();
     auto cdr = cons->cdr();
-    auto carStr = car->toString();
-    if (quasiquoteLevel)
+    static auto const unquoteId = intern("unquote");
+    static auto const unquoteSplicingId = intern("unquote-splicing");
+    static auto const quasiquoteId = intern("quasiquote");
+    auto carId = asSymbolId(car);
+    if (quasiquoteLevel && carId)
     {
-        if (carStr == "unquote" || carStr == "unquote-splicing")
+        if (carId == unquoteId || carId == unquoteSplicingId)
         {
             if ( quasiquoteLevel.value() == 1)
             {
                 auto result = unquote(cdr);
-                if (carStr == "unquote")
+                if (carId == unquoteId)
                 {
                     return result;
                 }
@@ -399,12 +415,12 @@ inline auto consToQuoted(ExprPtr const& expr, std::optional<int32_t> quasiquoteL
             }
             --(*quasiquoteLevel);
         }
-        else if (carStr == "quasiquote")
+        else if (carId == quasiquoteId)
         {
             ++(*quasiquoteLevel);
         }
     }
-    return ExprPtr{new Cons{parseAsQuoted(car, quasiquoteLevel), consToQuoted(cdr, quasiquoteLevel)}};
+    return makeCons(parseAsQuoted(car, quasiquoteLevel), consToQuoted(cdr, quasiquoteLevel));
 }
 
 inline auto parseAsQuoted(ExprPtr const& expr, std::optional<int32_t> quasiquoteLevel) -> ExprPtr
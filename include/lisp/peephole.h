@@ -0,0 +1,40 @@
+#ifndef LISP_PEEPHOLE_H
+#define LISP_PEEPHOLE_H
+
+#include "vm.h"
+#include <ostream>
+
+namespace vm
+{
+// What each pass of the peephole optimizer rewrote, summed over the code it ran on.
+struct PeepholeStats
+{
+    // kICONST or kCONST followed by kMINUS, replaced with the negated constant.
+    size_t constantsFolded{};
+    // Jumps to a kJUMP retargeted to its target, or replaced with the kRET they jump to.
+    size_t jumpsThreaded{};
+    // kNOT before a conditional jump, or a conditional jump over a kJUMP, replaced with the opposite jump.
+    size_t branchesInverted{};
+    // Jumps to the next instruction.
+    size_t jumpsRemoved{};
+    // Instructions no path reaches.
+    size_t deadInstructions{};
+    // kGET_LOCAL n followed by kSET_LOCAL n, and the same on globals.
+    size_t loadStoresRemoved{};
+    size_t bytesBefore{};
+    size_t bytesAfter{};
+    PeepholeStats& operator+=(PeepholeStats const& other);
+};
+
+std::ostream& operator<<(std::ostream& o, PeepholeStats const& stats);
+
+// Rewrites the instructions of a function, or of the top level code, into shorter equivalent ones.
+// Negated constants that are not fixnums are added to constantPool, unless it already holds them.
+void optimize(Instructions& instructions, std::vector<Object>& constantPool, PeepholeStats& stats);
+
+// Replaces common sequences of instructions with the superinstructions running them in one dispatch,
+// returns how many were selected. Runs after optimize, which does not know about superinstructions.
+size_t selectSuperinstructions(Instructions& instructions);
+} // namespace vm
+
+#endif // LISP_PEEPHOLE_H
@@ -1,102 +1,183 @@
 #ifndef LISP_VM_H
 #define LISP_VM_H
 
+#include <array>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <vector>
-#include <stack>
+#include <algorithm>
 #include <string>
-#include <variant>
 #include <memory>
+#include <optional>
+#include <ostream>
+#include <type_traits>
 #include "meta.h"
+#include "intern.h"
+#include "cellPool.h"
 
 namespace vm
 {
 using Byte = uint8_t;
 
+// X-macro over every op code, so that the enum and the dispatch tables in vm.cpp stay in sync.
+#define LISP_VM_OP_CODES(X) \
+    X(kICONST) \
+    X(kIADD) \
+    X(kADD) \
+    X(kSUB) \
+    X(kMUL) \
+    X(kDIV) \
+    X(kCONST) \
+    X(kHALT) \
+    X(kPRINT) \
+    X(kCALL) \
+    X(kRET) \
+    X(kGET_LOCAL) \
+    X(kSET_LOCAL) \
+    X(kSET_GLOBAL) \
+    X(kGET_GLOBAL) \
+    X(kGET_FREE) \
+    X(kTRUE) \
+    X(kFALSE) \
+    X(kNULL) \
+    X(kEQUAL) \
+    X(kLESS_THAN) \
+    X(kNOT) \
+    X(kMINUS) \
+    X(kJUMP) \
+    X(kJUMP_IF_NOT_TRUE) \
+    X(kPOP) \
+    X(kCONS) \
+    X(kCAR) \
+    X(kCDR) \
+    X(kCURRENT_FUNCTION) \
+    X(kCLOSURE) \
+    X(kIS_CONS) \
+    X(kIS_NULL) \
+    X(kERROR) \
+    X(kMOD) \
+    X(kSPLICING) \
+    X(kTAIL_CALL) \
+    X(kJUMP_IF_TRUE) \
+    X(kAPPEND) \
+    LISP_VM_SUPERINSTRUCTIONS(X)
+
+// Superinstructions: each runs a common sequence of the op codes above in one dispatch.
+// The compiler selects them after generating the code (see selectSuperinstructions).
+#define LISP_VM_SUPERINSTRUCTIONS(X) \
+    /* kGET_LOCAL n; kCAR */ \
+    X(kGET_LOCAL_CAR) \
+    /* kGET_LOCAL n; kCDR */ \
+    X(kGET_LOCAL_CDR) \
+    /* kGET_LOCAL n; kIS_NULL; kJUMP_IF_NOT_TRUE target, operands: target n */ \
+    X(kJUMP_IF_LOCAL_NOT_NULL) \
+    /* kICONST i; kADD */ \
+    X(kADD_ICONST) \
+    /* kICONST i; kSUB */ \
+    X(kSUB_ICONST) \
+    /* kGET_GLOBAL n; kCALL nbArgs, operands: n nbArgs */ \
+    X(kGET_GLOBAL_CALL) \
+    X(kGET_GLOBAL_TAIL_CALL) \
+    /* kCURRENT_FUNCTION; kCALL nbArgs */ \
+    X(kCURRENT_FUNCTION_CALL) \
+    X(kCURRENT_FUNCTION_TAIL_CALL)
+
 enum OpCode : Byte
 {
-    kICONST,
-    kIADD,
-    kADD,
-    kSUB,
-    kMUL,
-    kDIV,
-    kCONST,
-    kHALT,
-    kPRINT,
-    kCALL,
-    kRET,
-    kGET_LOCAL,
-    kSET_LOCAL,
-    kSET_GLOBAL,
-    kGET_GLOBAL,
-    kGET_FREE,
-    kTRUE,
-    kFALSE,
-    kNULL,
-    kEQUAL,
-    kLESS_THAN,
-    kNOT,
-    kMINUS,
-    kJUMP,
-    kJUMP_IF_NOT_TRUE,
-    kPOP,
-    kCONS,
-    kCAR,
-    kCDR,
-    kCURRENT_FUNCTION,
-    kCLOSURE,
-    kIS_CONS,
-    kIS_NULL,
-    kERROR,
-    kMOD,
-    kSPLICING,
+#define LISP_VM_OP_CODE_ENUM(op) op,
+    LISP_VM_OP_CODES(LISP_VM_OP_CODE_ENUM)
+#undef LISP_VM_OP_CODE_ENUM
 };
 
+#define LISP_VM_COUNT_OP_CODE(op) + 1
+inline constexpr size_t kNbOpCodes = 0 LISP_VM_OP_CODES(LISP_VM_COUNT_OP_CODE);
+#undef LISP_VM_COUNT_OP_CODE
+
+// Compact form of the code, as emitted by the compiler: operands are 4-byte big-endian integers.
 using Instructions = std::vector<Byte>;
 
-class FunctionSymbol
+// Form of the code the VM runs, decoded once by link: the op code and each operand take one native word,
+// jump targets are word offsets.
+using Word = uint32_t;
+using LinkedInstructions = std::vector<Word>;
+
+char const* opCodeName(Byte opCode);
+
+// Op codes dispatched by VM::runProfiled, and pairs of op codes dispatched one after the other: the frequent pairs
+// are the candidates for superinstructions.
+class OpCodeProfile
 {
-    std::string mName{};
-    size_t mNbArgs{};
-    bool mVariadic{};
-    size_t mNbLocals{};
-    Instructions mInstructions{};
+    size_t mDispatches{};
+    std::array<size_t, kNbOpCodes> mCounts{};
+    std::array<std::array<size_t, kNbOpCodes>, kNbOpCodes> mPairs{};
+    size_t mPrevious{kNbOpCodes};
 public:
-    FunctionSymbol(std::string const& name, size_t nbArgs, bool variadic, size_t nbLocals, Instructions const& instructions)
-    : mName{name}
-    , mNbArgs{nbArgs}
-    , mVariadic{variadic}
-    , mNbLocals{nbLocals}
-    , mInstructions{instructions}
-    {}
-    std::string name() const
-    {
-        return mName;
-    }
-    size_t nbArgs() const
+    void record(Byte opCode);
+    size_t dispatches() const
     {
-        return mNbArgs;
+        return mDispatches;
     }
-    auto variadic() const
+    size_t count(Byte opCode) const
     {
-        return mVariadic;
+        return mCounts.at(opCode);
     }
-    size_t nbLocals() const
-    {
-        return mNbLocals;
-    }
-    auto const& instructions() const
+    // Pairs dispatched at least once, the most frequent first.
+    std::vector<std::pair<std::pair<Byte, Byte>, size_t>> pairs() const;
+};
+
+// The total and the most frequent pairs.
+std::ostream& operator<<(std::ostream& o, OpCodeProfile const& profile);
+
+// Number of 4-byte operands following the op code.
+size_t nbOperands(Byte opCode);
+// Whether the first operand of the op code is a jump target.
+bool isJump(Byte opCode);
+LinkedInstructions link(Instructions const& instructions);
+
+enum class HeapKind : uint8_t
+{
+    kSTRING,
+    kFUNCTION,
+    kCLOSURE,
+    kCONS,
+    kSPLICING,
+    kBUILTIN,
+};
+
+// Common header of everything an Object can point to.
+// Heap objects are owned by the Heap that allocated them, Objects pointing to them do not own anything.
+class HeapObject
+{
+    friend class Heap;
+    HeapKind mKind;
+    mutable bool mMarked{};
+    // Pinned objects are never collected, they live as long as their heap (constants of a ByteCode).
+    bool mPinned{};
+    // Next object allocated on the same heap.
+    HeapObject* mNext{};
+protected:
+    explicit HeapObject(HeapKind kind)
+    : mKind{kind}
+    {}
+public:
+    HeapObject(HeapObject const&) = delete;
+    HeapObject& operator=(HeapObject const&) = delete;
+    virtual ~HeapObject() = default;
+    auto kind() const
     {
-        return mInstructions;
+        return mKind;
     }
+    // Bytes used by the object, counted by the heap for its statistics and collection threshold.
+    virtual size_t footprint() const = 0;
 };
 
 class Closure;
-using ClosurePtr = std::shared_ptr<Closure>;
+using ClosurePtr = Closure*;
 
 class VMCons;
-using ConsPtr = std::shared_ptr<VMCons>;
+using ConsPtr = VMCons*;
 
 
 class VMNull
@@ -104,6 +185,7 @@ class VMNull
 
 inline constexpr VMNull vmNull{};
 
+// The types below describe the values an Object can hold, they are used to construct Objects and to get values back.
 template <typename T>
 class Literal
 {
@@ -116,10 +198,11 @@ using Int = Literal<int32_t>;
 using Double = Literal<double>;
 using String = Literal<std::string>;
 
+// Symbols are interned names, held by the Object itself: eq? on symbols compares two ids.
 class Symbol
 {
 public:
-    std::string value;
+    SymbolId value;
 };
 
 class Splicing
@@ -128,35 +211,247 @@ public:
     ConsPtr value;
 };
 
-using Object = std::variant<Bool, Int, Double, String, Symbol, FunctionSymbol, ClosurePtr, ConsPtr, VMNull, Splicing>;
+class StringObject final : public HeapObject
+{
+public:
+    static constexpr auto kKind = HeapKind::kSTRING;
+    std::string const value;
+    explicit StringObject(std::string str)
+    : HeapObject{kKind}
+    , value{std::move(str)}
+    {}
+    size_t footprint() const override
+    {
+        return sizeof(*this) + value.capacity();
+    }
+};
+
+// NaN-boxed value, 8 bytes, copied as is.
+// Doubles are stored as is (NaNs are canonicalized), the other values live in the unused negative quiet NaN space:
+// the upper 16 bits hold the tag and the lower 48 bits the payload (an int32, a bool, a SymbolId or a HeapObject pointer).
+class Object
+{
+    uint64_t mBits;
+
+    static constexpr uint64_t kTagMask = 0xFFFF'0000'0000'0000ULL;
+    static constexpr uint64_t kPayloadMask = ~kTagMask;
+    static constexpr uint64_t kCanonicalNaN = 0x7FF8'0000'0000'0000ULL;
+    static constexpr uint64_t kIntTag = 0xFFF9'0000'0000'0000ULL;
+    static constexpr uint64_t kBoolTag = 0xFFFA'0000'0000'0000ULL;
+    static constexpr uint64_t kNullTag = 0xFFFB'0000'0000'0000ULL;
+    static constexpr uint64_t kHeapTag = 0xFFFC'0000'0000'0000ULL;
+    static constexpr uint64_t kSymbolTag = 0xFFFD'0000'0000'0000ULL;
+
+public:
+    Object()
+    : mBits{kNullTag}
+    {}
+    Object(VMNull)
+    : Object{}
+    {}
+    Object(Bool b)
+    : mBits{kBoolTag | static_cast<uint64_t>(b.value)}
+    {}
+    Object(Int i)
+    : mBits{kIntTag | static_cast<uint32_t>(i.value)}
+    {}
+    Object(Double d)
+    : mBits{}
+    {
+        if (std::isnan(d.value))
+        {
+            mBits = kCanonicalNaN;
+        }
+        else
+        {
+            std::memcpy(&mBits, &d.value, sizeof(mBits));
+        }
+    }
+    Object(Symbol sym)
+    : mBits{kSymbolTag | sym.value}
+    {}
+    Object(HeapObject const* heapObject)
+    : mBits{kHeapTag | reinterpret_cast<uintptr_t>(heapObject)}
+    {
+        ASSERT((reinterpret_cast<uintptr_t>(heapObject) & kTagMask) == 0);
+    }
+
+    bool isDouble() const
+    {
+        return mBits < kIntTag;
+    }
+    bool isInt() const
+    {
+        return (mBits & kTagMask) == kIntTag;
+    }
+    bool isBool() const
+    {
+        return (mBits & kTagMask) == kBoolTag;
+    }
+    bool isNull() const
+    {
+        return mBits == kNullTag;
+    }
+    bool isHeap() const
+    {
+        return (mBits & kTagMask) == kHeapTag;
+    }
+    bool isSymbol() const
+    {
+        return (mBits & kTagMask) == kSymbolTag;
+    }
+    template <typename T>
+    bool is() const
+    {
+        return isHeap() && asHeap()->kind() == T::kKind;
+    }
+
+    double asDouble() const
+    {
+        double d;
+        std::memcpy(&d, &mBits, sizeof(d));
+        return d;
+    }
+    int32_t asInt() const
+    {
+        return static_cast<int32_t>(static_cast<uint32_t>(mBits));
+    }
+    bool asBool() const
+    {
+        return (mBits & 1U) != 0;
+    }
+    SymbolId asSymbol() const
+    {
+        return static_cast<SymbolId>(mBits);
+    }
+    HeapObject* asHeap() const
+    {
+        return reinterpret_cast<HeapObject*>(static_cast<uintptr_t>(mBits & kPayloadMask));
+    }
+    // nullptr if the Object does not hold a T.
+    template <typename T>
+    T* as() const
+    {
+        return is<T>() ? static_cast<T*>(asHeap()) : nullptr;
+    }
+    bool sameBits(Object const& other) const
+    {
+        return mBits == other.mBits;
+    }
+};
+
+static_assert(sizeof(Object) == 8);
+static_assert(std::is_trivially_copyable_v<Object>);
+
+// Function prototype, created once by the compiler and shared by every closure and frame running it.
+class FunctionSymbol final : public HeapObject
+{
+    std::string const mName{};
+    size_t const mNbArgs{};
+    bool const mVariadic{};
+    size_t const mNbLocals{};
+    Instructions const mInstructions{};
+    LinkedInstructions const mLinkedInstructions{};
+    // Constants of the function body, kCONST and kCLOSURE in the body index them.
+    std::vector<Object> const mConstantPool{};
+public:
+    static constexpr auto kKind = HeapKind::kFUNCTION;
+    FunctionSymbol(std::string const& name, size_t nbArgs, bool variadic, size_t nbLocals, Instructions instructions,
+                   std::vector<Object> constantPool = {})
+    : HeapObject{kKind}
+    , mName{name}
+    , mNbArgs{nbArgs}
+    , mVariadic{variadic}
+    , mNbLocals{nbLocals}
+    , mInstructions{std::move(instructions)}
+    , mLinkedInstructions{link(mInstructions)}
+    , mConstantPool{std::move(constantPool)}
+    {}
+    std::string name() const
+    {
+        return mName;
+    }
+    size_t nbArgs() const
+    {
+        return mNbArgs;
+    }
+    auto variadic() const
+    {
+        return mVariadic;
+    }
+    size_t nbLocals() const
+    {
+        return mNbLocals;
+    }
+    auto const& instructions() const
+    {
+        return mInstructions;
+    }
+    auto const& linkedInstructions() const
+    {
+        return mLinkedInstructions;
+    }
+    auto const& constantPool() const
+    {
+        return mConstantPool;
+    }
+    size_t footprint() const override
+    {
+        return sizeof(*this) + mName.capacity() + mInstructions.capacity() + mLinkedInstructions.capacity() * sizeof(Word)
+               + mConstantPool.capacity() * sizeof(Object);
+    }
+};
 
-class Closure
+class Closure final : public HeapObject
 {
-    FunctionSymbol mFuncSym;
-    std::vector<Object> mFreeVars;
+    FunctionSymbol const* const mFuncSym;
+    std::vector<Object> const mFreeVars;
 public:
-    Closure(FunctionSymbol const& funcSym, std::vector<Object> const& freeVars)
-    : mFuncSym{funcSym}
-    , mFreeVars{freeVars}
+    static constexpr auto kKind = HeapKind::kCLOSURE;
+    Closure(FunctionSymbol const* funcSym, std::vector<Object>&& freeVars)
+    : HeapObject{kKind}
+    , mFuncSym{funcSym}
+    , mFreeVars{std::move(freeVars)}
     {
     }
-    auto const& funcSym() const
+    FunctionSymbol const& funcSym() const
     {
-        return mFuncSym;
+        return *mFuncSym;
     }
     auto const& freeVars() const
     {
         return mFreeVars;
     }
+    size_t footprint() const override
+    {
+        return sizeof(*this) + mFreeVars.capacity() * sizeof(Object);
+    }
 };
 
-class VMCons
+class VMCons final : public HeapObject
 {
     Object mCar{};
     Object mCdr{};
 public:
+    static constexpr auto kKind = HeapKind::kCONS;
+    // The cells of every heap come from one pool.
+    static CellPool& pool()
+    {
+        static auto const cellPool = new CellPool{sizeof(VMCons)};
+        return *cellPool;
+    }
+    static void* operator new(size_t size)
+    {
+        ASSERT(size == sizeof(VMCons));
+        return pool().allocate();
+    }
+    static void operator delete(void* ptr)
+    {
+        pool().deallocate(ptr);
+    }
     VMCons(Object const& car_, Object const& cdr_)
-    : mCar{car_}
+    : HeapObject{kKind}
+    , mCar{car_}
     , mCdr{cdr_}
     {}
     auto const& car() const
@@ -168,49 +463,296 @@ public:
         return mCdr;
     }
     std::string toString() const;
+    size_t footprint() const override
+    {
+        return sizeof(*this);
+    }
 };
 
-inline ConsPtr cons(Object const& car_, Object const& cdr_)
+class SplicingObject final : public HeapObject
 {
-    return std::make_shared<VMCons>(car_, cdr_);
+public:
+    static constexpr auto kKind = HeapKind::kSPLICING;
+    ConsPtr const value;
+    explicit SplicingObject(ConsPtr cons_)
+    : HeapObject{kKind}
+    , value{cons_}
+    {}
+    size_t footprint() const override
+    {
+        return sizeof(*this);
+    }
+};
+
+// Variadic primitive of the VM called as a procedure, where it is used as a value: (map - lst).
+// The arguments are read where the caller pushed them, no rest list is allocated. One argument runs the unary op
+// if any, otherwise the binary op is folded over the arguments, as the compiler open-codes direct calls.
+class Builtin final : public HeapObject
+{
+    std::string const mName;
+    std::optional<Byte> const mUnary;
+    Byte const mBinary;
+    bool const mRightFold;
+    std::optional<Object> const mIdentity;
+    bool const mFoldIdentity;
+public:
+    static constexpr auto kKind = HeapKind::kBUILTIN;
+    // identity is the value without arguments, folded with the arguments too when foldIdentity:
+    // list is kCONS folded from the right with null.
+    Builtin(std::string name, std::optional<Byte> unary, Byte binary, bool rightFold, std::optional<Object> identity,
+            bool foldIdentity)
+    : HeapObject{kKind}
+    , mName{std::move(name)}
+    , mUnary{unary}
+    , mBinary{binary}
+    , mRightFold{rightFold}
+    , mIdentity{identity}
+    , mFoldIdentity{foldIdentity}
+    {}
+    std::string const& name() const
+    {
+        return mName;
+    }
+    auto unary() const
+    {
+        return mUnary;
+    }
+    Byte binary() const
+    {
+        return mBinary;
+    }
+    bool rightFold() const
+    {
+        return mRightFold;
+    }
+    auto const& identity() const
+    {
+        return mIdentity;
+    }
+    bool foldIdentity() const
+    {
+        return mFoldIdentity;
+    }
+    size_t footprint() const override
+    {
+        return sizeof(*this) + mName.capacity();
+    }
+};
+
+struct GcStats
+{
+    size_t collections{};
+    std::chrono::nanoseconds totalPause{};
+    std::chrono::nanoseconds maxPause{};
+    // Bytes held by the heap, live after the last collection plus allocated since.
+    size_t bytesInUse{};
+    size_t bytesLiveAfterLastCollection{};
+    size_t objectsInUse{};
+    size_t bytesAllocated{};
+    size_t bytesFreed{};
+};
+
+// Owner of heap objects, with a precise mark-sweep collector.
+// The heap does not know its roots: the caller of collect marks them, the heap then traces what they reach
+// and frees everything else. Tracing uses an explicit stack, so long lists do not recurse.
+class Heap
+{
+    HeapObject* mObjects{};
+    bool const mPinned;
+    size_t mNextCollection;
+    std::vector<HeapObject const*> mGray{};
+    GcStats mStats{};
+    void trace();
+    void sweep();
+public:
+    // Objects allocated after a collection before the next one is due, at least.
+    static constexpr size_t kMinCollectionThreshold = size_t{1} << 20;
+    enum Pinning
+    {
+        kCOLLECTED,
+        kPINNED
+    };
+    explicit Heap(Pinning pinning = kCOLLECTED)
+    : mPinned{pinning == kPINNED}
+    , mNextCollection{kMinCollectionThreshold}
+    {}
+    Heap(Heap const&) = delete;
+    Heap& operator=(Heap const&) = delete;
+    ~Heap();
+    template <typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        auto const obj = new T(std::forward<Args>(args)...);
+        obj->mPinned = mPinned;
+        obj->mNext = mObjects;
+        mObjects = obj;
+        auto const bytes = obj->footprint();
+        mStats.bytesInUse += bytes;
+        mStats.bytesAllocated += bytes;
+        ++mStats.objectsInUse;
+        return obj;
+    }
+    ConsPtr cons(Object car_, Object cdr_);
+    StringObject* string(std::string str)
+    {
+        return make<StringObject>(std::move(str));
+    }
+    // Allocation never collects by itself, the owner collects at points where all its live values are rooted.
+    bool shouldCollect() const
+    {
+        return mStats.bytesInUse >= mNextCollection;
+    }
+    void mark(Object const& obj)
+    {
+        if (obj.isHeap())
+        {
+            mark(obj.asHeap());
+        }
+    }
+    void mark(HeapObject const* obj)
+    {
+        if (!obj->mMarked && !obj->mPinned)
+        {
+            obj->mMarked = true;
+            mGray.push_back(obj);
+        }
+    }
+    // markRoots(heap) marks every root.
+    template <typename MarkRoots>
+    void collect(MarkRoots const& markRoots)
+    {
+        auto const begin = std::chrono::steady_clock::now();
+        markRoots(*this);
+        trace();
+        sweep();
+        auto const pause = std::chrono::steady_clock::now() - begin;
+        ++mStats.collections;
+        mStats.totalPause += pause;
+        mStats.maxPause = std::max<std::chrono::nanoseconds>(mStats.maxPause, pause);
+        mStats.bytesLiveAfterLastCollection = mStats.bytesInUse;
+        mNextCollection = std::max(kMinCollectionThreshold, 2 * mStats.bytesInUse);
+    }
+    GcStats const& stats() const
+    {
+        return mStats;
+    }
+};
+
+// Counterpart of std::get for Objects, throws if the Object does not hold a T.
+template <typename T>
+T get(Object const& obj);
+
+template <>
+inline Bool get<Bool>(Object const& obj)
+{
+    ASSERT(obj.isBool());
+    return Bool{obj.asBool()};
+}
+
+template <>
+inline Int get<Int>(Object const& obj)
+{
+    ASSERT(obj.isInt());
+    return Int{obj.asInt()};
+}
+
+template <>
+inline Double get<Double>(Object const& obj)
+{
+    ASSERT(obj.isDouble());
+    return Double{obj.asDouble()};
+}
+
+template <>
+inline String get<String>(Object const& obj)
+{
+    auto const str = obj.as<StringObject>();
+    ASSERT(str);
+    return String{str->value};
+}
+
+template <>
+inline Symbol get<Symbol>(Object const& obj)
+{
+    ASSERT(obj.isSymbol());
+    return Symbol{obj.asSymbol()};
+}
+
+template <>
+inline ConsPtr get<ConsPtr>(Object const& obj)
+{
+    auto const cons_ = obj.as<VMCons>();
+    ASSERT(cons_);
+    return cons_;
+}
+
+template <>
+inline ClosurePtr get<ClosurePtr>(Object const& obj)
+{
+    auto const closure = obj.as<Closure>();
+    ASSERT(closure);
+    return closure;
 }
 
-inline Object car(ConsPtr const& cons_)
+template <>
+inline Splicing get<Splicing>(Object const& obj)
+{
+    auto const splicing = obj.as<SplicingObject>();
+    ASSERT(splicing);
+    return Splicing{splicing->value};
+}
+
+bool operator==(Object const& lhs, Object const& rhs);
+std::ostream& operator<<(std::ostream& o, Object const& obj);
+
+inline ConsPtr Heap::cons(Object car_, Object cdr_)
+{
+    return make<VMCons>(car_, cdr_);
+}
+
+inline Object car(ConsPtr cons_)
 {
     return cons_->car();
 }
 
-inline Object cdr(ConsPtr const& cons_)
+inline Object cdr(ConsPtr cons_)
 {
     return cons_->cdr();
 }
 
 class VM;
 
+// A call frame does not own any storage: its arguments and locals live on the VM value stack, starting at basePointer.
 class StackFrame
 {
-    ClosurePtr const mClosure;
-    std::vector<Object> mLocals;
+    ClosurePtr mClosure;
+    FunctionSymbol const* mFuncSym;
+    size_t mBasePointer;
     size_t mReturnAddress;
 public:
-    StackFrame(ClosurePtr const& func, std::vector<Object>&& locals, size_t returnAddress)
+    StackFrame(ClosurePtr func, size_t basePointer, size_t returnAddress)
     : mClosure{func}
-    , mLocals{std::move(locals)}
+    , mFuncSym{&func->funcSym()}
+    , mBasePointer{basePointer}
     , mReturnAddress{returnAddress}
     {
     }
-    auto const& closure() const
+    ClosurePtr closure() const
     {
         ASSERT(mClosure);
         return mClosure;
     }
-    auto returnAddress() const
+    FunctionSymbol const& funcSym() const
     {
-        return mReturnAddress;
+        return *mFuncSym;
     }
-    auto& locals(size_t i)
+    auto basePointer() const
     {
-        return mLocals.at(i);
+        return mBasePointer;
+    }
+    auto returnAddress() const
+    {
+        return mReturnAddress;
     }
 };
 
@@ -218,34 +760,93 @@ class ByteCode
 {
 public:
     Instructions instructions{};
+    // Constants of the top level code, each function has its own.
     std::vector<Object> constantPool{};
+    // Owns the heap objects of the constant pool, shared by the copies of the ByteCode and the VMs running it.
+    std::shared_ptr<Heap> constants{std::make_shared<Heap>(Heap::kPINNED)};
 };
 
+// Name of the dispatch engine VM::run was built with, "threaded" (computed goto) or "switch".
+char const* dispatchEngine();
+
 class VM
 {
 public:
-    VM(ByteCode const& code)
-    : mCode{code}
-    {}
+    static constexpr size_t kDefaultMaxCallDepth = 1U << 20;
+    // The top level code gets a kHALT sentinel, so that the dispatch loop does not need to test for its end.
+    VM(ByteCode const& code, size_t maxCallDepth = kDefaultMaxCallDepth)
+    : mCode{Instructions(code.instructions.size() + 1, kHALT), code.constantPool, code.constants}
+    , mMaxCallDepth{maxCallDepth}
+    {
+        std::copy(code.instructions.begin(), code.instructions.end(), mCode.instructions.begin());
+        mInstructions = link(mCode.instructions);
+        mStack.reserve(kInitialStackSize);
+        mCallStack.reserve(std::min(maxCallDepth, kInitialCallStackSize));
+    }
     void run();
+    // Same as run, also recording the op codes dispatched into profile.
+    void runProfiled(OpCodeProfile& profile);
     auto peekOperandStack() const
     {
-        return mOperands.top();
+        return mStack.back();
     }
-    auto& operandStack()
+    auto const& instructions() const
     {
-        return mOperands;
+        return mCallStack.empty() ? mInstructions : mCallStack.back().funcSym().linkedInstructions();
     }
-    auto const& instructions() const
+    auto const& constantPool() const
+    {
+        return mCallStack.empty() ? mCode.constantPool : mCallStack.back().funcSym().constantPool();
+    }
+    // Values returned by the VM point into its heap, they are valid as long as the VM.
+    Heap& heap()
+    {
+        return mHeap;
+    }
+    GcStats const& gcStats() const
     {
-        return mCallStack.empty() ? mCode.instructions : mCallStack.top().closure()->funcSym().instructions();
+        return mHeap.stats();
     }
+    void collectGarbage();
 private:
+    // Only called where every live value is reachable from the stack, the globals or the frames.
+    void collectIfNeeded()
+    {
+        if (mHeap.shouldCollect())
+        {
+            collectGarbage();
+        }
+    }
+    template <bool kProfile>
+    void execute(OpCodeProfile* profile);
+    // Pushes the result of an arithmetic op the dispatch loop does not handle inline.
+    void arithmetic(Byte opCode, Object lhs, Object rhs);
+    // A copy of the list lhs ending with rhs.
+    Object append(Object lhs, Object rhs);
+    // Replaces the nbArgs arguments on top of the stack with the value of builtin applied to them.
+    void callBuiltin(Builtin const& builtin, size_t nbArgs);
+    static constexpr size_t kInitialStackSize = 4096;
+    static constexpr size_t kInitialCallStackSize = 1024;
+    void push(Object obj)
+    {
+        mStack.push_back(std::move(obj));
+    }
+    Object popOperand()
+    {
+        auto result = std::move(mStack.back());
+        mStack.pop_back();
+        return result;
+    }
     ByteCode mCode{};
+    // The top level code of mCode, linked.
+    LinkedInstructions mInstructions{};
+    Heap mHeap{};
     size_t mIp{};
+    size_t mMaxCallDepth{};
     std::vector<Object> mGlobals{};
-    std::stack<Object> mOperands{};
-    std::stack<StackFrame> mCallStack{};
+    // Locals of every frame, each followed by the operands of that frame.
+    std::vector<Object> mStack{};
+    std::vector<StackFrame> mCallStack{};
 };
 
 template <typename T>
@@ -0,0 +1,88 @@
+#include "lisp/compiler.h"
+#include "lisp/metaParser.h"
+#include "lisp/parser.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+
+// Call-heavy recursive list programs for comparing VM builds, e.g. configured with
+// -DLISP_VM_COMPUTED_GOTO=ON and -DLISP_VM_COMPUTED_GOTO=OFF.
+
+constexpr auto prelude =
+    "(define (range n) (if (= n 0) '() (cons n (range (- n 1)))))"
+    "(define (len lst) (if (null? lst) 0 (+ 1 (len (cdr lst)))))"
+    "(define (map proc lst) (if (null? lst) '() (cons (proc (car lst)) (map proc (cdr lst)))))"
+    "(define (fact n) (if (= n 0) 1 (* n (fact (- n 1)))))"
+    "(define (inc x) (+ x 1))"
+    "(define (repeat n thunk acc) (if (= n 0) acc (repeat (- n 1) thunk (thunk))))"
+    "(define lst (range 1000))";
+
+struct Program
+{
+    std::string name;
+    std::string source;
+};
+
+// fact with a long, never taken branch: the cost of a call must not depend on the size of the callee.
+auto bigFact()
+{
+    std::string sum = "(+ n";
+    for (size_t i = 0; i < 500; ++i)
+    {
+        sum += " n";
+    }
+    sum += ")";
+    return "(define (big-fact n) (if (= n 0) 1 (if (< n 0) " + sum + " (* n (big-fact (- n 1))))))";
+}
+
+auto programs()
+{
+    return std::vector<Program>{
+        {"fact", "(repeat 2000 (lambda () (fact 20)) 0)"},
+        {"bigfact", bigFact() + "(repeat 2000 (lambda () (big-fact 20)) 0)"},
+        {"len", "(repeat 200 (lambda () (len lst)) 0)"},
+        {"map", "(repeat 200 (lambda () (map inc lst)) 0)"},
+    };
+}
+
+auto sourceToBytecode(std::string const& source)
+{
+    Lexer lex(source);
+    MetaParser p(lex);
+    Compiler c{};
+    while (!p.eof())
+    {
+        c.compile(parse(p.sexpr()));
+    }
+    return std::make_pair(c.code(), c.constantPoolStats());
+}
+
+int32_t main(int n, char** args)
+{
+    ASSERT(n <= 2);
+    auto const nbRuns = n == 2 ? std::stoul(args[1]) : 5UL;
+    std::cout << "dispatch: " << vm::dispatchEngine() << std::endl;
+    for (auto const& program : programs())
+    {
+        auto const [code, constantPoolStats] = sourceToBytecode(std::string{prelude} + program.source);
+        std::vector<double> times;
+        vm::GcStats gcStats{};
+        for (size_t i = 0; i < nbRuns; ++i)
+        {
+            vm::VM vm{code};
+            auto const begin = std::chrono::steady_clock::now();
+            vm.run();
+            auto const end = std::chrono::steady_clock::now();
+            times.push_back(std::chrono::duration<double, std::milli>(end - begin).count());
+            gcStats = vm.gcStats();
+        }
+        std::sort(times.begin(), times.end());
+        std::cout << std::left << std::setw(8) << program.name << " median " << times.at(times.size() / 2) << " ms"
+                  << ", gc " << gcStats.collections << " collections, max pause "
+                  << std::chrono::duration<double, std::milli>(gcStats.maxPause).count() << " ms, "
+                  << gcStats.bytesLiveAfterLastCollection / 1024 << " KiB live, "
+                  << constantPoolStats.entries << "/" << constantPoolStats.references << " constants stored" << std::endl;
+    }
+    return 0;
+}
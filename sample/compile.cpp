@@ -1,6 +1,8 @@
 #include "lisp/evaluator.h"
 #include "lisp/parser.h"
 #include "lisp/compiler.h"
+#include "lisp/image.h"
+#include "lisp/bytecode.h"
 #include <numeric>
 #include <fstream>
 #include <filesystem>
@@ -33,7 +35,20 @@ void announceOutput(std::string const& string)
     std::cout << "\n" << string << std::endl;
 }
 
-auto compile(Compiler& c, std::string const& input)
+// Makes the procedure a top level form defines visible to the macros expanded after it, which may call it, without
+// running the program in the interpreter: evaluating the definition of a lambda only creates a closure. Other forms,
+// and globals defined with other values, only run on the VM.
+void defineForMacros(ExprPtr const& e)
+{
+    auto const defPtr = dynamic_cast<Definition const*>(e.get());
+    if (defPtr && dynamic_cast<LambdaBase<CompoundProcedure> const*>(defPtr->value().get()))
+    {
+        e->eval(globalEnvironment());
+    }
+}
+
+// Records the forms processed in forms when given, to write them to an image.
+auto compile(Compiler& c, std::string const& input, std::vector<PreludeForm>* forms = nullptr)
 {
     Lexer lex(input);
     MetaParser p(lex);
@@ -47,17 +62,22 @@ auto compile(Compiler& c, std::string const& input)
 #if DEBUG
         std::cout << "ee ## " << ee->toString() << std::endl;
 #endif // DEBUG
+        if (forms)
+        {
+            auto const macroDefinition = parseMacroDefinition(me) != nullptr;
+            forms->push_back({macroDefinition ? me : ee, macroDefinition});
+        }
         auto e = parse(ee);
 #if DEBUG
         std::cout << "e ## " << e->toString() << std::endl;
 #endif // DEBUG
-        e->eval(globalEnvironment());
+        defineForMacros(e);
         c.compile(e);
     } while (!p.eof());
     return c.code();
 }
 
-void preCompile(Compiler& c)
+std::string preludeSource()
 {
     auto const path1 = "core.lisp";
     auto const path2 = std::string("../../") + path1;
@@ -65,8 +85,43 @@ void preCompile(Compiler& c)
     std::ifstream ifs(path);
     std::string content((std::istreambuf_iterator<char>(ifs)),
                         (std::istreambuf_iterator<char>()));
-    auto code = compile(c, content);
+    return content;
+}
+
+// Restores the compiler and the environments from the image of core.lisp when it matches, compiles core.lisp otherwise.
+void preCompile(Compiler& c, std::string const& imagePath)
+{
+    auto const source = preludeSource();
+    if (!imagePath.empty() && fs::exists(imagePath))
+    {
+        vm::MappedFile image{imagePath};
+        if (auto const forms = readImage(image.bytes(), source, &c))
+        {
+            for (auto const& form : *forms)
+            {
+                if (form.macroDefinition)
+                {
+                    expandMacros(form.expr, globalMacroEnvironment());
+                    continue;
+                }
+                defineForMacros(parse(form.expr));
+            }
+            return;
+        }
+    }
+    auto code = compile(c, source);
+    (void)code;
+}
+
+void writePreludeImage(Compiler& c, std::string const& imagePath)
+{
+    auto const source = preludeSource();
+    std::vector<PreludeForm> forms;
+    auto code = compile(c, source, &forms);
     (void)code;
+    std::ofstream ofs(imagePath, std::ios::binary);
+    ofs << writeImage(forms, c, source);
+    ASSERT_MSG(ofs, imagePath);
 }
 
 bool hasEnding(std::string const &fullString, std::string const &ending)
@@ -83,8 +138,65 @@ bool hasEnding(std::string const &fullString, std::string const &ending)
 
 int32_t main(int n, char** args)
 {
-    Compiler c{};
-    preCompile(c);
+    // Report what the AST optimizer folded (--ast-stats), or compile without it (--no-ast-optimizer).
+    // Call small global procedures instead of inlining them (--no-inline).
+    // Run the peephole optimizer over the compiled code (--peephole), and also report what each pass did
+    // (--peephole-stats).
+    // Report the op codes and pairs of op codes the program dispatches (--profile-opcodes), to choose superinstructions,
+    // best mined on the plain op codes (--no-superinstructions).
+    // Write the image of core.lisp loaded at startup (--write-image <path>), or compile core.lisp (--no-image).
+    // Write the code to a bytecode file for the run sample instead of running it (-o <path>), without the names of
+    // the functions (--no-debug-info).
+    CompilerOptions options{};
+    bool astStats = false;
+    bool peepholeStats = false;
+    bool profileOpCodes = false;
+    auto imagePath = fs::path{args[0]}.replace_filename("core.image").string();
+    std::string writeImagePath;
+    std::string outputPath;
+    bool debugInfo = true;
+    for (; n >= 2 && (std::string{args[1]}.rfind("--", 0) == 0 || std::string{args[1]} == "-o"); --n, ++args)
+    {
+        std::string const flag = args[1];
+        options.astOptimizer = options.astOptimizer && flag != "--no-ast-optimizer";
+        astStats = astStats || flag == "--ast-stats";
+        options.inliner = options.inliner && flag != "--no-inline";
+        options.peephole = options.peephole || flag == "--peephole" || flag == "--peephole-stats";
+        peepholeStats = peepholeStats || flag == "--peephole-stats";
+        profileOpCodes = profileOpCodes || flag == "--profile-opcodes";
+        options.superinstructions = options.superinstructions && flag != "--no-superinstructions";
+        if (flag == "--no-image")
+        {
+            imagePath.clear();
+        }
+        if (flag == "--write-image")
+        {
+            ASSERT_MSG(n >= 3, "--write-image <path>");
+            writeImagePath = args[2];
+            --n;
+            ++args;
+        }
+        if (flag == "-o")
+        {
+            ASSERT_MSG(n >= 3, "-o <path>");
+            outputPath = args[2];
+            --n;
+            ++args;
+        }
+        debugInfo = debugInfo && flag != "--no-debug-info";
+        ASSERT_MSG(flag == "--no-ast-optimizer" || flag == "--ast-stats" || flag == "--no-inline" || flag == "--peephole"
+                       || flag == "--peephole-stats" || flag == "--profile-opcodes" || flag == "--no-superinstructions"
+                       || flag == "--no-image" || flag == "--write-image" || flag == "-o" || flag == "--no-debug-info",
+                   flag);
+    }
+    Compiler c{options};
+    if (!writeImagePath.empty())
+    {
+        ASSERT(n == 1);
+        writePreludeImage(c, writeImagePath);
+        return 0;
+    }
+    preCompile(c, imagePath);
     ASSERT(n == 2);
     std::string input = args[1];
     if (hasEnding(input, ".lisp"))
@@ -95,8 +207,30 @@ int32_t main(int n, char** args)
         input = std::move(content);
     }
     auto code = compile(c, input);
+    if (astStats)
+    {
+        std::cerr << "ast: " << c.astOptimizerStats() << std::endl;
+    }
+    if (peepholeStats)
+    {
+        std::cerr << "peephole: " << c.peepholeStats() << std::endl;
+    }
     code.instructions.push_back(vm::kPRINT);
+    if (!outputPath.empty())
+    {
+        std::ofstream ofs(outputPath, std::ios::binary);
+        ofs << vm::writeByteCode(code, debugInfo);
+        ASSERT_MSG(ofs, outputPath);
+        return 0;
+    }
     vm::VM vm{code};
+    if (profileOpCodes)
+    {
+        vm::OpCodeProfile profile{};
+        vm.runProfiled(profile);
+        std::cerr << profile;
+        return 0;
+    }
     vm.run();
     return 0;
 }
@@ -1,5 +1,7 @@
 #include "lisp/evaluator.h"
+#include "lisp/executor.h"
 #include "lisp/parser.h"
+#include "lisp/image.h"
 #include <numeric>
 #include <fstream>
 #include <filesystem>
@@ -22,6 +24,13 @@ auto& globalMacroEnvironment()
     return macroEnv;
 }
 
+// Run the analyzed executors (--analyze) instead of evaluating the expressions.
+bool& useExecutors()
+{
+    static bool executors = false;
+    return executors;
+}
+
 constexpr auto inputPrompt = ";;; M-Eval input:";
 constexpr auto outputPrompt = ";;; M-Eval value:";
 
@@ -35,6 +44,16 @@ void announceOutput(std::string const& string)
     std::cout << "\n" << string << std::endl;
 }
 
+// Evaluates an expression with its macros expanded.
+auto evalExpanded(ExprPtr const& ee, std::shared_ptr<Env> const& env)
+{
+    auto e = analyze(parse(ee));
+#if DEBUG
+    std::cout << "e ## " << e->toString() << std::endl;
+#endif // DEBUG
+    return useExecutors() ? executeTrampoline(*Analyzer::analyze(e), env) : e->eval(env);
+}
+
 auto eval(std::string const& input, std::shared_ptr<Env> const& env, std::shared_ptr<Env> const& macroEnv)
 {
     Lexer lex(input);
@@ -50,16 +69,14 @@ auto eval(std::string const& input, std::shared_ptr<Env> const& env, std::shared
 #if DEBUG
         std::cout << "ee ## " << ee->toString() << std::endl;
 #endif // DEBUG
-        auto e = parse(ee);
-#if DEBUG
-        std::cout << "e ## " << e->toString() << std::endl;
-#endif // DEBUG
-        result = e->eval(env)->toString();
+        result = evalExpanded(ee, env)->toString();
     } while (!p.eof());
     return result;
 }
 
-void preEval()
+// Replays the forms of the image of core.lisp, written by the compile sample, when it matches,
+// evaluates core.lisp otherwise.
+void preEval(std::string const& imagePath)
 {
     auto const path1 = "core.lisp";
     auto const path2 = std::string("../../") + path1;
@@ -67,31 +84,47 @@ void preEval()
     std::ifstream ifs(path);
     std::string content((std::istreambuf_iterator<char>(ifs)),
                         (std::istreambuf_iterator<char>()));
+    if (!imagePath.empty() && fs::exists(imagePath))
+    {
+        vm::MappedFile image{imagePath};
+        if (auto const forms = readImage(image.bytes(), content))
+        {
+            for (auto const& form : *forms)
+            {
+                if (form.macroDefinition)
+                {
+                    expandMacros(form.expr, globalMacroEnvironment());
+                    continue;
+                }
+                evalExpanded(form.expr, globalEnvironment());
+            }
+            return;
+        }
+    }
     auto output = eval(content, globalEnvironment(), globalMacroEnvironment());
     (void)output;
 }
 
-#if defined(__clang__)
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Winfinite-recursion"
-#endif
 void driverLoop()
 {
-    promptForInput(inputPrompt);
-    std::string input;
-    std::string allInput;
-    while (getline(std::cin, input) && !input.empty())
+    while (true)
     {
-        allInput += input;
+        promptForInput(inputPrompt);
+        std::string input;
+        std::string allInput;
+        while (getline(std::cin, input) && !input.empty())
+        {
+            allInput += input;
+        }
+        if (allInput.empty() && !std::cin)
+        {
+            return;
+        }
+        auto output = eval(allInput, globalEnvironment(), globalMacroEnvironment());
+        announceOutput(outputPrompt);
+        std::cout << output << std::endl;
     }
-    auto output = eval(allInput, globalEnvironment(), globalMacroEnvironment());
-    announceOutput(outputPrompt);
-    std::cout << output << std::endl;
-    driverLoop();
 }
-#if defined(__clang__)
-#pragma clang diagnostic pop
-#endif
 
 bool hasEnding(std::string const &fullString, std::string const &ending)
 {
@@ -107,7 +140,19 @@ bool hasEnding(std::string const &fullString, std::string const &ending)
 
 int32_t main(int n, char** args)
 {
-    preEval();
+    // Evaluate core.lisp instead of loading its image (--no-image).
+    auto imagePath = fs::path{args[0]}.replace_filename("core.image").string();
+    for (; n >= 2 && std::string{args[1]}.rfind("--", 0) == 0; --n, ++args)
+    {
+        std::string const flag = args[1];
+        useExecutors() = useExecutors() || flag == "--analyze";
+        if (flag == "--no-image")
+        {
+            imagePath.clear();
+        }
+        ASSERT_MSG(flag == "--analyze" || flag == "--no-image", flag);
+    }
+    preEval(imagePath);
     if (n == 1)
     {
         driverLoop();
@@ -0,0 +1,28 @@
+#include "lisp/bytecode.h"
+#include <iostream>
+
+// Runs a bytecode file written by the compile sample (compile -o <path>), with the VM only: the reader, the
+// interpreter and the compiler are not linked in.
+int32_t main(int n, char** args)
+{
+    // Report the op codes and pairs of op codes the program dispatches (--profile-opcodes).
+    bool profileOpCodes = false;
+    for (; n >= 2 && std::string{args[1]}.rfind("--", 0) == 0; --n, ++args)
+    {
+        std::string const flag = args[1];
+        profileOpCodes = profileOpCodes || flag == "--profile-opcodes";
+        ASSERT_MSG(flag == "--profile-opcodes", flag);
+    }
+    ASSERT_MSG(n == 2, "run [--profile-opcodes] <file.lbc>");
+    vm::MappedFile file{args[1]};
+    vm::VM vm{vm::readByteCode(file.bytes())};
+    if (profileOpCodes)
+    {
+        vm::OpCodeProfile profile{};
+        vm.runProfiled(profile);
+        std::cerr << profile;
+        return 0;
+    }
+    vm.run();
+    return 0;
+}
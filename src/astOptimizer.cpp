@@ -0,0 +1,326 @@
+#include "lisp/astOptimizer.h"
+#include "lisp/compiler.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+AstOptimizerStats& AstOptimizerStats::operator+=(AstOptimizerStats const& other)
+{
+    constantsFolded += other.constantsFolded;
+    branchesRemoved += other.branchesRemoved;
+    sequencesFlattened += other.sequencesFlattened;
+    return *this;
+}
+
+std::ostream& operator<<(std::ostream& o, AstOptimizerStats const& stats)
+{
+    return o << "constants folded " << stats.constantsFolded
+             << ", branches removed " << stats.branchesRemoved
+             << ", sequences flattened " << stats.sequencesFlattened;
+}
+
+namespace
+{
+template <typename T>
+std::optional<T> literal(ExprPtr const& expr)
+{
+    if (auto literalPtr = dynamic_cast<Literal<T> const*>(expr.get()))
+    {
+        return literalPtr->get();
+    }
+    return {};
+}
+
+// The value of an op on fixnums, which is a fixnum again when it fits (0, not -0.0).
+double fixnumResult(double value)
+{
+    return value == 0 ? 0.0 : value;
+}
+
+// The value the VM computes for a binary op on two literals, empty when it is left to run time:
+// the op fails, depends on the identity of heap objects, or divides by zero.
+ExprPtr foldBinary(vm::OpCode op, ExprPtr const& lhs, ExprPtr const& rhs)
+{
+    auto const l = literal<double>(lhs);
+    auto const r = literal<double>(rhs);
+    if (l && r)
+    {
+        // Both fixnums, unless a double literal is involved.
+        auto const fixnums = isFixnum(*l) && isFixnum(*r);
+        switch (op)
+        {
+        case vm::kADD:
+            // Exact in doubles when the fixnum result fits, the double the VM promotes to otherwise.
+            return number(fixnums ? fixnumResult(*l + *r) : *l + *r);
+        case vm::kSUB:
+            return number(fixnums ? fixnumResult(*l - *r) : *l - *r);
+        case vm::kMUL:
+            return number(fixnums ? fixnumResult(*l * *r) : *l * *r);
+        case vm::kDIV:
+            if (*r == 0)
+            {
+                return {};
+            }
+            if (fixnums)
+            {
+                auto const lInt = static_cast<int64_t>(*l);
+                auto const rInt = static_cast<int64_t>(*r);
+                // Inexact quotients are doubles.
+                return number(lInt % rInt == 0 ? fixnumResult(static_cast<double>(lInt / rInt)) : *l / *r);
+            }
+            return number(*l / *r);
+        case vm::kMOD:
+            if (!fixnums || *r == 0)
+            {
+                return {};
+            }
+            return number(fixnumResult(static_cast<double>(static_cast<int64_t>(*l) % static_cast<int64_t>(*r))));
+        case vm::kLESS_THAN:
+            return *l < *r ? true_() : false_();
+        case vm::kEQUAL:
+            return *l == *r ? true_() : false_();
+        default:
+            return {};
+        }
+    }
+    auto const lBool = literal<bool>(lhs);
+    auto const rBool = literal<bool>(rhs);
+    if (lBool && rBool && op == vm::kEQUAL)
+    {
+        return *lBool == *rBool ? true_() : false_();
+    }
+    auto const lStr = literal<std::string>(lhs);
+    auto const rStr = literal<std::string>(rhs);
+    if (lStr && rStr && op == vm::kADD)
+    {
+        return ExprPtr{new String{*lStr + *rStr}};
+    }
+    return {};
+}
+
+ExprPtr foldUnary(vm::OpCode op, ExprPtr const& operand)
+{
+    if (auto const value = literal<double>(operand); value && op == vm::kMINUS)
+    {
+        // The negation of the smallest fixnum is a double, like any double.
+        return number(isFixnum(*value) ? fixnumResult(-*value) : -*value);
+    }
+    if (auto const value = literal<bool>(operand); value && op == vm::kNOT)
+    {
+        return *value ? false_() : true_();
+    }
+    return {};
+}
+
+// Whether the predicate of an if always takes the same branch, and which one: everything but false is true.
+std::optional<bool> staticTruth(ExprPtr const& predicate)
+{
+    if (auto const value = literal<bool>(predicate))
+    {
+        return *value;
+    }
+    auto const exprPtr = predicate.get();
+    if (dynamic_cast<Number const*>(exprPtr) || dynamic_cast<String const*>(exprPtr)
+        || dynamic_cast<Symbol const*>(exprPtr) || dynamic_cast<Null const*>(exprPtr))
+    {
+        return true;
+    }
+    return {};
+}
+} // namespace
+
+void AstOptimizer::addDefinitions(ExprPtr const& expr)
+{
+    // The definitions anywhere in the body, not in the lambdas nested in it.
+    auto const exprPtr = expr.get();
+    if (auto defPtr = dynamic_cast<Definition const*>(exprPtr))
+    {
+        mLocals.push_back(defPtr->mVariableName);
+        addDefinitions(defPtr->mValue);
+    }
+    else if (auto assignmentPtr = dynamic_cast<Assignment const*>(exprPtr))
+    {
+        addDefinitions(assignmentPtr->mValue);
+    }
+    else if (auto ifPtr = dynamic_cast<If const*>(exprPtr))
+    {
+        addDefinitions(ifPtr->mPredicate);
+        addDefinitions(ifPtr->mConsequent);
+        addDefinitions(ifPtr->mAlternative);
+    }
+    else if (auto seqPtr = dynamic_cast<Sequence const*>(exprPtr))
+    {
+        for (auto const& action : seqPtr->mActions)
+        {
+            addDefinitions(action);
+        }
+    }
+    else if (auto appPtr = dynamic_cast<Application const*>(exprPtr))
+    {
+        addDefinitions(appPtr->mOperator);
+        for (auto const& operand : appPtr->mOperands)
+        {
+            addDefinitions(operand);
+        }
+    }
+}
+
+PrimitiveOp const* AstOptimizer::primitive(ExprPtr const& op) const
+{
+    auto const variablePtr = dynamic_cast<Variable const*>(op.get());
+    if (!variablePtr || std::find(mLocals.begin(), mLocals.end(), variablePtr->id()) != mLocals.end())
+    {
+        return nullptr;
+    }
+    return primitiveOp(variablePtr->id());
+}
+
+ExprPtr AstOptimizer::application(Application const& app, ExprPtr const& expr)
+{
+    auto op = optimize(app.mOperator);
+    auto operands = app.mOperands;
+    bool changed = op != app.mOperator;
+    for (auto& operand : operands)
+    {
+        auto optimized = optimize(operand);
+        changed = changed || optimized != operand;
+        operand = std::move(optimized);
+    }
+    auto const primitive = this->primitive(op);
+    if (primitive && operands.size() == 1 && primitive->unary)
+    {
+        if (auto folded = foldUnary(*primitive->unary, operands.front()))
+        {
+            ++mStats.constantsFolded;
+            return folded;
+        }
+    }
+    else if (primitive && primitive->binary && !primitive->rightFold && operands.size() >= 2
+             && (primitive->variadic || operands.size() == 2))
+    {
+        // The op is folded from the left: only the leading literals are folded, (+ 1 2 x) into (+ 3 x).
+        size_t nbFolded = 0;
+        while (operands.size() >= 2)
+        {
+            auto folded = foldBinary(*primitive->binary, operands.at(0), operands.at(1));
+            if (!folded)
+            {
+                break;
+            }
+            operands.erase(operands.begin());
+            operands.front() = std::move(folded);
+            ++nbFolded;
+        }
+        mStats.constantsFolded += nbFolded;
+        if (operands.size() == 1)
+        {
+            return operands.front();
+        }
+        changed = changed || nbFolded > 0;
+    }
+    if (!changed)
+    {
+        return expr;
+    }
+    return ExprPtr{new Application{op, operands}};
+}
+
+std::vector<ExprPtr> AstOptimizer::actions(std::vector<ExprPtr> const& actions)
+{
+    std::vector<ExprPtr> result;
+    result.reserve(actions.size());
+    for (auto const& action : actions)
+    {
+        auto optimized = optimize(action);
+        // Nested sequences run their actions one after the other in the enclosing one.
+        auto const seqPtr = dynamic_cast<Sequence const*>(optimized.get());
+        if (seqPtr && !seqPtr->mActions.empty())
+        {
+            ++mStats.sequencesFlattened;
+            result.insert(result.end(), seqPtr->mActions.begin(), seqPtr->mActions.end());
+            continue;
+        }
+        result.push_back(std::move(optimized));
+    }
+    return result;
+}
+
+ExprPtr AstOptimizer::optimize(ExprPtr const& expr)
+{
+    auto const exprPtr = expr.get();
+    if (auto ifPtr = dynamic_cast<If const*>(exprPtr))
+    {
+        auto predicate = optimize(ifPtr->mPredicate);
+        if (auto const truth = staticTruth(predicate))
+        {
+            ++mStats.branchesRemoved;
+            return optimize(*truth ? ifPtr->mConsequent : ifPtr->mAlternative);
+        }
+        auto consequent = optimize(ifPtr->mConsequent);
+        auto alternative = optimize(ifPtr->mAlternative);
+        if (predicate == ifPtr->mPredicate && consequent == ifPtr->mConsequent && alternative == ifPtr->mAlternative)
+        {
+            return expr;
+        }
+        return ExprPtr{new If{predicate, consequent, alternative}};
+    }
+    if (auto seqPtr = dynamic_cast<Sequence const*>(exprPtr))
+    {
+        auto result = actions(seqPtr->mActions);
+        if (result.size() == 1)
+        {
+            ++mStats.sequencesFlattened;
+            return result.front();
+        }
+        if (result == seqPtr->mActions)
+        {
+            return expr;
+        }
+        return ExprPtr{new Sequence{std::move(result)}};
+    }
+    if (auto appPtr = dynamic_cast<Application const*>(exprPtr))
+    {
+        return application(*appPtr, expr);
+    }
+    if (auto defPtr = dynamic_cast<Definition const*>(exprPtr))
+    {
+        auto value = optimize(defPtr->mValue);
+        if (value == defPtr->mValue)
+        {
+            return expr;
+        }
+        auto result = std::make_shared<Definition>(defPtr->mVariableName, value);
+        result->mSlot = defPtr->mSlot;
+        return result;
+    }
+    if (auto assignmentPtr = dynamic_cast<Assignment const*>(exprPtr))
+    {
+        auto value = optimize(assignmentPtr->mValue);
+        if (value == assignmentPtr->mValue)
+        {
+            return expr;
+        }
+        auto result = std::make_shared<Assignment>(assignmentPtr->mVariableName, value);
+        result->mAddress = assignmentPtr->mAddress;
+        return result;
+    }
+    if (auto lambdaPtr = dynamic_cast<LambdaBase<CompoundProcedure> const*>(exprPtr))
+    {
+        auto const nbLocals = mLocals.size();
+        auto const& params = lambdaPtr->mArguments.first;
+        mLocals.insert(mLocals.end(), params.begin(), params.end());
+        addDefinitions(lambdaPtr->mBody);
+        // The body stays a sequence, even of a single action.
+        auto body = actions(lambdaPtr->mBody->mActions);
+        mLocals.resize(nbLocals);
+        if (body == lambdaPtr->mBody->mActions)
+        {
+            return expr;
+        }
+        auto result = std::make_shared<Lambda>(lambdaPtr->mArguments, std::make_shared<Sequence>(std::move(body)));
+        result->setName(lambdaPtr->mName);
+        return result;
+    }
+    // Literals, variables, quoted data and macros.
+    return expr;
+}
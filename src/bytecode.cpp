@@ -0,0 +1,522 @@
+#include "lisp/bytecode.h"
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <unordered_set>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LISP_MAPPED_FILE_MMAP 1
+#else
+#define LISP_MAPPED_FILE_MMAP 0
+#endif
+
+namespace vm
+{
+uint64_t fnv1a(std::string_view bytes, uint64_t hash)
+{
+    for (auto const c : bytes)
+    {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+uint64_t opCodesHash()
+{
+    auto hash = fnv1a({});
+    for (size_t i = 0; i < kNbOpCodes; ++i)
+    {
+        hash = fnv1a(opCodeName(static_cast<Byte>(i)), hash);
+        hash = fnv1a(" ", hash);
+    }
+    return hash;
+}
+
+namespace
+{
+enum class ObjectTag : uint8_t
+{
+    kINT,
+    kDOUBLE,
+    kBOOL,
+    kNULL,
+    kSYMBOL,
+    kSTRING,
+    kFUNCTION,
+    kBUILTIN,
+};
+
+constexpr std::string_view kMagic = "LISPLBC";
+// Bumped whenever the layout of .lbc files changes.
+constexpr uint32_t kVersion = 1;
+} // namespace
+
+void ByteWriter::size(size_t value)
+{
+    ASSERT(value <= std::numeric_limits<uint32_t>::max());
+    integer(static_cast<uint32_t>(value));
+}
+
+void ByteWriter::real(double value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    integer(bits);
+}
+
+void ByteWriter::symbol(SymbolId id)
+{
+    auto const [iter, inserted] = mSymbolToIndex.try_emplace(id, mSymbols.size());
+    if (inserted)
+    {
+        mSymbols.push_back(id);
+    }
+    size(iter->second);
+}
+
+void ByteWriter::instructions(Instructions const& instructions)
+{
+    string({reinterpret_cast<char const*>(instructions.data()), instructions.size()});
+}
+
+void ByteWriter::object(Object const& obj)
+{
+    if (obj.isInt())
+    {
+        tag(ObjectTag::kINT);
+        integer(static_cast<uint32_t>(obj.asInt()));
+    }
+    else if (obj.isDouble())
+    {
+        tag(ObjectTag::kDOUBLE);
+        real(obj.asDouble());
+    }
+    else if (obj.isBool())
+    {
+        tag(ObjectTag::kBOOL);
+        flag(obj.asBool());
+    }
+    else if (obj.isNull())
+    {
+        tag(ObjectTag::kNULL);
+    }
+    else if (obj.isSymbol())
+    {
+        tag(ObjectTag::kSYMBOL);
+        symbol(obj.asSymbol());
+    }
+    else if (auto strPtr = obj.as<StringObject>())
+    {
+        tag(ObjectTag::kSTRING);
+        string(strPtr->value);
+    }
+    else if (auto funcSym = obj.as<FunctionSymbol>())
+    {
+        // Registered first: it may write the functions it refers to.
+        auto const index = function(funcSym);
+        tag(ObjectTag::kFUNCTION);
+        size(index);
+    }
+    else if (auto builtin = obj.as<Builtin>())
+    {
+        tag(ObjectTag::kBUILTIN);
+        string(builtin->name());
+        flag(builtin->unary().has_value());
+        integer(builtin->unary().value_or(Byte{}));
+        integer(builtin->binary());
+        flag(builtin->rightFold());
+        flag(builtin->identity().has_value());
+        if (builtin->identity())
+        {
+            object(*builtin->identity());
+        }
+        flag(builtin->foldIdentity());
+    }
+    else
+    {
+        FAIL_MSG("Not serializable!", obj);
+    }
+}
+
+size_t ByteWriter::function(FunctionSymbol const* funcSym)
+{
+    if (auto const iter = mFunctionToIndex.find(funcSym); iter != mFunctionToIndex.end())
+    {
+        return iter->second;
+    }
+    // The functions it makes closures of come first in the table, they are read before it.
+    for (auto const& constant : funcSym->constantPool())
+    {
+        if (auto const nested = constant.as<FunctionSymbol>())
+        {
+            function(nested);
+        }
+    }
+    auto bytes = release();
+    size(funcSym->nbArgs());
+    flag(funcSym->variadic());
+    size(funcSym->nbLocals());
+    instructions(funcSym->instructions());
+    size(funcSym->constantPool().size());
+    for (auto const& constant : funcSym->constantPool())
+    {
+        object(constant);
+    }
+    mFunctionBytes.push_back(std::exchange(mBytes, std::move(bytes)));
+    mFunctions.push_back(funcSym);
+    mFunctionToIndex.emplace(funcSym, mFunctions.size() - 1);
+    return mFunctions.size() - 1;
+}
+
+std::string ByteWriter::symbolTable() const
+{
+    ByteWriter table;
+    table.size(mSymbols.size());
+    for (auto const id : mSymbols)
+    {
+        table.string(symbolName(id));
+    }
+    return table.release();
+}
+
+std::string ByteWriter::functionTable() const
+{
+    ByteWriter table;
+    table.size(mFunctionBytes.size());
+    for (auto const& bytes : mFunctionBytes)
+    {
+        table.raw(bytes);
+    }
+    return table.release();
+}
+
+std::string ByteWriter::functionNames() const
+{
+    ByteWriter names;
+    names.size(mFunctions.size());
+    for (auto const funcSym : mFunctions)
+    {
+        names.string(funcSym->name());
+    }
+    return names.release();
+}
+
+size_t ByteReader::symbolIndex()
+{
+    auto const index = size();
+    ASSERT_MSG(index < mSymbols.size(), "Corrupt bytes!");
+    return index;
+}
+
+std::string_view ByteReader::raw(size_t size)
+{
+    ASSERT_MSG(size <= mBytes.size() - mPos, "Truncated bytes!");
+    auto const result = mBytes.substr(mPos, size);
+    mPos += size;
+    return result;
+}
+
+size_t ByteReader::count()
+{
+    auto const result = size();
+    ASSERT_MSG(result <= mBytes.size() - mPos, "Corrupt bytes!");
+    return result;
+}
+
+bool ByteReader::flag()
+{
+    auto const value = integer<uint8_t>();
+    ASSERT_MSG(value <= 1, "Corrupt bytes!");
+    return value == 1;
+}
+
+double ByteReader::real()
+{
+    auto const bits = integer<uint64_t>();
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+Instructions ByteReader::instructions()
+{
+    auto const bytes = string();
+    auto const begin = reinterpret_cast<Byte const*>(bytes.data());
+    return Instructions(begin, begin + bytes.size());
+}
+
+Object ByteReader::object(Heap& heap)
+{
+    switch (tag<ObjectTag>())
+    {
+    case ObjectTag::kINT:
+        return Int{static_cast<int32_t>(integer<uint32_t>())};
+    case ObjectTag::kDOUBLE:
+        return Double{real()};
+    case ObjectTag::kBOOL:
+        return Bool{flag()};
+    case ObjectTag::kNULL:
+        return vmNull;
+    case ObjectTag::kSYMBOL:
+        return Symbol{symbol()};
+    case ObjectTag::kSTRING:
+        return heap.string(std::string{string()});
+    case ObjectTag::kFUNCTION:
+    {
+        auto const index = size();
+        ASSERT_MSG(index < mFunctions.size(), "Corrupt bytes!");
+        return mFunctions[index];
+    }
+    case ObjectTag::kBUILTIN:
+    {
+        auto name = std::string{string()};
+        auto const hasUnary = flag();
+        auto const unary = integer<Byte>();
+        auto const binary = integer<Byte>();
+        auto const rightFold = flag();
+        std::optional<Object> identity;
+        if (flag())
+        {
+            identity = object(heap);
+        }
+        auto const foldIdentity = flag();
+        return heap.make<Builtin>(std::move(name), hasUnary ? std::optional<Byte>{unary} : std::nullopt, binary,
+                                  rightFold, identity, foldIdentity);
+    }
+    }
+    FAIL_("Corrupt bytes!");
+}
+
+void ByteReader::symbolTable()
+{
+    mSymbols.resize(count());
+    for (auto& id : mSymbols)
+    {
+        id = intern(std::string{string()});
+    }
+}
+
+void ByteReader::functionTable(Heap& heap, std::vector<std::string> const& names)
+{
+    auto const nbFunctions = count();
+    ASSERT_MSG(names.empty() || names.size() == nbFunctions, "Corrupt bytes!");
+    mFunctions.reserve(nbFunctions);
+    for (size_t i = 0; i < nbFunctions; ++i)
+    {
+        auto const nbArgs = size();
+        auto const variadic = flag();
+        auto const nbLocals = size();
+        auto instructions = this->instructions();
+        std::vector<Object> constantPool(count());
+        for (auto& constant : constantPool)
+        {
+            constant = object(heap);
+        }
+        mFunctions.push_back(heap.make<FunctionSymbol>(names.empty() ? std::string{} : names[i], nbArgs, variadic,
+                                                       nbLocals, std::move(instructions), std::move(constantPool)));
+    }
+}
+
+std::vector<std::string> ByteReader::functionNames()
+{
+    std::vector<std::string> names(count());
+    for (auto& name : names)
+    {
+        name = string();
+    }
+    return names;
+}
+
+namespace
+{
+// Runs read over the section that follows, which it must consume exactly.
+template <typename Read>
+void section(ByteReader& reader, Read const& read)
+{
+    auto const end = reader.size() + reader.position();
+    read();
+    ASSERT_MSG(reader.position() == end, "Corrupt bytecode file!");
+}
+
+// Code of the top level or of a function, with the constants and the number of locals its operands refer to.
+struct CodeUnit
+{
+    LinkedInstructions const& code;
+    std::vector<Object> const& constants;
+    size_t nbLocals;
+};
+
+// Calls visit with each op code of code and its operands.
+template <typename Visit>
+void forEachInstruction(LinkedInstructions const& code, Visit const& visit)
+{
+    for (size_t i = 0; i < code.size(); i += 1 + nbOperands(static_cast<Byte>(code[i])))
+    {
+        visit(static_cast<Byte>(code[i]), code.data() + i + 1);
+    }
+}
+
+// The VM indexes the locals of the frame without checking them: the locals, the globals and the constants the code
+// refers to must exist. The globals are the ones the code sets, the top level code runs without a frame.
+void checkIndexes(ByteCode const& code)
+{
+    auto const topLevel = link(code.instructions);
+    std::vector<CodeUnit> units{{topLevel, code.constantPool, 0}};
+    std::unordered_set<FunctionSymbol const*> functions;
+    size_t nbGlobals = 0;
+    for (size_t i = 0; i < units.size(); ++i)
+    {
+        auto const unit = units[i];
+        for (auto const& constant : unit.constants)
+        {
+            if (auto const funcSym = constant.as<FunctionSymbol>(); funcSym && functions.insert(funcSym).second)
+            {
+                units.push_back({funcSym->linkedInstructions(), funcSym->constantPool(),
+                                 funcSym->nbArgs() + funcSym->nbLocals()});
+            }
+        }
+        forEachInstruction(unit.code, [&](Byte opCode, Word const* operands) {
+            if (opCode == kSET_GLOBAL)
+            {
+                nbGlobals = std::max(nbGlobals, size_t{operands[0]} + 1);
+            }
+        });
+    }
+    for (auto const& unit : units)
+    {
+        forEachInstruction(unit.code, [&](Byte opCode, Word const* operands) {
+            switch (opCode)
+            {
+            case kGET_LOCAL:
+            case kSET_LOCAL:
+            case kGET_LOCAL_CAR:
+            case kGET_LOCAL_CDR:
+                ASSERT_MSG(operands[0] < unit.nbLocals, "Corrupt bytecode file!");
+                break;
+            case kJUMP_IF_LOCAL_NOT_NULL:
+                ASSERT_MSG(operands[1] < unit.nbLocals, "Corrupt bytecode file!");
+                break;
+            case kGET_GLOBAL:
+            case kGET_GLOBAL_CALL:
+            case kGET_GLOBAL_TAIL_CALL:
+                ASSERT_MSG(operands[0] < nbGlobals, "Corrupt bytecode file!");
+                break;
+            case kCONST:
+                ASSERT_MSG(operands[0] < unit.constants.size(), "Corrupt bytecode file!");
+                break;
+            case kCLOSURE:
+                ASSERT_MSG(operands[0] < unit.constants.size() && unit.constants[operands[0]].as<FunctionSymbol>(),
+                           "Corrupt bytecode file!");
+                break;
+            default:
+                break;
+            }
+        });
+    }
+}
+} // namespace
+
+std::string writeByteCode(ByteCode const& code, bool debugInfo)
+{
+    ByteWriter writer;
+    writer.size(code.constantPool.size());
+    for (auto const& constant : code.constantPool)
+    {
+        writer.object(constant);
+    }
+    auto const constants = writer.release();
+
+    // Sections are prefixed with their size.
+    ByteWriter payload;
+    payload.string(writer.symbolTable());
+    payload.string(debugInfo ? writer.functionNames() : std::string{});
+    payload.string(writer.functionTable());
+    payload.string(constants);
+    payload.instructions(code.instructions);
+    auto const bytes = payload.release();
+
+    ByteWriter header;
+    header.raw(kMagic);
+    header.integer(kVersion);
+    header.integer(opCodesHash());
+    header.flag(debugInfo);
+    header.integer(fnv1a(bytes));
+    header.size(bytes.size());
+    return header.release() + bytes;
+}
+
+ByteCode readByteCode(std::string_view bytes)
+{
+    ByteReader header{bytes};
+    ASSERT_MSG(header.raw(kMagic.size()) == kMagic, "Not a bytecode file!");
+    ASSERT_MSG(header.integer<uint32_t>() == kVersion, "Unsupported bytecode file version!");
+    ASSERT_MSG(header.integer<uint64_t>() == opCodesHash(), "Bytecode file written by a build with other op codes!");
+    auto const debugInfo = header.flag();
+    auto const checksum = header.integer<uint64_t>();
+    auto const payload = header.raw(header.size());
+    ASSERT_MSG(header.atEnd() && fnv1a(payload) == checksum, "Corrupt bytecode file!");
+
+    ByteCode code;
+    ByteReader reader{payload};
+    section(reader, [&] { reader.symbolTable(); });
+    std::vector<std::string> names;
+    section(reader, [&] {
+        if (debugInfo)
+        {
+            names = reader.functionNames();
+        }
+    });
+    section(reader, [&] { reader.functionTable(*code.constants, names); });
+    section(reader, [&] {
+        code.constantPool.resize(reader.count());
+        for (auto& constant : code.constantPool)
+        {
+            constant = reader.object(*code.constants);
+        }
+    });
+    code.instructions = reader.instructions();
+    ASSERT_MSG(reader.atEnd(), "Corrupt bytecode file!");
+    checkIndexes(code);
+    return code;
+}
+
+MappedFile::MappedFile(std::string const& path)
+{
+#if LISP_MAPPED_FILE_MMAP
+    auto const fd = ::open(path.c_str(), O_RDONLY);
+    ASSERT_MSG(fd >= 0, path);
+    struct stat status{};
+    if (::fstat(fd, &status) == 0 && status.st_size > 0)
+    {
+        mSize = static_cast<size_t>(status.st_size);
+        auto const data = ::mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        mData = data == MAP_FAILED ? nullptr : data;
+    }
+    ::close(fd);
+    if (mData)
+    {
+        return;
+    }
+    mSize = 0;
+#endif
+    std::ifstream ifs(path, std::ios::binary);
+    ASSERT_MSG(ifs, path);
+    mBuffer.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+MappedFile::~MappedFile()
+{
+#if LISP_MAPPED_FILE_MMAP
+    if (mData)
+    {
+        ::munmap(mData, mSize);
+    }
+#endif
+}
+} // namespace vm
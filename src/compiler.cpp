@@ -1,5 +1,8 @@
 #include "lisp/compiler.h"
+#include <algorithm>
 #include <array>
+#include <cmath>
+#include <limits>
 
 auto integerToFourBytes(size_t num) -> std::array<vm::Byte, 4>
 {
@@ -47,156 +50,405 @@ void Compiler::emitVar(VarInfo const& varInfo)
     }
 }
 
-void Compiler::emitApplication(Application const& app)
+bool isFixnum(double value)
 {
-    auto nbOperands = app.mOperands.size();
-    auto const emitUnaryOp = [&app, this, nbOperands](vm::OpCode opCode)
+    return std::trunc(value) == value && value >= std::numeric_limits<int32_t>::min()
+           && value <= std::numeric_limits<int32_t>::max() && !(value == 0 && std::signbit(value));
+}
+
+PrimitiveOp const* primitiveOp(SymbolId name)
+{
+    static auto const ops = []
     {
-        ASSERT (nbOperands == 1)
-        compile(app.mOperands.at(0));
-        instructions().push_back(static_cast<vm::OpCode>(opCode));
-    };
-    auto const emitBinaryOps = [&app, this, nbOperands](vm::OpCode opCode)
+        std::unordered_map<SymbolId, PrimitiveOp> nameToOp;
+        nameToOp[intern("+")] = {{}, vm::kADD, true, false, number(0)};
+        nameToOp[intern("-")] = {vm::kMINUS, vm::kSUB, true};
+        nameToOp[intern("*")] = {{}, vm::kMUL, true, false, number(1)};
+        nameToOp[intern("/")] = {{}, vm::kDIV, false};
+        nameToOp[intern("%")] = {{}, vm::kMOD, false};
+        nameToOp[intern("=")] = {{}, vm::kEQUAL, false};
+        nameToOp[intern("eq?")] = {{}, vm::kEQUAL, false};
+        nameToOp[intern("<")] = {{}, vm::kLESS_THAN, false};
+        nameToOp[intern("not")] = {vm::kNOT, {}, false};
+        nameToOp[intern("cons")] = {{}, vm::kCONS, false};
+        nameToOp[intern("list")] = {{}, vm::kCONS, true, true, null(), true};
+        nameToOp[intern("list*")] = {{}, vm::kCONS, true, true, null()};
+        nameToOp[intern("append")] = {{}, vm::kAPPEND, true, true, null()};
+        nameToOp[intern("car")] = {vm::kCAR, {}, false};
+        nameToOp[intern("cdr")] = {vm::kCDR, {}, false};
+        nameToOp[intern("cons?")] = {vm::kIS_CONS, {}, false};
+        nameToOp[intern("null?")] = {vm::kIS_NULL, {}, false};
+        nameToOp[intern("print")] = {vm::kPRINT, {}, false};
+        nameToOp[intern("error")] = {vm::kERROR, {}, false};
+        return nameToOp;
+    }();
+    auto const iter = ops.find(name);
+    return iter == ops.end() ? nullptr : &iter->second;
+}
+
+vm::Builtin* makeBuiltin(SymbolId name, vm::Heap& heap)
+{
+    auto const primitive = primitiveOp(name);
+    ASSERT_MSG(primitive && primitive->variadic, symbolName(name));
+    std::optional<vm::Object> identity;
+    if (auto const numPtr = dynamic_cast<Number const*>(primitive->identity.get()))
     {
-        compile(app.mOperands.at(0));
-        for (auto i = 1U; i < nbOperands; ++i)
-        {
-            compile(app.mOperands.at(i));
-            instructions().push_back(opCode);
-        }
-    };
-    bool isPrimitive = true;
-    // primitive procedure
+        identity = vm::Int{static_cast<int32_t>(numPtr->get())};
+    }
+    else if (primitive->identity)
     {
-        auto opName = app.mOperator->toString();
-        if (opName == "+")
-        {
-            emitBinaryOps(vm::kADD);
-        }
-        else if (opName == "-")
-        {
-            ASSERT(nbOperands == 2U || nbOperands == 1U);
-            if (nbOperands == 2U)
-            {
-                emitBinaryOps(vm::kSUB);
-            }
-            else
-            {
-                emitUnaryOp(vm::kMINUS);
-            }
-        }
-        else if (opName == "*")
+        ASSERT(dynamic_cast<Null const*>(primitive->identity.get()));
+        identity = vm::vmNull;
+    }
+    return heap.make<vm::Builtin>(symbolName(name), primitive->unary, *primitive->binary, primitive->rightFold, identity,
+                                  primitive->foldIdentity);
+}
+
+namespace
+{
+// Bodies inlined are at most this many literals, variables, ifs and applications.
+constexpr size_t kInlineBudget = 16;
+// Inlined bodies calling other candidates are inlined too, up to this depth.
+constexpr size_t kMaxInlineDepth = 4;
+
+bool isLiteral(Expr const* exprPtr)
+{
+    return dynamic_cast<Number const*>(exprPtr) || dynamic_cast<String const*>(exprPtr) || dynamic_cast<Bool const*>(exprPtr)
+           || dynamic_cast<Symbol const*>(exprPtr) || dynamic_cast<Null const*>(exprPtr);
+}
+} // namespace
+
+std::optional<size_t> Compiler::inlineSize(ExprPtr const& expr)
+{
+    auto const exprPtr = expr.get();
+    if (isLiteral(exprPtr) || dynamic_cast<Variable const*>(exprPtr))
+    {
+        return 1;
+    }
+    std::vector<ExprPtr> subexprs;
+    if (auto ifPtr = dynamic_cast<If const*>(exprPtr))
+    {
+        subexprs = {ifPtr->mPredicate, ifPtr->mConsequent, ifPtr->mAlternative};
+    }
+    else if (auto appPtr = dynamic_cast<Application const*>(exprPtr))
+    {
+        subexprs = appPtr->mOperands;
+        subexprs.push_back(appPtr->mOperator);
+    }
+    else
+    {
+        return {};
+    }
+    size_t size = 1;
+    for (auto const& subexpr : subexprs)
+    {
+        auto const subSize = inlineSize(subexpr);
+        if (!subSize)
         {
-            emitBinaryOps(vm::kMUL);
+            return {};
         }
-        else if (opName == "/")
+        size += *subSize;
+    }
+    return size;
+}
+
+void Compiler::variables(ExprPtr const& expr, std::vector<SymbolId>& result)
+{
+    auto const exprPtr = expr.get();
+    if (auto variablePtr = dynamic_cast<Variable const*>(exprPtr))
+    {
+        result.push_back(variablePtr->id());
+    }
+    else if (auto ifPtr = dynamic_cast<If const*>(exprPtr))
+    {
+        variables(ifPtr->mPredicate, result);
+        variables(ifPtr->mConsequent, result);
+        variables(ifPtr->mAlternative, result);
+    }
+    else if (auto appPtr = dynamic_cast<Application const*>(exprPtr))
+    {
+        for (auto const& operand : appPtr->mOperands)
         {
-            ASSERT(nbOperands == 2U);
-            emitBinaryOps(vm::kDIV);
+            variables(operand, result);
         }
-        else if (opName == "%")
+        // The operator of a primitive op is compiled to its op code, whatever the name is bound to.
+        auto const opPtr = dynamic_cast<Variable const*>(appPtr->mOperator.get());
+        if (!opPtr || !primitiveOp(opPtr->id()))
         {
-            ASSERT(nbOperands == 2U);
-            emitBinaryOps(vm::kMOD);
+            variables(appPtr->mOperator, result);
         }
-        else if (opName == "=")
+    }
+}
+
+Compiler::Reach Compiler::firstReach(ExprPtr const& expr, SymbolId param)
+{
+    auto const exprPtr = expr.get();
+    if (auto variablePtr = dynamic_cast<Variable const*>(exprPtr))
+    {
+        return variablePtr->id() == param ? Reach::kFOUND : Reach::kNONE;
+    }
+    if (auto ifPtr = dynamic_cast<If const*>(exprPtr))
+    {
+        auto const reach = firstReach(ifPtr->mPredicate, param);
+        // Either branch may run.
+        return reach == Reach::kNONE ? Reach::kBLOCKED : reach;
+    }
+    if (auto appPtr = dynamic_cast<Application const*>(exprPtr))
+    {
+        for (auto const& operand : appPtr->mOperands)
         {
-            ASSERT(nbOperands == 2U);
-            emitBinaryOps(vm::kEQUAL);
+            auto const reach = firstReach(operand, param);
+            if (reach != Reach::kNONE)
+            {
+                return reach;
+            }
         }
-        else if (opName == "eq?")
+        auto const opPtr = dynamic_cast<Variable const*>(appPtr->mOperator.get());
+        if (!opPtr || !primitiveOp(opPtr->id()))
         {
-            ASSERT(nbOperands == 2U);
-            emitBinaryOps(vm::kEQUAL);
+            auto const reach = firstReach(appPtr->mOperator, param);
+            if (reach != Reach::kNONE)
+            {
+                return reach;
+            }
         }
-        else if (opName == "<")
+        // The op or the call has effects.
+        return Reach::kBLOCKED;
+    }
+    return Reach::kNONE;
+}
+
+void Compiler::addInlineCandidate(SymbolId name, size_t index, LambdaBase<CompoundProcedure> const& lambda)
+{
+    auto const& [params, variadic] = lambda.mArguments;
+    auto const& actions = lambda.mBody->mActions;
+    if (variadic || actions.size() != 1)
+    {
+        return;
+    }
+    auto const size = inlineSize(actions.front());
+    if (!size || *size > kInlineBudget)
+    {
+        return;
+    }
+    InlineCandidate candidate{index, params, actions.front(), {}};
+    std::vector<SymbolId> vars;
+    variables(candidate.body, vars);
+    for (auto const var : vars)
+    {
+        if (std::find(params.begin(), params.end(), var) != params.end())
         {
-            ASSERT(nbOperands == 2U);
-            emitBinaryOps(vm::kLESS_THAN);
+            continue;
         }
-        else if (opName == "not")
+        auto const varInfo = mSymbolTable.resolve(var);
+        // Recursive, or not a global yet.
+        if (var == name || !varInfo || varInfo->second != Scope::kGLOBAL)
         {
-            ASSERT(nbOperands == 1U);
-            emitUnaryOp(vm::kNOT);
+            return;
         }
-        else if (opName == "cons")
+        candidate.globals.emplace_back(var, varInfo->first);
+    }
+    mInlineCandidates.insert_or_assign(name, std::move(candidate));
+}
+
+ExprPtr const* Compiler::inlineArgument(SymbolId name) const
+{
+    if (mInlineFrames.empty())
+    {
+        return nullptr;
+    }
+    auto const& frame = mInlineFrames.back();
+    auto const& params = frame.candidate.params;
+    auto const iter = std::find(params.begin(), params.end(), name);
+    return iter == params.end() ? nullptr : &frame.args->at(static_cast<size_t>(iter - params.begin()));
+}
+
+bool Compiler::isPure(ExprPtr const& expr, size_t nbFrames) const
+{
+    if (isLiteral(expr.get()))
+    {
+        return true;
+    }
+    auto const variablePtr = dynamic_cast<Variable const*>(expr.get());
+    if (!variablePtr)
+    {
+        return false;
+    }
+    if (nbFrames > 0)
+    {
+        // A parameter of the body being inlined stands for an argument of the call.
+        auto const& frame = mInlineFrames.at(nbFrames - 1);
+        auto const& params = frame.candidate.params;
+        auto const iter = std::find(params.begin(), params.end(), variablePtr->id());
+        if (iter != params.end())
         {
-            ASSERT(nbOperands == 2U);
-            emitBinaryOps(vm::kCONS);
+            return isPure(frame.args->at(static_cast<size_t>(iter - params.begin())), nbFrames - 1);
         }
-        else if (opName == "car")
+    }
+    return true;
+}
+
+bool Compiler::inlineApplication(Application const& app, bool tail)
+{
+    auto const variablePtr = dynamic_cast<Variable const*>(app.mOperator.get());
+    if (!mOptions.inliner || !variablePtr || inlineArgument(variablePtr->id()) || mInlineFrames.size() >= kMaxInlineDepth)
+    {
+        return false;
+    }
+    auto const name = variablePtr->id();
+    auto const iter = mInlineCandidates.find(name);
+    if (iter == mInlineCandidates.end() || iter->second.params.size() != app.mOperands.size())
+    {
+        return false;
+    }
+    auto const candidate = iter->second;
+    if (std::any_of(mInlineFrames.begin(), mInlineFrames.end(), [name](InlineFrame const& frame) { return frame.name == name; }))
+    {
+        return false;
+    }
+    // The procedure and the globals of its body are the ones it was defined with, not redefined or shadowed.
+    auto const sameGlobal = [this](SymbolId var, size_t index)
+    {
+        auto const varInfo = symbolTable().resolve(var);
+        return varInfo && varInfo->second == Scope::kGLOBAL && varInfo->first == index;
+    };
+    if (!sameGlobal(name, candidate.index)
+        || !std::all_of(candidate.globals.begin(), candidate.globals.end(), [&sameGlobal](auto const& global)
+                        { return sameGlobal(global.first, global.second); }))
+    {
+        return false;
+    }
+    // Arguments are evaluated once, in order: only one may have effects, its parameter must be used once and
+    // before anything else with effects.
+    std::vector<SymbolId> vars;
+    variables(candidate.body, vars);
+    size_t nbImpure = 0;
+    for (size_t i = 0; i < app.mOperands.size(); ++i)
+    {
+        if (isPure(app.mOperands[i], mInlineFrames.size()))
         {
-            ASSERT(nbOperands == 1U);
-            emitUnaryOp(vm::kCAR);
+            continue;
         }
-        else if (opName == "cdr")
+        auto const param = candidate.params[i];
+        if (++nbImpure > 1 || std::count(vars.begin(), vars.end(), param) != 1
+            || firstReach(candidate.body, param) != Reach::kFOUND)
         {
-            ASSERT(nbOperands == 1U);
-            emitUnaryOp(vm::kCDR);
+            return false;
         }
-        else if (opName == "cons?")
+    }
+    mInlineFrames.push_back({name, candidate, &app.mOperands});
+    compile(candidate.body, tail);
+    mInlineFrames.pop_back();
+    ++mInlinedCalls;
+    return true;
+}
+
+PrimitiveOp const* Compiler::primitive(SymbolId name)
+{
+    auto const result = primitiveOp(name);
+    if (!result || inlineArgument(name))
+    {
+        return nullptr;
+    }
+    // The other names of a body being inlined are resolved where it was defined, at the top level, whatever the
+    // caller binds: the primitive ops it was compiled with.
+    if (!mInlineFrames.empty())
+    {
+        return result;
+    }
+    auto const varInfo = symbolTable().resolve(name);
+    return !varInfo || varInfo->second == Scope::kGLOBAL ? result : nullptr;
+}
+
+void Compiler::emitApplication(Application const& app, bool tail)
+{
+    auto nbOperands = app.mOperands.size();
+    auto const emitUnaryOp = [&app, this, nbOperands](vm::OpCode opCode)
+    {
+        ASSERT (nbOperands == 1)
+        compile(app.mOperands.at(0), /* tail = */ false);
+        instructions().push_back(static_cast<vm::OpCode>(opCode));
+    };
+    auto const emitBinaryOps = [&app, this](PrimitiveOp const& primitive)
+    {
+        auto operands = app.mOperands;
+        if (primitive.foldIdentity || operands.empty())
         {
-            ASSERT(nbOperands == 1U);
-            emitUnaryOp(vm::kIS_CONS);
+            ASSERT_MSG(primitive.identity, "Missing operands!");
+            operands.push_back(primitive.identity);
         }
-        else if (opName == "null?")
+        // The operands are evaluated in order either way, a right fold runs its ops once they are all pushed.
+        compile(operands.at(0), /* tail = */ false);
+        for (size_t i = 1; i < operands.size(); ++i)
         {
-            ASSERT(nbOperands == 1U);
-            emitUnaryOp(vm::kIS_NULL);
+            compile(operands.at(i), /* tail = */ false);
+            if (!primitive.rightFold)
+            {
+                instructions().push_back(*primitive.binary);
+            }
         }
-        else if (opName == "print")
+        if (primitive.rightFold)
         {
-            ASSERT(nbOperands == 1U);
-            emitUnaryOp(vm::kPRINT);
+            instructions().insert(instructions().end(), operands.size() - 1, *primitive.binary);
         }
-        else if (opName == "error")
+    };
+    // primitive procedure
+    auto const primitive = [&app, this]() -> PrimitiveOp const*
+    {
+        auto const variablePtr = dynamic_cast<Variable const*>(app.mOperator.get());
+        return variablePtr ? this->primitive(variablePtr->id()) : nullptr;
+    }();
+    bool const isPrimitive = primitive != nullptr;
+    if (isPrimitive)
+    {
+        if (nbOperands == 1U && primitive->unary)
         {
-            ASSERT(nbOperands == 1U);
-            emitUnaryOp(vm::kERROR);
+            emitUnaryOp(primitive->unary.value());
         }
         else
         {
-            isPrimitive = false;
+            ASSERT(primitive->binary.has_value());
+            ASSERT(primitive->variadic || nbOperands == 2U);
+            emitBinaryOps(*primitive);
         }
     }
     // lambda procedure.
-    if (isPrimitive == false)
+    if (isPrimitive == false && !inlineApplication(app, tail))
     {
         for (auto const &o : app.mOperands)
         {
-            compile(o);
+            compile(o, /* tail = */ false);
         }
-        compile(app.mOperator);
-        instructions().push_back(vm::kCALL);
+        compile(app.mOperator, /* tail = */ false);
+        instructions().push_back(tail ? vm::kTAIL_CALL : vm::kCALL);
         emitIndex(app.mOperands.size());
     }
 }
 
-void Compiler::compile(ExprPtr const& expr)
+void Compiler::compile(ExprPtr const& expr, bool tail)
 {
     auto const exprPtr = expr.get();
     if (auto numPtr = dynamic_cast<Number const*>(exprPtr))
     {
-        auto const index = mCode.constantPool.size();
-        mCode.constantPool.push_back(vm::Double{numPtr->get()});
-        instructions().push_back(vm::kCONST);
-        emitIndex(index);
+        // Integral literals are fixnums, carried in the instruction instead of the constant pool.
+        auto const value = numPtr->get();
+        if (isFixnum(value))
+        {
+            instructions().push_back(vm::kICONST);
+            emitIndex(static_cast<uint32_t>(static_cast<int32_t>(value)));
+            return;
+        }
+        emitConstant(vm::kCONST, [value](ConstantPool& pool) { return pool.add(value); });
         return;
     }
     if (auto symPtr = dynamic_cast<Symbol const*>(exprPtr))
     {
-        auto const index = mCode.constantPool.size();
-        mCode.constantPool.push_back(vm::Symbol{symPtr->toString()});
-        instructions().push_back(vm::kCONST);
-        emitIndex(index);
+        emitConstant(vm::kCONST, [symPtr](ConstantPool& pool) { return pool.add(vm::Symbol{symPtr->id()}); });
         return;
     }
     if (auto strPtr = dynamic_cast<String const*>(exprPtr))
     {
-        auto const index = mCode.constantPool.size();
-        mCode.constantPool.push_back(vm::String{strPtr->get()});
-        instructions().push_back(vm::kCONST);
-        emitIndex(index);
+        emitConstant(vm::kCONST, [strPtr, this](ConstantPool& pool) { return pool.add(strPtr->get(), *mCode.constants); });
         return;
     }
     if (auto boolPtr = dynamic_cast<Bool const*>(exprPtr))
@@ -209,11 +461,21 @@ void Compiler::compile(ExprPtr const& expr)
     {
         if (auto lambdaPtr = dynamic_cast<LambdaBase<CompoundProcedure>*>(defPtr->mValue.get()))
         {
-            lambdaPtr->setName(defPtr->mVariableName);
+            lambdaPtr->setName(symbolName(defPtr->mVariableName));
         }
-        compile(defPtr->mValue);
+        compile(defPtr->mValue, /* tail = */ false);
         auto [index, scope] = define(defPtr->mVariableName);
         ASSERT (scope != Scope::kFUNCTION_SELF_REF);
+        if (scope == Scope::kGLOBAL)
+        {
+            // Calls compiled from now on refer to this definition.
+            mInlineCandidates.erase(defPtr->mVariableName);
+            auto const lambdaPtr = dynamic_cast<LambdaBase<CompoundProcedure> const*>(defPtr->mValue.get());
+            if (lambdaPtr && mOptions.inliner)
+            {
+                addInlineCandidate(defPtr->mVariableName, index, *lambdaPtr);
+            }
+        }
         auto setIns = scope == Scope::kLOCAL ? vm::kSET_LOCAL : vm::kSET_GLOBAL;
         instructions().push_back(setIns);
         emitIndex(index);
@@ -221,8 +483,23 @@ void Compiler::compile(ExprPtr const& expr)
     }
     if (auto variablePtr = dynamic_cast<Variable const*>(exprPtr))
     {
-        auto const name = variablePtr->name();
-        auto const varInfo = resolve(name);
+        if (auto const arg = inlineArgument(variablePtr->id()))
+        {
+            // The argument belongs to the caller, outside of the body being inlined.
+            auto frame = std::move(mInlineFrames.back());
+            mInlineFrames.pop_back();
+            compile(*arg, tail);
+            mInlineFrames.push_back(std::move(frame));
+            return;
+        }
+        // A variadic primitive used as a value.
+        if (auto const primitivePtr = primitive(variablePtr->id()); primitivePtr && primitivePtr->variadic)
+        {
+            emitConstant(vm::kCONST, [variablePtr, this](ConstantPool& pool)
+                         { return pool.addBuiltin(variablePtr->id(), *mCode.constants); });
+            return;
+        }
+        auto const varInfo = resolve(variablePtr->id());
         if (varInfo.second == Scope::kFUNCTION_SELF_REF)
         {
             instructions().push_back(vm::kCURRENT_FUNCTION);
@@ -233,7 +510,7 @@ void Compiler::compile(ExprPtr const& expr)
     }
     if (auto ifPtr = dynamic_cast<If const*>(exprPtr))
     {
-        compile(ifPtr->mPredicate);
+        compile(ifPtr->mPredicate, /* tail = */ false);
         instructions().push_back(vm::kJUMP_IF_NOT_TRUE);
         // jump to alternative
         auto const jump0OperandIndex = instructions().size();
@@ -241,7 +518,7 @@ void Compiler::compile(ExprPtr const& expr)
         {
             instructions().push_back(0);
         }
-        compile(ifPtr->mConsequent);
+        compile(ifPtr->mConsequent, tail);
         instructions().push_back(vm::kJUMP);
         // jump to post alternative
         auto const jump1OperandIndex = instructions().size();
@@ -258,7 +535,7 @@ void Compiler::compile(ExprPtr const& expr)
                 instructions().at(jump0OperandIndex + i) = bytes[i];
             }
         }
-        compile(ifPtr->mAlternative);
+        compile(ifPtr->mAlternative, tail);
         // update jump1
         {
             auto const postAlterPos = instructions().size();
@@ -272,9 +549,10 @@ void Compiler::compile(ExprPtr const& expr)
     }
     if (auto seqPtr = dynamic_cast<Sequence const*>(exprPtr))
     {
-        for (auto const& e : seqPtr->mActions)
+        auto const& actions = seqPtr->mActions;
+        for (size_t i = 0; i < actions.size(); ++i)
         {
-            compile(e);
+            compile(actions.at(i), tail && i + 1 == actions.size());
             // todo, some actions push stack, some do not. Those pushing stack should pop their values.
         }
         return;
@@ -286,7 +564,7 @@ void Compiler::compile(ExprPtr const& expr)
         mFuncStack.push(funcInfo);
         if (!lambdaPtr->mName.empty())
         {
-            defineCurrentFunction(lambdaPtr->mName);
+            defineCurrentFunction(intern(lambdaPtr->mName));
         }
         auto const& [args, variadic] = lambdaPtr->mArguments;
         for (auto const& arg : args)
@@ -294,27 +572,34 @@ void Compiler::compile(ExprPtr const& expr)
             auto [_, scope] = define(arg);
             ASSERT(scope == Scope::kLOCAL);
         }
-        compile(lambdaPtr->mBody);
+        compile(lambdaPtr->mBody, /* tail = */ true);
         instructions().push_back(vm::kRET);
-        auto funcInstructions = std::get<0>(mFuncStack.top());
+        auto funcInstructions = std::move(std::get<0>(mFuncStack.top()));
+        auto funcConstants = std::get<2>(mFuncStack.top()).release();
         auto const freeVars = symbolTable().freeVariables();
         auto const nbLocals = symbolTable().nbDefinitions() - args.size();
         mFuncStack.pop();
+        if (mOptions.peephole)
+        {
+            vm::optimize(funcInstructions, funcConstants, mPeepholeStats);
+        }
+        if (mOptions.superinstructions)
+        {
+            vm::selectSuperinstructions(funcInstructions);
+        }
         for (auto f : freeVars)
         {
             emitVar(f);
         }
-        auto const index = mCode.constantPool.size();
-        auto const funcSym = vm::FunctionSymbol{lambdaPtr->mName, args.size(), variadic, nbLocals, funcInstructions};
-        mCode.constantPool.push_back(funcSym);
-        instructions().push_back(vm::kCLOSURE);
-        emitIndex(index);
+        auto const funcSym = mCode.constants->make<vm::FunctionSymbol>(lambdaPtr->mName, args.size(), variadic, nbLocals,
+                                                                       std::move(funcInstructions), std::move(funcConstants));
+        emitConstant(vm::kCLOSURE, [funcSym](ConstantPool& pool) { return pool.add(funcSym); });
         emitIndex(freeVars.size());
         return;
     }
     if (auto appPtr = dynamic_cast<Application const*>(exprPtr))
     {
-        emitApplication(*appPtr);
+        emitApplication(*appPtr, tail);
         return;
     }
     if (dynamic_cast<Null const*>(exprPtr))
@@ -324,14 +609,14 @@ void Compiler::compile(ExprPtr const& expr)
     }
     if (auto consPtr = dynamic_cast<Cons const*>(exprPtr))
     {
-        compile(consPtr->car());
-        compile(consPtr->cdr());
+        compile(consPtr->car(), /* tail = */ false);
+        compile(consPtr->cdr(), /* tail = */ false);
         instructions().push_back(vm::kCONS);
         return;
     }
     if (auto splicingPtr = dynamic_cast<Splicing const*>(exprPtr))
     {
-        compile(splicingPtr->get());
+        compile(splicingPtr->get(), /* tail = */ false);
         instructions().push_back(vm::kSPLICING);
         return;
     }
@@ -1,5 +1,8 @@
 #include "lisp/evaluator.h"
 #include "lisp/parser.h"
+#include <cmath>
+#include <cstring>
+#include <typeinfo>
 
 ExprPtr true_()
 {
@@ -13,30 +16,236 @@ ExprPtr false_()
     return f;
 }
 
+ExprPtr number(double value)
+{
+    constexpr int32_t kMinCached = -128;
+    constexpr int32_t kMaxCached = 1024;
+    static auto const cache = []
+    {
+        std::vector<ExprPtr> numbers;
+        for (auto i = kMinCached; i <= kMaxCached; ++i)
+        {
+            numbers.push_back(ExprPtr{new Number{static_cast<double>(i)}});
+        }
+        return numbers;
+    }();
+    if (value >= kMinCached && value <= kMaxCached && std::trunc(value) == value && !(value == 0 && std::signbit(value)))
+    {
+        return cache[static_cast<size_t>(static_cast<int32_t>(value) - kMinCached)];
+    }
+    return std::make_shared<Number>(value);
+}
+
+CellPool& consPool()
+{
+    // Room for a Cons and the control block of its shared_ptr.
+    // Never destroyed: static environments still release cells at exit.
+    static auto const pool = new CellPool{80};
+    return *pool;
+}
+
+ExprPtr makeCons(ExprPtr const& car, ExprPtr const& cdr)
+{
+    return std::allocate_shared<Cons>(PoolAllocator<Cons>{consPool()}, car, cdr);
+}
+
 ExprPtr null()
 {
     static ExprPtr n{new Null{}};
     return n;
 }
 
+namespace
+{
+size_t& evalDepthLimit()
+{
+    static size_t limit = 10000;
+    return limit;
+}
+
+size_t& evalDepth()
+{
+    static size_t depth = 0;
+    return depth;
+}
+} // namespace
+
+EvalDepthGuard::EvalDepthGuard()
+{
+    if (++evalDepth() > evalDepthLimit())
+    {
+        --evalDepth();
+        throw std::runtime_error{"maximum recursion depth " + std::to_string(evalDepthLimit()) + " exceeded"};
+    }
+}
+
+EvalDepthGuard::~EvalDepthGuard()
+{
+    --evalDepth();
+}
+
+size_t maxEvalDepth()
+{
+    return evalDepthLimit();
+}
+
+void setMaxEvalDepth(size_t depth)
+{
+    evalDepthLimit() = depth;
+}
+
+ExprPtr evalTrampoline(Expr& expr, std::shared_ptr<Env> const& env)
+{
+    EvalDepthGuard guard;
+    TailCall tail{};
+    auto result = expr.evalStep(env, tail);
+    while (tail.expr)
+    {
+        // Keep the expression and its environment alive while evaluating it, tail is overwritten by the step.
+        auto current = std::move(tail);
+        tail = TailCall{};
+        result = current.expr->evalStep(current.env, tail);
+    }
+    return result;
+}
+
+ExprPtr analyze(ExprPtr const& expr)
+{
+    expr->analyze(nullptr);
+    return expr;
+}
+
 ExprPtr Definition::eval(std::shared_ptr<Env> const& env)
 {
+    if (mSlot)
+    {
+        return env->defineVariable(*mSlot, mVariableName, mValue->eval(env));
+    }
     return env->defineVariable(mVariableName, mValue->eval(env));
 }
 
 
+namespace
+{
+size_t hashCombine(size_t seed, size_t value)
+{
+    return seed ^ (value + 0x9E3779B97F4A7C15ULL + (seed << 6) + (seed >> 2));
+}
+
+uint64_t numberBits(Number const& num)
+{
+    auto const value = num.get();
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+size_t atomHash(Expr const* expr)
+{
+    if (auto num = dynamic_cast<Number const*>(expr))
+    {
+        return hashCombine(1, std::hash<uint64_t>{}(numberBits(*num)));
+    }
+    if (auto str = dynamic_cast<String const*>(expr))
+    {
+        return hashCombine(2, std::hash<std::string>{}(str->get()));
+    }
+    if (auto word = dynamic_cast<RawWord const*>(expr))
+    {
+        return hashCombine(dynamic_cast<Symbol const*>(expr) ? 3 : 4, word->id());
+    }
+    // Booleans and null are shared.
+    return std::hash<Expr const*>{}(expr);
+}
+
+bool sameAtom(Expr const* lhs, Expr const* rhs)
+{
+    if (lhs == rhs)
+    {
+        return true;
+    }
+    if (typeid(*lhs) != typeid(*rhs))
+    {
+        return false;
+    }
+    if (auto num = dynamic_cast<Number const*>(lhs))
+    {
+        return numberBits(*num) == numberBits(static_cast<Number const&>(*rhs));
+    }
+    if (auto str = dynamic_cast<String const*>(lhs))
+    {
+        return str->get() == static_cast<String const&>(*rhs).get();
+    }
+    if (auto word = dynamic_cast<RawWord const*>(lhs))
+    {
+        return word->id() == static_cast<RawWord const&>(*rhs).id();
+    }
+    return false;
+}
+} // namespace
+
+size_t formHash(ExprPtr const& expr)
+{
+    size_t hash = 0;
+    auto e = expr.get();
+    // Along the list, so that long lists do not recurse.
+    while (auto cons = dynamic_cast<Cons const*>(e))
+    {
+        hash = hashCombine(hash, formHash(cons->car()));
+        e = cons->cdr().get();
+    }
+    return hashCombine(hash, atomHash(e));
+}
+
+bool sameForm(ExprPtr const& lhs, ExprPtr const& rhs)
+{
+    auto l = lhs.get();
+    auto r = rhs.get();
+    while (l != r)
+    {
+        auto const lCons = dynamic_cast<Cons const*>(l);
+        auto const rCons = dynamic_cast<Cons const*>(r);
+        if (!lCons || !rCons)
+        {
+            return !lCons && !rCons && sameAtom(l, r);
+        }
+        if (!sameForm(lCons->car(), rCons->car()))
+        {
+            return false;
+        }
+        l = lCons->cdr().get();
+        r = rCons->cdr().get();
+    }
+    return true;
+}
+
 ExprPtr MacroProcedure::apply(std::vector<std::shared_ptr<Expr> > const &args)
 {
-    auto result = CompoundProcedureBase::apply(args);
-    return transform(result, [](ExprPtr const& expr)
+    size_t hash = args.size();
+    for (auto const& arg : args)
+    {
+        hash = hashCombine(hash, formHash(arg));
+    }
+    auto const [begin, end] = mExpansions.equal_range(hash);
+    for (auto iter = begin; iter != end; ++iter)
+    {
+        auto const& cachedArgs = iter->second.args;
+        if (std::equal(cachedArgs.begin(), cachedArgs.end(), args.begin(), args.end(), sameForm))
+        {
+            return iter->second.result;
+        }
+    }
+    auto result = transform(CompoundProcedureBase::apply(args), [](ExprPtr const& expr)
         {
             if (auto s = dynamic_cast<Symbol const*>(expr.get()))
             {
-                return ExprPtr{new RawWord{s->get()}};
+                return ExprPtr{new RawWord{s->id()}};
             }
             return expr;
         }
     );
+    mExpansions.emplace(hash, Expansion{args, result});
+    return result;
 }
 
 ExprPtr vecToCons(std::vector<ExprPtr> const& vec)
@@ -48,7 +257,8 @@ ExprPtr vecToCons(std::vector<ExprPtr> const& vec)
     {
         auto dot = vec.at(vecSize - 2);
         auto dotPtr = dynamic_cast<RawWord*>(dot.get());
-        if (dotPtr != nullptr && dotPtr->toString() == ".")
+        static auto const dotId = intern(".");
+        if (dotPtr != nullptr && dotPtr->id() == dotId)
         {
             ASSERT(vecSize >=3);
             ++i;
@@ -58,7 +268,7 @@ ExprPtr vecToCons(std::vector<ExprPtr> const& vec)
     }
     for (;i != vec.rend(); ++i)
     {
-        result = ExprPtr{new Cons{*i, result}};
+        result = makeCons(*i, result);
     }
     return result;
 }
@@ -78,27 +288,29 @@ std::vector<ExprPtr> consToVec(ExprPtr const& expr)
 
 auto expandMacros(ExprPtr const& expr, std::shared_ptr<Env> const& env) -> ExprPtr
 {
-    if (auto macroDefinition = parseMacroDefinition(expr))
+    // Atoms have nothing to expand, lists not headed by a word are only walked.
+    auto const c = dynamic_cast<Cons const*>(expr.get());
+    if (!c)
     {
-        macroDefinition->eval(env);
-        return null();
+        return expr;
     }
-    if (auto e = tryMacroCall(expr, env))
+    if (dynamic_cast<RawWord const*>(c->car().get()))
     {
-        if (e != expr)
+        if (auto macroDefinition = parseMacroDefinition(expr))
+        {
+            macroDefinition->eval(env);
+            return null();
+        }
+        if (auto e = tryMacroCall(expr, env); e != expr)
         {
             return e;
         }
     }
-    if (auto c = dynamic_cast<Cons const*>(expr.get()))
+    auto carResult = expandMacros(c->car(), env);
+    auto cdrResult = expandMacros(c->cdr(), env);
+    if (carResult == c->car() && cdrResult == c->cdr())
     {
-        auto carResult = expandMacros(c->car(), env);
-        auto cdrResult = expandMacros(c->cdr(), env);
-        if (carResult == c->car() && cdrResult == c->cdr())
-        {
-            return expr;
-        }
-        return ExprPtr{new Cons{carResult, cdrResult}};
+        return expr;
     }
-    return expr;
+    return makeCons(carResult, cdrResult);
 }
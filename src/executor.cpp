@@ -0,0 +1,332 @@
+#include "lisp/executor.h"
+#include <array>
+
+ExprPtr executeTrampoline(Executor const& executor, std::shared_ptr<Env> const& env)
+{
+    EvalDepthGuard guard;
+    ExecutorTailCall tail{};
+    auto result = executor.executeStep(env, tail);
+    while (tail.executor)
+    {
+        // Keep the executor and its environment alive while running it, tail is overwritten by the step.
+        auto current = std::move(tail);
+        tail = ExecutorTailCall{};
+        result = current.executor->executeStep(current.env, tail);
+    }
+    return result;
+}
+
+namespace
+{
+class ConstantExecutor final : public Executor
+{
+    ExprPtr mValue;
+public:
+    explicit ConstantExecutor(ExprPtr value)
+    : mValue{std::move(value)}
+    {}
+    ExprPtr execute(std::shared_ptr<Env> const& /* env */) const override
+    {
+        return mValue;
+    }
+};
+
+class GlobalVariableExecutor final : public Executor
+{
+    SymbolId mName;
+public:
+    explicit GlobalVariableExecutor(SymbolId name)
+    : mName{name}
+    {}
+    ExprPtr execute(std::shared_ptr<Env> const& env) const override
+    {
+        return env->lookupVariableValue(mName);
+    }
+};
+
+class LocalVariableExecutor final : public Executor
+{
+    LexicalAddress mAddress;
+    SymbolId mName;
+public:
+    LocalVariableExecutor(LexicalAddress address, SymbolId name)
+    : mAddress{address}
+    , mName{name}
+    {}
+    ExprPtr execute(std::shared_ptr<Env> const& env) const override
+    {
+        return env->lookupVariableValue(mAddress, mName);
+    }
+};
+
+class AssignmentExecutor final : public Executor
+{
+    std::optional<LexicalAddress> mAddress;
+    SymbolId mName;
+    ExecutorPtr mValue;
+public:
+    AssignmentExecutor(std::optional<LexicalAddress> address, SymbolId name, ExecutorPtr value)
+    : mAddress{address}
+    , mName{name}
+    , mValue{std::move(value)}
+    {}
+    ExprPtr execute(std::shared_ptr<Env> const& env) const override
+    {
+        if (mAddress)
+        {
+            return env->setVariableValue(*mAddress, mName, mValue->execute(env));
+        }
+        return env->setVariableValue(mName, mValue->execute(env));
+    }
+};
+
+class DefinitionExecutor final : public Executor
+{
+    std::optional<size_t> mSlot;
+    SymbolId mName;
+    ExecutorPtr mValue;
+public:
+    DefinitionExecutor(std::optional<size_t> slot, SymbolId name, ExecutorPtr value)
+    : mSlot{slot}
+    , mName{name}
+    , mValue{std::move(value)}
+    {}
+    ExprPtr execute(std::shared_ptr<Env> const& env) const override
+    {
+        if (mSlot)
+        {
+            return env->defineVariable(*mSlot, mName, mValue->execute(env));
+        }
+        return env->defineVariable(mName, mValue->execute(env));
+    }
+};
+
+class IfExecutor final : public Executor
+{
+    ExecutorPtr mPredicate;
+    ExecutorPtr mConsequent;
+    ExecutorPtr mAlternative;
+public:
+    IfExecutor(ExecutorPtr predicate, ExecutorPtr consequent, ExecutorPtr alternative)
+    : mPredicate{std::move(predicate)}
+    , mConsequent{std::move(consequent)}
+    , mAlternative{std::move(alternative)}
+    {}
+    ExprPtr execute(std::shared_ptr<Env> const& env) const override
+    {
+        return executeTrampoline(*this, env);
+    }
+    ExprPtr executeStep(std::shared_ptr<Env> const& env, ExecutorTailCall& tail) const override
+    {
+        auto const predicate = mPredicate->execute(env);
+        // The primitive predicates return the shared booleans, no need to look at the value.
+        auto const branch = predicate == true_() ? true : predicate == false_() ? false : isTrue(predicate);
+        tail = {branch ? mConsequent : mAlternative, env};
+        return {};
+    }
+};
+
+class SequenceExecutor final : public Executor
+{
+    std::vector<ExecutorPtr> mActions;
+public:
+    explicit SequenceExecutor(std::vector<ExecutorPtr> actions)
+    : mActions{std::move(actions)}
+    {
+        ASSERT(!mActions.empty());
+    }
+    ExprPtr execute(std::shared_ptr<Env> const& env) const override
+    {
+        return executeTrampoline(*this, env);
+    }
+    ExprPtr executeStep(std::shared_ptr<Env> const& env, ExecutorTailCall& tail) const override
+    {
+        for (size_t i = 0; i < mActions.size() - 1; ++i)
+        {
+            mActions[i]->execute(env);
+        }
+        tail = {mActions.back(), env};
+        return {};
+    }
+};
+
+class LambdaExecutor final : public Executor
+{
+    std::shared_ptr<Sequence> mBody;
+    Params mArguments;
+    size_t mFrameSize;
+    ExecutorPtr mBodyExecutor;
+public:
+    LambdaExecutor(std::shared_ptr<Sequence> body, Params arguments, size_t frameSize, ExecutorPtr bodyExecutor)
+    : mBody{std::move(body)}
+    , mArguments{std::move(arguments)}
+    , mFrameSize{frameSize}
+    , mBodyExecutor{std::move(bodyExecutor)}
+    {}
+    ExprPtr execute(std::shared_ptr<Env> const& env) const override
+    {
+        return ExprPtr{new ExecutorProcedure{mBody, mArguments, mFrameSize, env, mBodyExecutor}};
+    }
+};
+
+// Application with the number of operands known when analyzing: when the callee takes exactly that many
+// fixed parameters, the operands go straight into the slots of its frame.
+template <typename Operands>
+class ApplicationExecutor final : public Executor
+{
+    ExecutorPtr mOperator;
+    Operands mOperands;
+    // The operands as parsed, what a macro gets instead of their values.
+    std::vector<ExprPtr> mOperandExprs;
+    std::vector<ExprPtr> values(std::shared_ptr<Env> const& env) const
+    {
+        std::vector<ExprPtr> args;
+        args.reserve(mOperands.size());
+        for (auto const& operand : mOperands)
+        {
+            args.push_back(operand->execute(env));
+        }
+        return args;
+    }
+public:
+    ApplicationExecutor(ExecutorPtr op, Operands operands, std::vector<ExprPtr> operandExprs)
+    : mOperator{std::move(op)}
+    , mOperands{std::move(operands)}
+    , mOperandExprs{std::move(operandExprs)}
+    {}
+    ExprPtr execute(std::shared_ptr<Env> const& env) const override
+    {
+        return executeTrampoline(*this, env);
+    }
+    ExprPtr executeStep(std::shared_ptr<Env> const& env, ExecutorTailCall& tail) const override
+    {
+        auto const op = mOperator->execute(env);
+        if (auto proc = dynamic_cast<ExecutorProcedure const*>(op.get()))
+        {
+            if (!proc->variadic() && proc->nbParams() == mOperands.size())
+            {
+                std::vector<ExprPtr> slots(proc->frameSize());
+                for (size_t i = 0; i < mOperands.size(); ++i)
+                {
+                    slots[i] = mOperands[i]->execute(env);
+                }
+                tail = {proc->executor(), std::make_shared<Env>(std::move(slots), proc->environment())};
+                return {};
+            }
+            tail = {proc->executor(), proc->frame(values(env))};
+            return {};
+        }
+        if (auto macro = dynamic_cast<MacroProcedure*>(op.get()))
+        {
+            // Like Application::evalStep, the operands are not evaluated.
+            return macro->apply(listOfValues(mOperandExprs, env, /* isMacroCall = */ true));
+        }
+        return dynamic_cast<Procedure&>(*op).apply(values(env));
+    }
+};
+
+template <size_t... N>
+ExecutorPtr makeApplication(ExecutorPtr op, std::vector<ExecutorPtr> operands, std::vector<ExprPtr> const& operandExprs,
+                            std::index_sequence<N...>)
+{
+    ExecutorPtr result;
+    auto const tryFixed = [&](auto size)
+    {
+        if (operands.size() != size)
+        {
+            return false;
+        }
+        std::array<ExecutorPtr, decltype(size)::value> fixed;
+        std::move(operands.begin(), operands.end(), fixed.begin());
+        result = std::make_shared<ApplicationExecutor<decltype(fixed)>>(std::move(op), std::move(fixed), operandExprs);
+        return true;
+    };
+    if (!(tryFixed(std::integral_constant<size_t, N>{}) || ...))
+    {
+        result = std::make_shared<ApplicationExecutor<std::vector<ExecutorPtr>>>(std::move(op), std::move(operands),
+                                                                                 operandExprs);
+    }
+    return result;
+}
+
+// Everything without a specialized executor (quasiquotes, macros) is evaluated as is.
+class EvalExecutor final : public Executor
+{
+    ExprPtr mExpr;
+public:
+    explicit EvalExecutor(ExprPtr expr)
+    : mExpr{std::move(expr)}
+    {}
+    ExprPtr execute(std::shared_ptr<Env> const& env) const override
+    {
+        return mExpr->eval(env);
+    }
+};
+} // namespace
+
+ExecutorPtr Analyzer::analyze(ExprPtr const& expr)
+{
+    auto const exprPtr = expr.get();
+    if (auto boolPtr = dynamic_cast<Bool const*>(exprPtr))
+    {
+        return std::make_shared<ConstantExecutor>(boolPtr->get() ? true_() : false_());
+    }
+    if (dynamic_cast<Number const*>(exprPtr) || dynamic_cast<String const*>(exprPtr) || dynamic_cast<Symbol const*>(exprPtr))
+    {
+        return std::make_shared<ConstantExecutor>(expr);
+    }
+    if (dynamic_cast<Null const*>(exprPtr))
+    {
+        return std::make_shared<ConstantExecutor>(null());
+    }
+    if (auto variablePtr = dynamic_cast<Variable const*>(exprPtr))
+    {
+        if (variablePtr->mAddress)
+        {
+            return std::make_shared<LocalVariableExecutor>(*variablePtr->mAddress, variablePtr->mName);
+        }
+        return std::make_shared<GlobalVariableExecutor>(variablePtr->mName);
+    }
+    if (auto assignmentPtr = dynamic_cast<Assignment const*>(exprPtr))
+    {
+        return std::make_shared<AssignmentExecutor>(assignmentPtr->mAddress, assignmentPtr->mVariableName, analyze(assignmentPtr->mValue));
+    }
+    if (auto definitionPtr = dynamic_cast<Definition const*>(exprPtr))
+    {
+        return std::make_shared<DefinitionExecutor>(definitionPtr->mSlot, definitionPtr->mVariableName, analyze(definitionPtr->mValue));
+    }
+    if (auto ifPtr = dynamic_cast<If const*>(exprPtr))
+    {
+        return std::make_shared<IfExecutor>(analyze(ifPtr->mPredicate), analyze(ifPtr->mConsequent), analyze(ifPtr->mAlternative));
+    }
+    if (auto sequencePtr = dynamic_cast<Sequence const*>(exprPtr))
+    {
+        std::vector<ExecutorPtr> actions;
+        for (auto const& action : sequencePtr->mActions)
+        {
+            actions.push_back(analyze(action));
+        }
+        return std::make_shared<SequenceExecutor>(std::move(actions));
+    }
+    if (auto lambdaPtr = dynamic_cast<LambdaBase<CompoundProcedure> const*>(exprPtr))
+    {
+        ASSERT(lambdaPtr->mFrameSize);
+        return std::make_shared<LambdaExecutor>(lambdaPtr->mBody, lambdaPtr->mArguments, *lambdaPtr->mFrameSize, analyze(lambdaPtr->mBody));
+    }
+    if (auto appPtr = dynamic_cast<Application const*>(exprPtr))
+    {
+        std::vector<ExecutorPtr> operands;
+        for (auto const& operand : appPtr->mOperands)
+        {
+            operands.push_back(analyze(operand));
+        }
+        return makeApplication(analyze(appPtr->mOperator), std::move(operands), appPtr->mOperands,
+                               std::make_index_sequence<4>{});
+    }
+    return std::make_shared<EvalExecutor>(expr);
+}
+
+ExecutorPtr makeExecutor(ExprPtr const& expr)
+{
+    return Analyzer::analyze(::analyze(expr));
+}
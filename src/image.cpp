@@ -0,0 +1,401 @@
+#include "lisp/image.h"
+
+namespace
+{
+constexpr std::string_view kMagic = "LISPIMG";
+// Bumped whenever the layout written below changes.
+constexpr uint32_t kVersion = 3;
+
+enum class ExprTag : uint8_t
+{
+    kNUMBER,
+    kSTRING,
+    kTRUE,
+    kFALSE,
+    kNULL,
+    kWORD,
+    kSYMBOL,
+    kLIST,
+    kVARIABLE,
+    kIF,
+    kAPPLICATION,
+};
+
+bool operator==(CompilerOptions const& lhs, CompilerOptions const& rhs)
+{
+    return lhs.astOptimizer == rhs.astOptimizer && lhs.peephole == rhs.peephole
+           && lhs.superinstructions == rhs.superinstructions && lhs.inliner == rhs.inliner;
+}
+} // namespace
+
+// Expressions and compiler state, on top of the encoding of values and code.
+class ImageWriter : public vm::ByteWriter
+{
+public:
+    void expr(ExprPtr const& expr);
+    void options(Compiler const& compiler);
+    void compiler(Compiler const& compiler);
+};
+
+void ImageWriter::expr(ExprPtr const& expr)
+{
+    auto const exprPtr = expr.get();
+    if (auto numPtr = dynamic_cast<Number const*>(exprPtr))
+    {
+        tag(ExprTag::kNUMBER);
+        real(numPtr->get());
+    }
+    else if (auto strPtr = dynamic_cast<String const*>(exprPtr))
+    {
+        tag(ExprTag::kSTRING);
+        string(strPtr->get());
+    }
+    else if (auto boolPtr = dynamic_cast<Bool const*>(exprPtr))
+    {
+        tag(boolPtr->get() ? ExprTag::kTRUE : ExprTag::kFALSE);
+    }
+    else if (dynamic_cast<Null const*>(exprPtr))
+    {
+        tag(ExprTag::kNULL);
+    }
+    else if (auto symPtr = dynamic_cast<Symbol const*>(exprPtr))
+    {
+        tag(ExprTag::kSYMBOL);
+        symbol(symPtr->id());
+    }
+    else if (auto wordPtr = dynamic_cast<RawWord const*>(exprPtr))
+    {
+        tag(ExprTag::kWORD);
+        symbol(wordPtr->id());
+    }
+    else if (dynamic_cast<Cons const*>(exprPtr))
+    {
+        // The elements then the tail, so that long lists do not recurse.
+        std::vector<ExprPtr> elements;
+        auto tail = expr;
+        while (auto consPtr = dynamic_cast<Cons const*>(tail.get()))
+        {
+            elements.push_back(consPtr->car());
+            tail = consPtr->cdr();
+        }
+        tag(ExprTag::kLIST);
+        size(elements.size());
+        for (auto const& element : elements)
+        {
+            this->expr(element);
+        }
+        this->expr(tail);
+    }
+    else if (auto variablePtr = dynamic_cast<Variable const*>(exprPtr))
+    {
+        tag(ExprTag::kVARIABLE);
+        symbol(variablePtr->id());
+    }
+    else if (auto ifPtr = dynamic_cast<If const*>(exprPtr))
+    {
+        tag(ExprTag::kIF);
+        this->expr(ifPtr->mPredicate);
+        this->expr(ifPtr->mConsequent);
+        this->expr(ifPtr->mAlternative);
+    }
+    else if (auto appPtr = dynamic_cast<Application const*>(exprPtr))
+    {
+        tag(ExprTag::kAPPLICATION);
+        this->expr(appPtr->mOperator);
+        size(appPtr->mOperands.size());
+        for (auto const& operand : appPtr->mOperands)
+        {
+            this->expr(operand);
+        }
+    }
+    else
+    {
+        FAIL_MSG("Not stored in images!", expr->toString());
+    }
+}
+
+void ImageWriter::options(Compiler const& compiler)
+{
+    auto const& options = compiler.mOptions;
+    flag(options.astOptimizer);
+    flag(options.peephole);
+    flag(options.superinstructions);
+    flag(options.inliner);
+}
+
+void ImageWriter::compiler(Compiler const& compiler)
+{
+    // Only the state left by top level expressions is stored.
+    ASSERT(compiler.mFuncStack.empty() && compiler.mInlineFrames.empty());
+    auto const& symbolTable = compiler.mSymbolTable;
+    ASSERT(!symbolTable.mEnclosing && symbolTable.mOrigFreeVars.empty());
+    size(symbolTable.mNbDefinitions);
+    size(symbolTable.mNameToVarInfo.size());
+    for (auto const& [name, varInfo] : symbolTable.mNameToVarInfo)
+    {
+        ASSERT(varInfo.second == Scope::kGLOBAL);
+        symbol(name);
+        size(varInfo.first);
+    }
+
+    instructions(compiler.mCode.instructions);
+    size(compiler.mConstantPool.size());
+    for (auto const& constant : compiler.mConstantPool.values())
+    {
+        object(constant);
+    }
+
+    size(compiler.mInlineCandidates.size());
+    for (auto const& [name, candidate] : compiler.mInlineCandidates)
+    {
+        symbol(name);
+        size(candidate.index);
+        size(candidate.params.size());
+        for (auto const param : candidate.params)
+        {
+            symbol(param);
+        }
+        expr(candidate.body);
+        size(candidate.globals.size());
+        for (auto const& [global, index] : candidate.globals)
+        {
+            symbol(global);
+            size(index);
+        }
+    }
+
+    auto const& constantPoolStats = compiler.mConstantPoolStats;
+    for (auto const value : {constantPoolStats.references, constantPoolStats.entries})
+    {
+        size(value);
+    }
+    auto const& astStats = compiler.mAstOptimizerStats;
+    for (auto const value : {astStats.constantsFolded, astStats.branchesRemoved, astStats.sequencesFlattened})
+    {
+        size(value);
+    }
+    auto const& peepholeStats = compiler.mPeepholeStats;
+    for (auto const value : {peepholeStats.constantsFolded, peepholeStats.jumpsThreaded, peepholeStats.branchesInverted,
+                             peepholeStats.jumpsRemoved, peepholeStats.deadInstructions, peepholeStats.loadStoresRemoved,
+                             peepholeStats.bytesBefore, peepholeStats.bytesAfter})
+    {
+        size(value);
+    }
+    size(compiler.mInlinedCalls);
+}
+
+class ImageReader : public vm::ByteReader
+{
+    // Words are shared by the forms read, like their ids.
+    std::vector<ExprPtr> mWords{};
+public:
+    using ByteReader::ByteReader;
+    ExprPtr word()
+    {
+        auto const index = symbolIndex();
+        if (index >= mWords.size())
+        {
+            mWords.resize(index + 1);
+        }
+        auto& word = mWords[index];
+        if (!word)
+        {
+            word = ExprPtr{new RawWord{symbol(index)}};
+        }
+        return word;
+    }
+    ExprPtr expr();
+    // Whether the image was written with the options of compiler.
+    bool options(Compiler const& compiler);
+    void compiler(Compiler& compiler);
+};
+
+ExprPtr ImageReader::expr()
+{
+    switch (tag<ExprTag>())
+    {
+    case ExprTag::kNUMBER:
+        return number(real());
+    case ExprTag::kSTRING:
+        return ExprPtr{new String{std::string{string()}}};
+    case ExprTag::kTRUE:
+        return true_();
+    case ExprTag::kFALSE:
+        return false_();
+    case ExprTag::kNULL:
+        return null();
+    case ExprTag::kWORD:
+        return word();
+    case ExprTag::kSYMBOL:
+        return ExprPtr{new Symbol{symbol()}};
+    case ExprTag::kLIST:
+    {
+        std::vector<ExprPtr> elements(count());
+        for (auto& element : elements)
+        {
+            element = expr();
+        }
+        auto result = expr();
+        for (auto iter = elements.rbegin(); iter != elements.rend(); ++iter)
+        {
+            result = makeCons(*iter, result);
+        }
+        return result;
+    }
+    case ExprTag::kVARIABLE:
+        return ExprPtr{new Variable{symbol()}};
+    case ExprTag::kIF:
+    {
+        auto const predicate = expr();
+        auto const consequent = expr();
+        auto const alternative = expr();
+        return ExprPtr{new If{predicate, consequent, alternative}};
+    }
+    case ExprTag::kAPPLICATION:
+    {
+        auto const op = expr();
+        std::vector<ExprPtr> operands(count());
+        for (auto& operand : operands)
+        {
+            operand = expr();
+        }
+        return ExprPtr{new Application{op, operands}};
+    }
+    }
+    FAIL_("Corrupt image!");
+}
+
+bool ImageReader::options(Compiler const& compiler)
+{
+    ASSERT_MSG(compiler.mSymbolTable.nbDefinitions() == 0 && compiler.mCode.instructions.empty(),
+               "Images are restored into new compilers");
+    CompilerOptions options{};
+    options.astOptimizer = flag();
+    options.peephole = flag();
+    options.superinstructions = flag();
+    options.inliner = flag();
+    return options == compiler.mOptions;
+}
+
+void ImageReader::compiler(Compiler& compiler)
+{
+    auto const names = functionNames();
+    functionTable(*compiler.mCode.constants, names);
+
+    auto& symbolTable = compiler.mSymbolTable;
+    symbolTable.mNbDefinitions = size();
+    for (auto i = count(); i > 0; --i)
+    {
+        auto const name = symbol();
+        auto const index = size();
+        ASSERT_MSG(index < symbolTable.mNbDefinitions, "Corrupt image!");
+        symbolTable.mNameToVarInfo[name] = VarInfo{index, Scope::kGLOBAL};
+    }
+
+    compiler.mCode.instructions = instructions();
+    for (auto i = count(); i > 0; --i)
+    {
+        // Added the way the compiler added it, so that the pool keeps finding the literals it holds.
+        auto const index = compiler.mConstantPool.size();
+        ASSERT_MSG(compiler.mConstantPool.restore(object(*compiler.mCode.constants)) == index, "Corrupt image!");
+    }
+
+    for (auto i = count(); i > 0; --i)
+    {
+        auto const name = symbol();
+        Compiler::InlineCandidate candidate{};
+        candidate.index = size();
+        candidate.params.resize(count());
+        for (auto& param : candidate.params)
+        {
+            param = symbol();
+        }
+        candidate.body = expr();
+        candidate.globals.resize(count());
+        for (auto& [global, index] : candidate.globals)
+        {
+            global = symbol();
+            index = size();
+        }
+        compiler.mInlineCandidates.insert_or_assign(name, std::move(candidate));
+    }
+
+    auto& constantPoolStats = compiler.mConstantPoolStats;
+    for (auto* value : {&constantPoolStats.references, &constantPoolStats.entries})
+    {
+        *value = size();
+    }
+    auto& astStats = compiler.mAstOptimizerStats;
+    for (auto* value : {&astStats.constantsFolded, &astStats.branchesRemoved, &astStats.sequencesFlattened})
+    {
+        *value = size();
+    }
+    auto& peepholeStats = compiler.mPeepholeStats;
+    for (auto* value : {&peepholeStats.constantsFolded, &peepholeStats.jumpsThreaded, &peepholeStats.branchesInverted,
+                        &peepholeStats.jumpsRemoved, &peepholeStats.deadInstructions, &peepholeStats.loadStoresRemoved,
+                        &peepholeStats.bytesBefore, &peepholeStats.bytesAfter})
+    {
+        *value = size();
+    }
+    compiler.mInlinedCalls = size();
+}
+
+// Header (with the checksum and size of the rest), symbols, forms and the options of the compiler, then the functions
+// and the state of the compiler, only read when the options match.
+std::string writeImage(std::vector<PreludeForm> const& forms, Compiler const& compiler, std::string_view source)
+{
+    ImageWriter body;
+    body.size(forms.size());
+    for (auto const& form : forms)
+    {
+        body.flag(form.macroDefinition);
+        body.expr(form.expr);
+    }
+    body.options(compiler);
+    auto const formsAndOptions = body.release();
+    body.compiler(compiler);
+    auto const state = body.release();
+    auto const payload = body.symbolTable() + formsAndOptions + body.functionNames() + body.functionTable() + state;
+
+    vm::ByteWriter header;
+    header.raw(kMagic);
+    header.integer(kVersion);
+    header.integer(vm::opCodesHash());
+    header.integer(vm::fnv1a(source));
+    header.integer(vm::fnv1a(payload));
+    header.size(payload.size());
+    return header.release() + payload;
+}
+
+std::optional<std::vector<PreludeForm>> readImage(std::string_view image, std::string_view source, Compiler* compiler)
+{
+    vm::ByteReader header{image};
+    ASSERT_MSG(header.raw(kMagic.size()) == kMagic, "Not an image!");
+    if (header.integer<uint32_t>() != kVersion || header.integer<uint64_t>() != vm::opCodesHash()
+        || header.integer<uint64_t>() != vm::fnv1a(source))
+    {
+        return {};
+    }
+    auto const checksum = header.integer<uint64_t>();
+    auto const payload = header.raw(header.size());
+    ASSERT_MSG(header.atEnd() && vm::fnv1a(payload) == checksum, "Corrupt image!");
+
+    ImageReader reader{payload};
+    reader.symbolTable();
+    std::vector<PreludeForm> forms(reader.count());
+    for (auto& form : forms)
+    {
+        form.macroDefinition = reader.flag();
+        form.expr = reader.expr();
+    }
+    if (compiler)
+    {
+        if (!reader.options(*compiler))
+        {
+            return {};
+        }
+        reader.compiler(*compiler);
+        ASSERT_MSG(reader.atEnd(), "Corrupt image!");
+    }
+    return forms;
+}
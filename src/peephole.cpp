@@ -0,0 +1,469 @@
+#include "lisp/peephole.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <limits>
+#include <optional>
+
+namespace vm
+{
+PeepholeStats& PeepholeStats::operator+=(PeepholeStats const& other)
+{
+    constantsFolded += other.constantsFolded;
+    jumpsThreaded += other.jumpsThreaded;
+    branchesInverted += other.branchesInverted;
+    jumpsRemoved += other.jumpsRemoved;
+    deadInstructions += other.deadInstructions;
+    loadStoresRemoved += other.loadStoresRemoved;
+    bytesBefore += other.bytesBefore;
+    bytesAfter += other.bytesAfter;
+    return *this;
+}
+
+std::ostream& operator<<(std::ostream& o, PeepholeStats const& stats)
+{
+    return o << "constants folded " << stats.constantsFolded
+             << ", jumps threaded " << stats.jumpsThreaded
+             << ", branches inverted " << stats.branchesInverted
+             << ", jumps removed " << stats.jumpsRemoved
+             << ", dead instructions " << stats.deadInstructions
+             << ", load/stores removed " << stats.loadStoresRemoved
+             << ", bytes " << stats.bytesBefore << " -> " << stats.bytesAfter;
+}
+
+namespace
+{
+struct Instruction
+{
+    Byte opCode;
+    std::array<uint32_t, 2> operands;
+    bool removed;
+};
+
+// Decoded instructions, the operands of jumps are instruction indexes. Removed instructions stay in place until
+// the code is encoded again, a jump to one of them goes to the next instruction kept.
+class Code
+{
+public:
+    std::vector<Instruction> instructions;
+    size_t size() const
+    {
+        return instructions.size();
+    }
+    // First instruction kept from index on, size() past the end.
+    size_t resolve(size_t index) const
+    {
+        while (index < size() && instructions[index].removed)
+        {
+            ++index;
+        }
+        return index;
+    }
+    size_t next(size_t index) const
+    {
+        return resolve(index + 1);
+    }
+    size_t target(Instruction const& ins) const
+    {
+        return resolve(ins.operands[0]);
+    }
+    // Instructions some jump goes to: rewriting one of them changes what the jump runs.
+    std::vector<bool> jumpTargets() const
+    {
+        std::vector<bool> result(size() + 1);
+        for (auto const& ins : instructions)
+        {
+            if (!ins.removed && isJump(ins.opCode))
+            {
+                result[target(ins)] = true;
+            }
+        }
+        return result;
+    }
+};
+
+Code decode(Instructions const& bytes)
+{
+    // Instruction index of each instruction, by byte offset.
+    std::vector<size_t> indexes(bytes.size() + 1);
+    Code code;
+    for (size_t i = 0; i < bytes.size();)
+    {
+        indexes[i] = code.size();
+        Instruction ins{bytes[i], {}, false};
+        ++i;
+        for (size_t j = 0; j < nbOperands(ins.opCode); ++j, i += 4)
+        {
+            ASSERT_MSG(i + 4 <= bytes.size(), "Truncated operand!");
+            ins.operands[j] = fourBytesToInteger<uint32_t>(bytes.data() + i);
+        }
+        code.instructions.push_back(ins);
+    }
+    indexes.back() = code.size();
+    for (auto& ins : code.instructions)
+    {
+        if (isJump(ins.opCode))
+        {
+            ins.operands[0] = static_cast<uint32_t>(indexes.at(ins.operands[0]));
+        }
+    }
+    return code;
+}
+
+Instructions encode(Code const& code)
+{
+    // Byte offset of each instruction, a removed one gets the offset of the next instruction kept.
+    std::vector<size_t> offsets(code.size() + 1);
+    size_t offset = 0;
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        offsets[i] = offset;
+        auto const& ins = code.instructions[i];
+        if (!ins.removed)
+        {
+            offset += 1 + 4 * nbOperands(ins.opCode);
+        }
+    }
+    offsets.back() = offset;
+
+    Instructions result;
+    result.reserve(offset);
+    for (auto const& ins : code.instructions)
+    {
+        if (ins.removed)
+        {
+            continue;
+        }
+        result.push_back(ins.opCode);
+        for (size_t j = 0; j < nbOperands(ins.opCode); ++j)
+        {
+            auto const operand = isJump(ins.opCode) && j == 0 ? offsets[ins.operands[j]] : ins.operands[j];
+            for (auto shift : {24U, 16U, 8U, 0U})
+            {
+                result.push_back(static_cast<Byte>(operand >> shift));
+            }
+        }
+    }
+    return result;
+}
+
+Byte invertedJump(Byte opCode)
+{
+    return opCode == kJUMP_IF_NOT_TRUE ? kJUMP_IF_TRUE : kJUMP_IF_NOT_TRUE;
+}
+
+bool isConditionalJump(Byte opCode)
+{
+    return opCode == kJUMP_IF_NOT_TRUE || opCode == kJUMP_IF_TRUE;
+}
+
+// The next instruction does not run after these: kTAIL_CALL does not come back, the callee returns to the caller.
+bool isTerminator(Byte opCode)
+{
+    return opCode == kJUMP || opCode == kRET || opCode == kHALT || opCode == kTAIL_CALL
+           || opCode == kGET_GLOBAL_TAIL_CALL || opCode == kCURRENT_FUNCTION_TAIL_CALL;
+}
+
+// Index of the double value in constantPool, added when it is not there yet. Doubles are compared by bits, like in the
+// constant pools of the compiler, so that 0.0 and -0.0 stay distinct.
+uint32_t addDouble(std::vector<Object>& constantPool, double value)
+{
+    auto const sameBits = [value](Object const& constant)
+    {
+        if (!constant.isDouble())
+        {
+            return false;
+        }
+        auto const other = constant.asDouble();
+        return std::memcmp(&other, &value, sizeof(value)) == 0;
+    };
+    auto const iter = std::find_if(constantPool.begin(), constantPool.end(), sameBits);
+    if (iter != constantPool.end())
+    {
+        return static_cast<uint32_t>(iter - constantPool.begin());
+    }
+    constantPool.push_back(Double{value});
+    return static_cast<uint32_t>(constantPool.size() - 1);
+}
+
+size_t foldConstants(Code& code, std::vector<Object>& constantPool)
+{
+    size_t count = 0;
+    auto const targets = code.jumpTargets();
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        auto& ins = code.instructions[i];
+        auto const n = code.next(i);
+        if (ins.removed || n == code.size() || code.instructions[n].opCode != kMINUS || targets[n])
+        {
+            continue;
+        }
+        if (ins.opCode == kICONST)
+        {
+            auto const value = static_cast<int32_t>(ins.operands[0]);
+            if (value == std::numeric_limits<int32_t>::min())
+            {
+                continue;
+            }
+            ins.operands[0] = static_cast<uint32_t>(-value);
+        }
+        else if (ins.opCode == kCONST && constantPool.at(ins.operands[0]).isDouble())
+        {
+            ins.operands[0] = addDouble(constantPool, -constantPool[ins.operands[0]].asDouble());
+        }
+        else
+        {
+            continue;
+        }
+        code.instructions[n].removed = true;
+        ++count;
+    }
+    return count;
+}
+
+size_t threadJumps(Code& code)
+{
+    size_t count = 0;
+    for (auto& ins : code.instructions)
+    {
+        if (ins.removed || !isJump(ins.opCode))
+        {
+            continue;
+        }
+        auto const target = code.target(ins);
+        auto final = target;
+        // Bounded, a cycle of jumps has no final target.
+        for (size_t hops = 0; hops < code.size() && final < code.size() && code.instructions[final].opCode == kJUMP; ++hops)
+        {
+            final = code.target(code.instructions[final]);
+        }
+        if (ins.opCode == kJUMP && final < code.size() && code.instructions[final].opCode == kRET)
+        {
+            ins.opCode = kRET;
+            ++count;
+        }
+        else if (final != target)
+        {
+            ins.operands[0] = static_cast<uint32_t>(final);
+            ++count;
+        }
+    }
+    return count;
+}
+
+size_t invertBranches(Code& code)
+{
+    size_t count = 0;
+    auto targets = code.jumpTargets();
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        auto& ins = code.instructions[i];
+        auto const n = code.next(i);
+        if (ins.removed || n == code.size() || targets[n])
+        {
+            continue;
+        }
+        auto& next = code.instructions[n];
+        // kNOT; kJUMP_IF_NOT_TRUE l => kJUMP_IF_TRUE l
+        if (ins.opCode == kNOT && isConditionalJump(next.opCode))
+        {
+            ins.removed = true;
+            next.opCode = invertedJump(next.opCode);
+            ++count;
+        }
+        // kJUMP_IF_NOT_TRUE l; kJUMP m; l: => kJUMP_IF_TRUE m; l:
+        else if (isConditionalJump(ins.opCode) && next.opCode == kJUMP && code.target(ins) == code.next(n))
+        {
+            ins.opCode = invertedJump(ins.opCode);
+            ins.operands[0] = next.operands[0];
+            next.removed = true;
+            targets[code.target(ins)] = true;
+            ++count;
+        }
+    }
+    return count;
+}
+
+size_t removeJumpsToNext(Code& code)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        auto& ins = code.instructions[i];
+        if (ins.removed || !isJump(ins.opCode) || code.target(ins) != code.next(i))
+        {
+            continue;
+        }
+        if (ins.opCode == kJUMP || ins.opCode == kJUMP_IF_LOCAL_NOT_NULL)
+        {
+            ins.removed = true;
+        }
+        else
+        {
+            // The condition is still popped.
+            ins.opCode = kPOP;
+        }
+        ++count;
+    }
+    return count;
+}
+
+size_t removeDeadCode(Code& code)
+{
+    std::vector<bool> reachable(code.size() + 1);
+    std::vector<size_t> pending{code.resolve(0)};
+    while (!pending.empty())
+    {
+        auto const i = pending.back();
+        pending.pop_back();
+        if (i == code.size() || reachable[i])
+        {
+            continue;
+        }
+        reachable[i] = true;
+        auto const& ins = code.instructions[i];
+        if (isJump(ins.opCode))
+        {
+            pending.push_back(code.target(ins));
+        }
+        if (!isTerminator(ins.opCode))
+        {
+            pending.push_back(code.next(i));
+        }
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        auto& ins = code.instructions[i];
+        if (!ins.removed && !reachable[i])
+        {
+            ins.removed = true;
+            ++count;
+        }
+    }
+    return count;
+}
+
+size_t removeLoadStores(Code& code)
+{
+    size_t count = 0;
+    auto const targets = code.jumpTargets();
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        auto& ins = code.instructions[i];
+        auto const n = code.next(i);
+        if (ins.removed || n == code.size() || targets[n])
+        {
+            continue;
+        }
+        auto& next = code.instructions[n];
+        auto const isLoadStore = (ins.opCode == kGET_LOCAL && next.opCode == kSET_LOCAL)
+                                 || (ins.opCode == kGET_GLOBAL && next.opCode == kSET_GLOBAL);
+        if (isLoadStore && ins.operands[0] == next.operands[0])
+        {
+            ins.removed = true;
+            next.removed = true;
+            ++count;
+        }
+    }
+    return count;
+}
+// The superinstruction running ins and next, if any.
+std::optional<Instruction> fuse(Instruction const& ins, Instruction const& next)
+{
+    auto const fused = [&ins](Byte opCode) { return Instruction{opCode, ins.operands, false}; };
+    switch (ins.opCode)
+    {
+    case kGET_LOCAL:
+        if (next.opCode == kCAR || next.opCode == kCDR)
+        {
+            return fused(next.opCode == kCAR ? kGET_LOCAL_CAR : kGET_LOCAL_CDR);
+        }
+        break;
+    case kICONST:
+        if (next.opCode == kADD || next.opCode == kSUB)
+        {
+            return fused(next.opCode == kADD ? kADD_ICONST : kSUB_ICONST);
+        }
+        break;
+    case kGET_GLOBAL:
+        if (next.opCode == kCALL || next.opCode == kTAIL_CALL)
+        {
+            return Instruction{next.opCode == kCALL ? kGET_GLOBAL_CALL : kGET_GLOBAL_TAIL_CALL,
+                               {ins.operands[0], next.operands[0]}, false};
+        }
+        break;
+    case kCURRENT_FUNCTION:
+        if (next.opCode == kCALL || next.opCode == kTAIL_CALL)
+        {
+            return Instruction{next.opCode == kCALL ? kCURRENT_FUNCTION_CALL : kCURRENT_FUNCTION_TAIL_CALL,
+                               next.operands, false};
+        }
+        break;
+    default:
+        break;
+    }
+    return {};
+}
+} // namespace
+
+size_t selectSuperinstructions(Instructions& instructions)
+{
+    auto code = decode(instructions);
+    auto const targets = code.jumpTargets();
+    size_t count = 0;
+    // Greedy from the start, the instructions fused into the first one of a sequence must not be jump targets.
+    for (size_t i = 0; i < code.size(); i = code.next(i))
+    {
+        auto& ins = code.instructions[i];
+        auto const n = code.next(i);
+        if (n == code.size() || targets[n])
+        {
+            continue;
+        }
+        auto& next = code.instructions[n];
+        auto const nn = code.next(n);
+        // kGET_LOCAL n; kIS_NULL; kJUMP_IF_NOT_TRUE l => kJUMP_IF_LOCAL_NOT_NULL l n
+        if (ins.opCode == kGET_LOCAL && next.opCode == kIS_NULL && nn < code.size() && !targets[nn]
+            && code.instructions[nn].opCode == kJUMP_IF_NOT_TRUE)
+        {
+            ins = Instruction{kJUMP_IF_LOCAL_NOT_NULL, {code.instructions[nn].operands[0], ins.operands[0]}, false};
+            next.removed = true;
+            code.instructions[nn].removed = true;
+            ++count;
+        }
+        else if (auto const fused = fuse(ins, next))
+        {
+            ins = *fused;
+            next.removed = true;
+            ++count;
+        }
+    }
+    instructions = encode(code);
+    return count;
+}
+
+void optimize(Instructions& instructions, std::vector<Object>& constantPool, PeepholeStats& stats)
+{
+    PeepholeStats result{};
+    result.bytesBefore = instructions.size();
+    auto code = decode(instructions);
+    // Each rewrite can make room for the others, run them all until none applies.
+    for (bool changed = true; changed;)
+    {
+        PeepholeStats round{};
+        round.constantsFolded = foldConstants(code, constantPool);
+        round.jumpsThreaded = threadJumps(code);
+        round.branchesInverted = invertBranches(code);
+        round.jumpsRemoved = removeJumpsToNext(code);
+        round.deadInstructions = removeDeadCode(code);
+        round.loadStoresRemoved = removeLoadStores(code);
+        changed = round.constantsFolded + round.jumpsThreaded + round.branchesInverted + round.jumpsRemoved
+                  + round.deadInstructions + round.loadStoresRemoved > 0;
+        result += round;
+    }
+    instructions = encode(code);
+    result.bytesAfter = instructions.size();
+    stats += result;
+}
+} // namespace vm
@@ -6,7 +6,7 @@
 auto consOp = [](std::vector<std::shared_ptr<Expr>> const& args)
 {
     ASSERT(args.size() == 2);
-    return ExprPtr{new Cons{args.at(0), args.at(1)}}; 
+    return makeCons(args.at(0), args.at(1)); 
 };
 
 auto printOp = [](std::vector<std::shared_ptr<Expr>> const& args)
@@ -75,7 +75,7 @@ auto modOp = [](std::vector<std::shared_ptr<Expr>> const& args)
     ASSERT(std::trunc(lhsD) == lhsD);
     ASSERT(std::trunc(rhsD) == rhsD);
     double result = static_cast<int32_t>(lhsD) % static_cast<int32_t>(rhsD);
-    return ExprPtr{new Number{result}}; 
+    return number(result); 
 };
 
 auto isEqOp = [](std::vector<std::shared_ptr<Expr>> const& args)
@@ -110,7 +110,7 @@ auto mulOp = [](std::vector<std::shared_ptr<Expr>> const& args)
         return p * num.get();
     }
     );
-    return std::shared_ptr<Expr>(new Number(result)); 
+    return number(result); 
 };
 
 auto addOp = [](std::vector<std::shared_ptr<Expr>> const& args)
@@ -121,7 +121,7 @@ auto addOp = [](std::vector<std::shared_ptr<Expr>> const& args)
         return p + num.get();
     }
     );
-    return std::shared_ptr<Expr>(new Number(result)); 
+    return number(result); 
 };
 
 auto divOp = [](std::vector<std::shared_ptr<Expr>> const& args)
@@ -129,13 +129,13 @@ auto divOp = [](std::vector<std::shared_ptr<Expr>> const& args)
     ASSERT(args.size() == 2);
     auto num1 = dynamic_cast<Number&>(*args.at(0));
     auto num2 = dynamic_cast<Number&>(*args.at(1));
-    return std::shared_ptr<Expr>(new Number(num1.get() / num2.get())); 
+    return number(num1.get() / num2.get()); 
 };
 
 std::shared_ptr<Env> setUpEnvironment()
 {
     auto emptyEnv = std::make_shared<Env>();
-    auto primitiveProcedureNames = std::vector<std::string>{};
+    auto primitiveProcedureNames = std::vector<SymbolId>{};
     auto primitiveProcedureObjects = std::vector<ExprPtr>{};
     auto initialEnv = emptyEnv->extend(Params{std::make_pair(primitiveProcedureNames, false)}, primitiveProcedureObjects);
 
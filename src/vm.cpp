@@ -1,103 +1,75 @@
 #include "lisp/vm.h"
 #include "lisp/meta.h"
+#include <iomanip>
 #include <iostream>
 #include <cmath>
+#include <limits>
+#include <optional>
 
 namespace vm{
 void print(std::ostream& o, StackFrame const& f)
 {
-    o << "StackFrame " << f.closure()->funcSym().name();
+    o << "StackFrame " << f.funcSym().name();
 }
 
-void print(std::ostream& o, FunctionSymbol const& f)
-{
-    o << "Function " << f.name();
-}
-
-void print(std::ostream& o, ClosurePtr const& c)
-{
-    o << "Closure " << c->funcSym().name();
-}
-
-void print(std::ostream& o, VMNull)
-{
-    o << "null";
-}
-
-bool operator== (ConsPtr const& lhs, ConsPtr const& rhs);
-
 bool operator== (FunctionSymbol const& lhs, FunctionSymbol const& rhs)
 {
     return lhs.name() == rhs.name() &&
            lhs.nbArgs() == rhs.nbArgs() &&
            lhs.variadic() == rhs.variadic() &&
            lhs.nbLocals() == rhs.nbLocals() &&
-           lhs.instructions() == rhs.instructions();
-}
-
-template <typename T>
-constexpr bool operator== (Literal<T> const& lhs, Literal<T> const& rhs)
-{
-    return lhs.value == rhs.value;
-}
-
-bool operator== (Symbol const& lhs, Symbol const& rhs)
-{
-    return lhs.value == rhs.value;
-}
-
-bool operator== (Splicing const& lhs, Splicing const& rhs)
-{
-    return lhs.value == rhs.value;
+           lhs.instructions() == rhs.instructions() &&
+           lhs.constantPool() == rhs.constantPool();
 }
 
-constexpr bool operator== (VMNull const&, VMNull const&)
+bool operator== (VMCons const& lhs, VMCons const& rhs)
 {
-    return true;
+    return lhs.car() == rhs.car() && lhs.cdr() == rhs.cdr();
 }
 
-bool operator== (ConsPtr const& lhs, ConsPtr const& rhs)
+bool operator== (Object const& lhs, Object const& rhs)
 {
-    if (lhs.get() == rhs.get())
+    if (lhs.isDouble() && rhs.isDouble())
+    {
+        return lhs.asDouble() == rhs.asDouble();
+    }
+    if (lhs.sameBits(rhs))
     {
         return true;
     }
-    if (!lhs || !rhs)
+    if (!lhs.isHeap() || !rhs.isHeap() || lhs.asHeap()->kind() != rhs.asHeap()->kind())
     {
         return false;
     }
-    return lhs->car() == rhs->car() && lhs->cdr() == rhs->cdr();
-}
-
-template <typename T>
-void print(std::ostream& o, Literal<T> const& obj)
-{
-    o << std::boolalpha << obj.value;
-}
-
-void print(std::ostream& o, Symbol const& obj)
-{
-    o << obj.value;
-}
-
-void print(std::ostream& o, String const& obj)
-{
-    o << "\"" << obj.value << "\"";
+    switch (lhs.asHeap()->kind())
+    {
+    case HeapKind::kSTRING:
+        return lhs.as<StringObject>()->value == rhs.as<StringObject>()->value;
+    case HeapKind::kFUNCTION:
+        return *lhs.as<FunctionSymbol>() == *rhs.as<FunctionSymbol>();
+    case HeapKind::kCLOSURE:
+        return false;
+    case HeapKind::kCONS:
+        return *lhs.as<VMCons>() == *rhs.as<VMCons>();
+    case HeapKind::kSPLICING:
+        return *lhs.as<SplicingObject>()->value == *rhs.as<SplicingObject>()->value;
+    case HeapKind::kBUILTIN:
+        return lhs.as<Builtin>()->name() == rhs.as<Builtin>()->name();
+    }
+    return false;
 }
 
-std::ostream& operator << (std::ostream& o, Object const& obj);
-
 std::string VMCons::toString() const
 {
     std::ostringstream o;
     o << "(" << mCar;
-    if (auto const consPtrPtr = std::get_if<ConsPtr>(&mCdr))
+    if (auto const consPtr = mCdr.as<VMCons>())
     {
-        auto cdrStr = (*consPtrPtr)->toString();
+        auto cdrStr = consPtr->toString();
         auto cdrStrSize = cdrStr.size();
         o << " " << cdrStr.substr(1U, cdrStrSize - 2);
     }
-    else if (std::get_if<VMNull>(&mCdr))
+    else if (mCdr.isNull())
     {
     }
     else
@@ -108,57 +80,136 @@ std::string VMCons::toString() const
     return o.str();
 }
 
-void print(std::ostream& o, vm::ConsPtr const& cons_)
+std::ostream& operator << (std::ostream& o, Object const& obj)
 {
-    ASSERT(cons_);
-    o << cons_->toString();
+    if (obj.isDouble())
+    {
+        return o << obj.asDouble();
+    }
+    if (obj.isInt())
+    {
+        return o << obj.asInt();
+    }
+    if (obj.isBool())
+    {
+        return o << std::boolalpha << obj.asBool();
+    }
+    if (obj.isNull())
+    {
+        return o << "null";
+    }
+    if (obj.isSymbol())
+    {
+        return o << "'" << symbolName(obj.asSymbol());
+    }
+    switch (obj.asHeap()->kind())
+    {
+    case HeapKind::kSTRING:
+        return o << "\"" << obj.as<StringObject>()->value << "\"";
+    case HeapKind::kFUNCTION:
+        return o << "Function " << obj.as<FunctionSymbol>()->name();
+    case HeapKind::kCLOSURE:
+        return o << "Closure " << obj.as<Closure>()->funcSym().name();
+    case HeapKind::kCONS:
+        return o << obj.as<VMCons>()->toString();
+    case HeapKind::kSPLICING:
+        return o << obj.as<SplicingObject>()->value->toString();
+    case HeapKind::kBUILTIN:
+        return o << "Builtin " << obj.as<Builtin>()->name();
+    }
+    return o;
 }
 
-void print(std::ostream& o, vm::Splicing const& spl)
+Heap::~Heap()
 {
-    print(o, spl.value);
+    while (mObjects)
+    {
+        auto const next = mObjects->mNext;
+        delete mObjects;
+        mObjects = next;
+    }
 }
 
-std::ostream& operator << (std::ostream& o, Object const& obj)
+void Heap::trace()
 {
-    std::visit([&o](auto op)
+    while (!mGray.empty())
     {
-        print(o, op);
-    }, obj);
-    return o;
+        auto const obj = mGray.back();
+        mGray.pop_back();
+        switch (obj->kind())
+        {
+        case HeapKind::kCONS:
+        {
+            auto const consPtr = static_cast<VMCons const*>(obj);
+            mark(consPtr->car());
+            mark(consPtr->cdr());
+            break;
+        }
+        case HeapKind::kCLOSURE:
+        {
+            auto const closure = static_cast<Closure const*>(obj);
+            mark(&closure->funcSym());
+            for (auto const& freeVar : closure->freeVars())
+            {
+                mark(freeVar);
+            }
+            break;
+        }
+        case HeapKind::kSPLICING:
+            mark(static_cast<SplicingObject const*>(obj)->value);
+            break;
+        case HeapKind::kSTRING:
+        case HeapKind::kFUNCTION:
+        case HeapKind::kBUILTIN:
+            break;
+        }
+    }
 }
 
-auto deCons(Object const& obj)
+void Heap::sweep()
 {
-    auto consPtrPtr = std::get_if<ConsPtr>(&obj);
-    ASSERT(consPtrPtr);
-    ASSERT(consPtrPtr->get());
-    return std::make_pair(consPtrPtr->get()->car(), consPtrPtr->get()->cdr());
+    auto link = &mObjects;
+    while (auto const obj = *link)
+    {
+        if (obj->mMarked)
+        {
+            obj->mMarked = false;
+            link = &obj->mNext;
+            continue;
+        }
+        *link = obj->mNext;
+        auto const bytes = obj->footprint();
+        mStats.bytesInUse -= bytes;
+        mStats.bytesFreed += bytes;
+        --mStats.objectsInUse;
+        delete obj;
+    }
 }
 
-std::vector<Object> consToVec(ConsPtr const& cons_)
+std::vector<Object> consToVec(ConsPtr cons_)
 {
     std::vector<Object> vec;
     Object me = cons_;
-    while (!std::get_if<VMNull>(&me))
+    while (!me.isNull())
     {
-        auto [car, cdr] = deCons(me);
-        vec.push_back(car);
-        me = cdr;
+        auto const consPtr = me.as<VMCons>();
+        ASSERT(consPtr);
+        vec.push_back(consPtr->car());
+        me = consPtr->cdr();
     }
     return vec;
 }
 
-Object vecToCons(std::vector<Object> const& vec)
+Object vecToCons(Heap& heap, std::vector<Object> const& vec)
 {
     Object result = vmNull;
     auto vecSize = vec.size();
     auto i = vec.rbegin();
     if (vecSize >= 2)
     {
-        auto dot = vec.at(vecSize - 2);
-        auto dotPtr = std::get_if<Symbol>(&dot);
-        if (dotPtr != nullptr && dotPtr->value == ".")
+        static auto const dotId = intern(".");
+        auto const& dot = vec.at(vecSize - 2);
+        if (dot.isSymbol() && dot.asSymbol() == dotId)
         {
             ASSERT(vecSize >=3);
             ++i;
@@ -168,193 +219,619 @@ Object vecToCons(std::vector<Object> const& vec)
     }
     for (;i != vec.rend(); ++i)
     {
-        result = cons(*i, result);
+        result = heap.cons(*i, result);
     }
     return result;
 }
 
+void VM::collectGarbage()
+{
+    mHeap.collect([this](Heap& heap)
+    {
+        for (auto const& obj : mStack)
+        {
+            heap.mark(obj);
+        }
+        for (auto const& obj : mGlobals)
+        {
+            heap.mark(obj);
+        }
+        for (auto const& obj : mCode.constantPool)
+        {
+            heap.mark(obj);
+        }
+        for (auto const& frame : mCallStack)
+        {
+            heap.mark(frame.closure());
+        }
+    });
+}
 
-void VM::run()
+
+#if LISP_VM_COMPUTED_GOTO && (defined(__GNUC__) || defined(__clang__))
+#define LISP_VM_THREADED 1
+#else
+#define LISP_VM_THREADED 0
+#endif
+
+char const* dispatchEngine()
+{
+    return LISP_VM_THREADED ? "threaded" : "switch";
+}
+
+size_t nbOperands(Byte opCode)
 {
-    while (mIp < instructions().size())
+    switch (opCode)
     {
-        Byte opCode = instructions()[mIp];
-        ++mIp;
-        switch (opCode)
+    case kICONST:
+    case kCONST:
+    case kCALL:
+    case kTAIL_CALL:
+    case kGET_LOCAL:
+    case kSET_LOCAL:
+    case kGET_GLOBAL:
+    case kSET_GLOBAL:
+    case kGET_FREE:
+    case kJUMP:
+    case kJUMP_IF_NOT_TRUE:
+    case kJUMP_IF_TRUE:
+    case kGET_LOCAL_CAR:
+    case kGET_LOCAL_CDR:
+    case kADD_ICONST:
+    case kSUB_ICONST:
+    case kCURRENT_FUNCTION_CALL:
+    case kCURRENT_FUNCTION_TAIL_CALL:
+        return 1;
+    case kCLOSURE:
+    case kJUMP_IF_LOCAL_NOT_NULL:
+    case kGET_GLOBAL_CALL:
+    case kGET_GLOBAL_TAIL_CALL:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+bool isJump(Byte opCode)
+{
+    return opCode == kJUMP || opCode == kJUMP_IF_NOT_TRUE || opCode == kJUMP_IF_TRUE || opCode == kJUMP_IF_LOCAL_NOT_NULL;
+}
+
+char const* opCodeName(Byte opCode)
+{
+#define LISP_VM_OP_CODE_NAME(op) #op,
+    static char const* const kNames[] = { LISP_VM_OP_CODES(LISP_VM_OP_CODE_NAME) };
+#undef LISP_VM_OP_CODE_NAME
+    return opCode < kNbOpCodes ? kNames[opCode] : "unknown";
+}
+
+void OpCodeProfile::record(Byte opCode)
+{
+    ++mDispatches;
+    ++mCounts[opCode];
+    if (mPrevious < kNbOpCodes)
+    {
+        ++mPairs[mPrevious][opCode];
+    }
+    mPrevious = opCode;
+}
+
+std::vector<std::pair<std::pair<Byte, Byte>, size_t>> OpCodeProfile::pairs() const
+{
+    std::vector<std::pair<std::pair<Byte, Byte>, size_t>> result;
+    for (size_t first = 0; first < kNbOpCodes; ++first)
+    {
+        for (size_t second = 0; second < kNbOpCodes; ++second)
         {
-        case kICONST:
+            if (mPairs[first][second] > 0)
+            {
+                result.emplace_back(std::make_pair(static_cast<Byte>(first), static_cast<Byte>(second)), mPairs[first][second]);
+            }
+        }
+    }
+    std::stable_sort(result.begin(), result.end(), [](auto const& lhs, auto const& rhs) { return lhs.second > rhs.second; });
+    return result;
+}
+
+std::ostream& operator<<(std::ostream& o, OpCodeProfile const& profile)
+{
+    o << profile.dispatches() << " dispatches" << std::endl;
+    auto const pairs = profile.pairs();
+    for (size_t i = 0; i < std::min(pairs.size(), size_t{20}); ++i)
+    {
+        auto const& [ops, count] = pairs[i];
+        o << std::setw(10) << count << " " << std::setw(5) << std::fixed << std::setprecision(1)
+          << 100.0 * static_cast<double>(count) / static_cast<double>(profile.dispatches()) << "% "
+          << opCodeName(ops.first) << " " << opCodeName(ops.second) << std::endl;
+    }
+    return o;
+}
+
+LinkedInstructions link(Instructions const& instructions)
+{
+    // Word offset of each instruction, indexed by its byte offset, for the jump targets.
+    std::vector<size_t> wordOffsets(instructions.size() + 1);
+    size_t nbWords = 0;
+    for (size_t i = 0; i < instructions.size(); i += 1 + 4 * nbOperands(instructions[i]))
+    {
+        ASSERT_MSG(instructions[i] < kNbOpCodes, static_cast<int32_t>(instructions[i]));
+        wordOffsets[i] = nbWords;
+        nbWords += 1 + nbOperands(instructions[i]);
+    }
+    wordOffsets.back() = nbWords;
+
+    LinkedInstructions result;
+    result.reserve(nbWords);
+    for (size_t i = 0; i < instructions.size();)
+    {
+        auto const opCode = instructions[i];
+        result.push_back(opCode);
+        ++i;
+        for (size_t j = 0; j < nbOperands(opCode); ++j, i += 4)
         {
-            int32_t word = fourBytesToInteger<int32_t>(&instructions()[mIp]);
-            mIp += 4;
-            operandStack().push(Int{word});
-            break;
+            ASSERT_MSG(i + 4 <= instructions.size(), "Truncated operand!");
+            auto const operand = fourBytesToInteger<uint32_t>(instructions.data() + i);
+            if (isJump(opCode) && j == 0)
+            {
+                ASSERT(operand < wordOffsets.size());
+                result.push_back(static_cast<Word>(wordOffsets[operand]));
+            }
+            else
+            {
+                result.push_back(operand);
+            }
         }
-        case kIADD:
+    }
+    return result;
+}
+
+namespace
+{
+template <typename T>
+T fetchOperand(Word const*& ip)
+{
+    return static_cast<T>(*ip++);
+}
+
+bool isNumber(Object const& obj)
+{
+    return obj.isInt() || obj.isDouble();
+}
+
+double toDouble(Object const& obj)
+{
+    if (obj.isInt())
+    {
+        return obj.asInt();
+    }
+    return get<Double>(obj).value;
+}
+
+Object negate(Object const& num)
+{
+    if (num.isInt() && num.asInt() != std::numeric_limits<int32_t>::min())
+    {
+        return Int{-num.asInt()};
+    }
+    return Double{-toDouble(num)};
+}
+
+// Result of fixnum arithmetic computed in 64 bits, empty when it does not fit in a fixnum.
+std::optional<Int> fixnum(int64_t value)
+{
+    if (value < std::numeric_limits<int32_t>::min() || value > std::numeric_limits<int32_t>::max())
+    {
+        return {};
+    }
+    return Int{static_cast<int32_t>(value)};
+}
+} // namespace
+
+// Arithmetic the handlers do not do inline: division and modulo of fixnums, fixnum results promoted to doubles,
+// doubles, mixed operands and string concatenation.
+void VM::arithmetic(Byte opCode, Object lhs, Object rhs)
+{
+    if (lhs.isInt() && rhs.isInt())
+    {
+        auto const l = int64_t{lhs.asInt()};
+        auto const r = int64_t{rhs.asInt()};
+        std::optional<Int> result;
+        switch (opCode)
         {
-            auto const rhs = std::get<Int>(operandStack().top());
-            operandStack().pop();
-            auto const lhs = std::get<Int>(operandStack().top());
-            operandStack().pop();
-            int32_t result = lhs.value + rhs.value;
-            operandStack().push(Int{result});
+        case kADD:
+            result = fixnum(l + r);
+            break;
+        case kSUB:
+            result = fixnum(l - r);
+            break;
+        case kMUL:
+            result = fixnum(l * r);
+            break;
+        case kDIV:
+            // Inexact quotients are doubles.
+            result = r != 0 && l % r == 0 ? fixnum(l / r) : std::nullopt;
+            break;
+        case kMOD:
+            ASSERT_MSG(r != 0, "Modulo by zero!");
+            result = fixnum(l % r);
+            break;
+        default:
             break;
         }
-        case kEQUAL:
+        if (result)
         {
-            auto const rhs = operandStack().top();
-            operandStack().pop();
-            auto const lhs = operandStack().top();
-            operandStack().pop();
-            bool result = lhs == rhs;
-            operandStack().push(Bool{result});
-            break;
+            push(*result);
+            return;
         }
+    }
+    // Fixnum results promoted to doubles, doubles and mixed operands.
+    if (isNumber(lhs))
+    {
+        auto const lhsD = toDouble(lhs);
+        auto const rhsD = toDouble(rhs);
+        switch (opCode)
+        {
         case kADD:
+        {
+            double result = lhsD + rhsD;
+            push(Double{result});
+            break;
+        }
+        
         case kSUB:
+        {
+            double result = lhsD - rhsD;
+            push(Double{result});
+            break;
+        }
+        
         case kMUL:
+        {
+            double result = lhsD * rhsD;
+            push(Double{result});
+            break;
+        }
+        
         case kDIV:
+        {
+            double result = lhsD / rhsD;
+            push(Double{result});
+            break;
+        }
+        
         case kMOD:
+        {
+            ASSERT(std::trunc(lhsD) == lhsD);
+            ASSERT(std::trunc(rhsD) == rhsD);
+            double result = static_cast<int32_t>(lhsD) % static_cast<int32_t>(rhsD);
+            push(Double{result});
+            break;
+        }
+        
         case kLESS_THAN:
         {
-            auto const rhs = operandStack().top();
-            operandStack().pop();
-            auto const lhs = operandStack().top();
-            operandStack().pop();
-            if (auto lhsDPtr = std::get_if<Double>(&lhs))
+            bool result = lhsD < rhsD;
+            push(Bool{result});
+            break;
+        }
+
+        default:
+            FAIL_("Unsupported op");
+        }
+    }
+    else if (auto lhsStrPtr = lhs.as<StringObject>())
+    {
+        auto const rhsStr = get<String>(rhs);
+        switch (opCode)
+        {
+        case kADD:
+        {
+            auto result = lhsStrPtr->value + rhsStr.value;
+            // The operands are not used anymore, they do not need to be rooted.
+            collectIfNeeded();
+            push(mHeap.string(std::move(result)));
+            break;
+        }
+        
+        default:
+            FAIL_("Unsupported op");
+        }
+    }
+    else
+    {
+        FAIL_("Unsupported operand type!");
+    }
+}
+
+Object VM::append(Object lhs, Object rhs)
+{
+    std::vector<Object> elements;
+    while (!lhs.isNull())
+    {
+        auto const consPtr = lhs.as<VMCons>();
+        ASSERT_MSG(consPtr, "Not a list when calling append");
+        elements.push_back(consPtr->car());
+        lhs = consPtr->cdr();
+    }
+    for (auto iter = elements.rbegin(); iter != elements.rend(); ++iter)
+    {
+        rhs = mHeap.cons(*iter, rhs);
+    }
+    return rhs;
+}
+
+void VM::callBuiltin(Builtin const& builtin, size_t nbArgs)
+{
+    // The arguments stay on the stack until the result is computed, rooted while it is allocated.
+    collectIfNeeded();
+    auto const base = mStack.size() - nbArgs;
+    auto const binary = [this, &builtin](Object lhs, Object rhs) -> Object
+    {
+        switch (builtin.binary())
+        {
+        case kCONS:
+            return mHeap.cons(lhs, rhs);
+        case kAPPEND:
+            return append(lhs, rhs);
+        default:
+            arithmetic(builtin.binary(), lhs, rhs);
+            return popOperand();
+        }
+    };
+    Object result;
+    if (nbArgs == 1 && builtin.unary())
+    {
+        ASSERT_MSG(builtin.unary() == kMINUS, opCodeName(*builtin.unary()));
+        result = negate(mStack[base]);
+    }
+    else
+    {
+        auto const nbOperands = nbArgs + (builtin.foldIdentity() ? 1 : 0);
+        ASSERT_MSG(nbOperands > 0 || builtin.identity(), builtin.name() + " needs arguments");
+        auto const operand = [this, &builtin, base, nbArgs](size_t i) { return i < nbArgs ? mStack[base + i] : *builtin.identity(); };
+        if (nbOperands == 0)
+        {
+            result = *builtin.identity();
+        }
+        else if (builtin.rightFold())
+        {
+            result = operand(nbOperands - 1);
+            for (auto i = nbOperands - 1; i > 0; --i)
             {
-                auto lhsD = *lhsDPtr;
-                auto rhsD = std::get<Double>(rhs);
-                switch (opCode)
-                {
-                case kADD:
-                {
-                    double result = lhsD.value + rhsD.value;
-                    operandStack().push(Double{result});
-                    break;
-                }
-                
-                case kSUB:
-                {
-                    double result = lhsD.value - rhsD.value;
-                    operandStack().push(Double{result});
-                    break;
-                }
-                
-                case kMUL:
-                {
-                    double result = lhsD.value * rhsD.value;
-                    operandStack().push(Double{result});
-                    break;
-                }
-                
-                case kDIV:
-                {
-                    double result = lhsD.value / rhsD.value;
-                    operandStack().push(Double{result});
-                    break;
-                }
-                
-                case kMOD:
+                result = binary(operand(i - 1), result);
+            }
+        }
+        else
+        {
+            result = operand(0);
+            for (size_t i = 1; i < nbOperands; ++i)
+            {
+                result = binary(result, operand(i));
+            }
+        }
+    }
+    mStack.resize(base);
+    push(result);
+}
+
+// Each handler is written once and expanded either as a label of the direct-threaded loop (every handler jumps
+// straight to the next one through the dispatch table) or as a case of the portable switch loop.
+// The profiled loop records every op code it dispatches, the other one compiles the recording away.
+#define VM_PROFILE() do { if constexpr (kProfile) { profile->record(opCode); } } while (false)
+#if LISP_VM_THREADED
+#define VM_CASE(op) L_##op
+#define VM_DISPATCH() do { opCode = static_cast<Byte>(*ip++); VM_PROFILE(); goto *kDispatchTable[opCode]; } while (false)
+#define VM_LOOP_BEGIN VM_DISPATCH();
+#define VM_LOOP_END
+#else
+#define VM_CASE(op) case op
+#define VM_DISPATCH() break
+#define VM_LOOP_BEGIN for (;;) { opCode = static_cast<Byte>(*ip++); VM_PROFILE(); switch (opCode) {
+#define VM_LOOP_END default: FAIL_MSG("Unknown op code!", static_cast<int32_t>(opCode)); } }
+#endif
+
+#if LISP_VM_THREADED
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wgnu-label-as-value"
+#else
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+#endif
+
+void VM::run()
+{
+    execute<false>(nullptr);
+}
+
+void VM::runProfiled(OpCodeProfile& profile)
+{
+    execute<true>(&profile);
+}
+
+template <bool kProfile>
+void VM::execute([[maybe_unused]] OpCodeProfile* profile)
+{
+#if LISP_VM_THREADED
+#define LISP_VM_LABEL_ADDRESS(op) &&L_##op,
+    static void* const kDispatchTable[] = { LISP_VM_OP_CODES(LISP_VM_LABEL_ADDRESS) };
+#undef LISP_VM_LABEL_ADDRESS
+#endif
+    // Cached views of the byte array and the constants of the running function, only refreshed on calls and returns.
+    Word const* code = instructions().data();
+    auto const* constants = &constantPool();
+    Word const* ip = code + mIp;
+    // Base pointer of the running frame in the value stack.
+    size_t bp = mCallStack.empty() ? 0 : mCallStack.back().basePointer();
+    Byte opCode{};
+
+    VM_LOOP_BEGIN
+        VM_CASE(kICONST):
+        {
+            auto const word = fetchOperand<int32_t>(ip);
+            push(Int{word});
+            VM_DISPATCH();
+        }
+        VM_CASE(kIADD):
+        {
+            auto const rhs = get<Int>(popOperand());
+            auto const lhs = get<Int>(popOperand());
+            int32_t result = lhs.value + rhs.value;
+            push(Int{result});
+            VM_DISPATCH();
+        }
+        VM_CASE(kEQUAL):
+        {
+            auto const rhs = popOperand();
+            auto const lhs = popOperand();
+            // Numbers compare by value whatever their representation, 1 = 1.0.
+            bool result = lhs.isInt() && rhs.isInt() ? lhs.sameBits(rhs)
+                : isNumber(lhs) && isNumber(rhs) ? toDouble(lhs) == toDouble(rhs) : lhs == rhs;
+            push(Bool{result});
+            VM_DISPATCH();
+        }
+        VM_CASE(kADD):
+        {
+            auto const rhs = popOperand();
+            auto const lhs = popOperand();
+            if (lhs.isInt() && rhs.isInt())
+            {
+                if (auto const result = fixnum(int64_t{lhs.asInt()} + rhs.asInt()))
                 {
-                    ASSERT(std::trunc(lhsD.value) == lhsD.value);
-                    ASSERT(std::trunc(rhsD.value) == rhsD.value);
-                    double result = static_cast<int32_t>(lhsD.value) % static_cast<int32_t>(rhsD.value);
-                    operandStack().push(Double{result});
-                    break;
+                    push(*result);
+                    VM_DISPATCH();
                 }
-                
-                case kLESS_THAN:
+            }
+            arithmetic(opCode, lhs, rhs);
+            VM_DISPATCH();
+        }
+        VM_CASE(kSUB):
+        {
+            auto const rhs = popOperand();
+            auto const lhs = popOperand();
+            if (lhs.isInt() && rhs.isInt())
+            {
+                if (auto const result = fixnum(int64_t{lhs.asInt()} - rhs.asInt()))
                 {
-                    bool result = lhsD.value < rhsD.value;
-                    operandStack().push(Bool{result});
-                    break;
-                }
-
-                default:
-                    FAIL_("Unsupported op");
+                    push(*result);
+                    VM_DISPATCH();
                 }
             }
-            else if (auto lhsStrPtr = std::get_if<String>(&lhs))
+            arithmetic(opCode, lhs, rhs);
+            VM_DISPATCH();
+        }
+        VM_CASE(kMUL):
+        {
+            auto const rhs = popOperand();
+            auto const lhs = popOperand();
+            if (lhs.isInt() && rhs.isInt())
             {
-                auto lhsStr = *lhsStrPtr;
-                auto rhsStr = std::get<String>(rhs);
-                switch (opCode)
-                {
-                case kADD:
+                if (auto const result = fixnum(int64_t{lhs.asInt()} * rhs.asInt()))
                 {
-                    auto result = lhsStr.value + rhsStr.value;
-                    operandStack().push(String{result});
-                    break;
-                }
-                
-                default:
-                    FAIL_("Unsupported op");
+                    push(*result);
+                    VM_DISPATCH();
                 }
             }
-            else
+            arithmetic(opCode, lhs, rhs);
+            VM_DISPATCH();
+        }
+        VM_CASE(kLESS_THAN):
+        {
+            auto const rhs = popOperand();
+            auto const lhs = popOperand();
+            if (lhs.isInt() && rhs.isInt())
             {
-                FAIL_("Unsupported operand type!");
+                push(Bool{lhs.asInt() < rhs.asInt()});
+                VM_DISPATCH();
             }
-            break;
+            arithmetic(opCode, lhs, rhs);
+            VM_DISPATCH();
         }
-        case kNOT:
+        VM_CASE(kDIV):
+        VM_CASE(kMOD):
         {
-            auto value = std::get<Bool>(operandStack().top());
-            operandStack().pop();
-            operandStack().push(Bool{!value.value});
-            break;
+            auto const rhs = popOperand();
+            auto const lhs = popOperand();
+            arithmetic(opCode, lhs, rhs);
+            VM_DISPATCH();
         }
-        case kMINUS:
+        VM_CASE(kNOT):
         {
-            auto num = std::get<Double>(operandStack().top());
-            operandStack().pop();
-            operandStack().push(Double{-num.value});
-            break;
+            auto const value = get<Bool>(popOperand());
+            push(Bool{!value.value});
+            VM_DISPATCH();
         }
-        case kCONST:
+        VM_CASE(kMINUS):
         {
-            uint32_t index = fourBytesToInteger<uint32_t>(&instructions()[mIp]);
-            mIp += 4;
-            operandStack().push(mCode.constantPool.at(index));
-            break;
+            push(negate(popOperand()));
+            VM_DISPATCH();
         }
-        case kPRINT:
+        VM_CASE(kCONST):
         {
-            auto op = operandStack().top();
-            operandStack().pop();
-            std::cout << op << std::endl;
-            break;
+            auto const index = fetchOperand<uint32_t>(ip);
+            push(constants->at(index));
+            VM_DISPATCH();
         }
-        case kERROR:
+        VM_CASE(kPRINT):
         {
-            auto op = operandStack().top();
-            operandStack().pop();
-            std::cout << "Error : " << op << std::endl;
-            break;
+            std::cout << popOperand() << std::endl;
+            VM_DISPATCH();
+        }
+        VM_CASE(kERROR):
+        {
+            std::cout << "Error : " << popOperand() << std::endl;
+            VM_DISPATCH();
         }
-        case kHALT:
+        VM_CASE(kHALT):
+        {
+            // Stay on the halt so that a later run() returns immediately.
+            mIp = static_cast<size_t>(ip - code) - 1;
             return;
-        case kCALL:
+        }
+        VM_CASE(kGET_GLOBAL_CALL):
+        {
+            auto const index = fetchOperand<uint32_t>(ip);
+            push(mGlobals.at(index));
+            goto call;
+        }
+        VM_CASE(kCURRENT_FUNCTION_CALL):
+        {
+            push(mCallStack.back().closure());
+            goto call;
+        }
+        VM_CASE(kCALL):
+        call:
         {
-            uint32_t nbParams = fourBytesToInteger<uint32_t>(&instructions()[mIp]);
-            mIp += 4;
+            auto const nbParams = fetchOperand<uint32_t>(ip);
 
-            auto const closurePtrPtr = std::get_if<ClosurePtr>(&operandStack().top());
-            ASSERT(closurePtrPtr);
-            auto const closurePtr = *closurePtrPtr;
-            auto const functionSymbol = closurePtr->funcSym();
-            operandStack().pop();
+            auto const closurePtr = mStack.back().as<Closure>();
+            if (!closurePtr)
+            {
+                auto const builtin = mStack.back().as<Builtin>();
+                ASSERT_MSG(builtin, "Not a procedure!");
+                mStack.pop_back();
+                callBuiltin(*builtin, nbParams);
+                VM_DISPATCH();
+            }
+            auto const& functionSymbol = closurePtr->funcSym();
             auto const nbArgs = functionSymbol.nbArgs();
             ASSERT(nbParams + 1 >= nbArgs);
-            std::vector<Object> params(nbArgs + functionSymbol.nbLocals());
+            if (functionSymbol.variadic())
+            {
+                // The rest list is allocated while the closure and the arguments are still on the stack.
+                collectIfNeeded();
+            }
+            mStack.pop_back();
+            if (mCallStack.size() >= mMaxCallDepth)
+            {
+                throw std::runtime_error{"stack overflow: call depth exceeds " + std::to_string(mMaxCallDepth)};
+            }
+            // The arguments stay where the caller pushed them and become the first locals of the callee.
+            auto const basePointer = mStack.size() - nbParams;
             if (!functionSymbol.variadic())
             {
                 ASSERT(nbParams == nbArgs);
-                for (size_t i = nbArgs; i > 0; --i)
-                {
-                    params.at(i - 1) = operandStack().top();
-                    operandStack().pop();
-                }
             }
             else
             {
@@ -362,194 +839,313 @@ void VM::run()
                 Object rest = vmNull;
                 for (size_t i = 0; i < nbRest; ++i)
                 {
-                    rest = cons(operandStack().top(), rest);
-                    operandStack().pop();
+                    rest = mHeap.cons(popOperand(), rest);
                 }
-                params.at(nbArgs - 1) = rest;
-                for (size_t i = nbArgs - 1; i > 0; --i)
+                push(std::move(rest));
+            }
+            mStack.resize(basePointer + nbArgs + functionSymbol.nbLocals());
+
+            mCallStack.emplace_back(closurePtr, basePointer, static_cast<size_t>(ip - code));
+            bp = basePointer;
+            code = functionSymbol.linkedInstructions().data();
+            constants = &functionSymbol.constantPool();
+            ip = code;
+            VM_DISPATCH();
+        }
+        VM_CASE(kGET_GLOBAL_TAIL_CALL):
+        {
+            auto const index = fetchOperand<uint32_t>(ip);
+            push(mGlobals.at(index));
+            goto tailCall;
+        }
+        VM_CASE(kCURRENT_FUNCTION_TAIL_CALL):
+        {
+            push(mCallStack.back().closure());
+            goto tailCall;
+        }
+        VM_CASE(kTAIL_CALL):
+        tailCall:
+        {
+            // Same as kCALL, except that the callee replaces the running frame instead of pushing a new one.
+            auto const nbParams = fetchOperand<uint32_t>(ip);
+
+            auto const closurePtr = mStack.back().as<Closure>();
+            if (!closurePtr)
+            {
+                // A builtin runs without a frame, its value is returned right away.
+                auto const builtin = mStack.back().as<Builtin>();
+                ASSERT_MSG(builtin, "Not a procedure!");
+                mStack.pop_back();
+                callBuiltin(*builtin, nbParams);
+                goto ret;
+            }
+            auto const& functionSymbol = closurePtr->funcSym();
+            auto const nbArgs = functionSymbol.nbArgs();
+            ASSERT(nbParams + 1 >= nbArgs);
+            if (functionSymbol.variadic())
+            {
+                collectIfNeeded();
+            }
+            mStack.pop_back();
+            auto const argsBegin = mStack.size() - nbParams;
+            if (!functionSymbol.variadic())
+            {
+                ASSERT(nbParams == nbArgs);
+            }
+            else
+            {
+                auto nbRest = nbParams + 1 - nbArgs; 
+                Object rest = vmNull;
+                for (size_t i = 0; i < nbRest; ++i)
                 {
-                    params.at(i - 1) = operandStack().top();
-                    operandStack().pop();
+                    rest = mHeap.cons(popOperand(), rest);
                 }
+                push(std::move(rest));
             }
+            auto const argsPos = mStack.begin() + static_cast<std::ptrdiff_t>(argsBegin);
+            std::move(argsPos, argsPos + static_cast<std::ptrdiff_t>(nbArgs), mStack.begin() + static_cast<std::ptrdiff_t>(bp));
+            mStack.resize(bp + nbArgs);
+            mStack.resize(bp + nbArgs + functionSymbol.nbLocals());
 
-            mCallStack.push(StackFrame{closurePtr, std::move(params), mIp});
-            mIp = 0;
-            break;
+            auto& frame = mCallStack.back();
+            frame = StackFrame{closurePtr, bp, frame.returnAddress()};
+            code = functionSymbol.linkedInstructions().data();
+            constants = &functionSymbol.constantPool();
+            ip = code;
+            VM_DISPATCH();
         }
-        case kRET:
+        VM_CASE(kRET):
+        ret:
         {
-            mIp = mCallStack.top().returnAddress();
-            mCallStack.pop();
-            break;
+            auto result = popOperand();
+            auto const& frame = mCallStack.back();
+            auto const returnAddress = frame.returnAddress();
+            mStack.resize(frame.basePointer());
+            push(std::move(result));
+            mCallStack.pop_back();
+            bp = mCallStack.empty() ? 0 : mCallStack.back().basePointer();
+            code = instructions().data();
+            constants = &constantPool();
+            ip = code + returnAddress;
+            VM_DISPATCH();
         }
-        case kGET_LOCAL:
+        VM_CASE(kGET_LOCAL):
         {
-            uint32_t index = fourBytesToInteger<uint32_t>(&instructions()[mIp]);
-            mIp += 4;
-
-            operandStack().push(mCallStack.top().locals(index));
-            break;
+            auto const index = fetchOperand<uint32_t>(ip);
+            push(mStack[bp + index]);
+            VM_DISPATCH();
         }
-        case kSET_LOCAL:
+        VM_CASE(kSET_LOCAL):
         {
-            uint32_t index = fourBytesToInteger<uint32_t>(&instructions()[mIp]);
-            mIp += 4;
-
-            mCallStack.top().locals(index) = operandStack().top();
-            operandStack().pop();
-            break;
+            auto const index = fetchOperand<uint32_t>(ip);
+            mStack[bp + index] = popOperand();
+            VM_DISPATCH();
         }
-        case kTRUE:
+        VM_CASE(kTRUE):
         {
-            operandStack().push(Bool{true});
-            break;
+            push(Bool{true});
+            VM_DISPATCH();
         }
-        case kFALSE:
+        VM_CASE(kFALSE):
         {
-            operandStack().push(Bool{false});
-            break;
+            push(Bool{false});
+            VM_DISPATCH();
         }
-        case kNULL:
+        VM_CASE(kNULL):
         {
-            operandStack().push(vmNull);
-            break;
+            push(vmNull);
+            VM_DISPATCH();
         }
-        case kJUMP:
+        VM_CASE(kJUMP):
         {
-            uint32_t index = fourBytesToInteger<uint32_t>(&instructions()[mIp]);
-            mIp = index;
-            break;
+            ip = code + *ip;
+            VM_DISPATCH();
         }
-        case kJUMP_IF_NOT_TRUE:
+        VM_CASE(kJUMP_IF_NOT_TRUE):
         {
-            auto predPtr = std::get_if<Bool>(&operandStack().top());
-            operandStack().pop();
+            auto const pred = popOperand();
             // not false => true
-            auto const isTrue = (predPtr == nullptr || predPtr->value);
+            auto const isTrue = !pred.isBool() || pred.asBool();
             if (!isTrue)
             {
-                uint32_t index = fourBytesToInteger<uint32_t>(&instructions()[mIp]);
-                mIp = index;
+                ip = code + *ip;
             }
             else
             {
-                mIp += 4;
+                ++ip;
             }
-            break;
+            VM_DISPATCH();
         }
-        case kSET_GLOBAL:
+        VM_CASE(kJUMP_IF_TRUE):
         {
-            auto value = operandStack().top();
-            operandStack().pop();
-            uint32_t index = fourBytesToInteger<uint32_t>(&instructions()[mIp]);
-            mIp += 4;
+            auto const pred = popOperand();
+            auto const isTrue = !pred.isBool() || pred.asBool();
+            if (isTrue)
+            {
+                ip = code + *ip;
+            }
+            else
+            {
+                ++ip;
+            }
+            VM_DISPATCH();
+        }
+        VM_CASE(kSET_GLOBAL):
+        {
+            auto value = popOperand();
+            auto const index = fetchOperand<uint32_t>(ip);
             if (mGlobals.size() == index)
             {
-                mGlobals.push_back(value);
+                mGlobals.push_back(std::move(value));
             }
             else
             {
-                mGlobals.at(index) = value;
+                mGlobals.at(index) = std::move(value);
             }
-            break;
+            VM_DISPATCH();
         }
-        case kGET_GLOBAL:
+        VM_CASE(kGET_GLOBAL):
         {
-            uint32_t index = fourBytesToInteger<uint32_t>(&instructions()[mIp]);
-            mIp += 4;
-            operandStack().push(mGlobals.at(index));
-            break;
+            auto const index = fetchOperand<uint32_t>(ip);
+            push(mGlobals.at(index));
+            VM_DISPATCH();
         }
-        case kPOP:
+        VM_CASE(kPOP):
         {
-            operandStack().pop();
-            break;
+            mStack.pop_back();
+            VM_DISPATCH();
         }
-        case kSPLICING:
+        VM_CASE(kSPLICING):
         {
-            auto const op = operandStack().top();
-            operandStack().pop();
-            operandStack().push(Splicing{std::get<ConsPtr>(op)});
-            break;
+            collectIfNeeded();
+            auto const op = popOperand();
+            push(mHeap.make<SplicingObject>(get<ConsPtr>(op)));
+            VM_DISPATCH();
         }
-        case kCONS:
+        VM_CASE(kCONS):
         {
-            auto const cdr = operandStack().top();
-            operandStack().pop();
-            auto const car = operandStack().top();
-            operandStack().pop();
-            if (auto const splicingPtr = std::get_if<Splicing>(&car))
+            collectIfNeeded();
+            auto cdr = popOperand();
+            auto car = popOperand();
+            if (auto const splicingPtr = car.as<SplicingObject>())
             {
                 auto vec = consToVec(splicingPtr->value); 
-                vec.push_back(Symbol{"."});
+                vec.push_back(Symbol{intern(".")});
                 vec.push_back(cdr);
-                operandStack().push(vecToCons(vec));
+                push(vecToCons(mHeap, vec));
             }
             else
             {
-                operandStack().push(cons(car, cdr));
+                push(mHeap.cons(car, cdr));
             }
-            break;
+            VM_DISPATCH();
         }
-        case kCAR:
-        case kCDR:
+        VM_CASE(kAPPEND):
         {
-            auto const obj = operandStack().top();
-            auto const consPtrPtr = std::get_if<ConsPtr>(&obj);
-            ASSERT(consPtrPtr);
-            auto const& consPtr = *consPtrPtr;
-            operandStack().pop();
-            operandStack().push(opCode == kCAR ? car(consPtr) : cdr(consPtr));
-            break;
+            // The operands are still on the stack while the copy is allocated.
+            collectIfNeeded();
+            auto const rhs = popOperand();
+            auto const lhs = popOperand();
+            push(append(lhs, rhs));
+            VM_DISPATCH();
         }
-        case kCURRENT_FUNCTION:
+        VM_CASE(kCAR):
+        VM_CASE(kCDR):
         {
-            operandStack().push(mCallStack.top().closure());
-            break;
+            auto const obj = popOperand();
+            auto const consPtr = obj.as<VMCons>();
+            ASSERT(consPtr);
+            push(opCode == kCAR ? consPtr->car() : consPtr->cdr());
+            VM_DISPATCH();
         }
-        case kCLOSURE:
+        VM_CASE(kGET_LOCAL_CAR):
+        VM_CASE(kGET_LOCAL_CDR):
         {
-            uint32_t index = fourBytesToInteger<uint32_t>(&instructions()[mIp]);
-            mIp += 4;
-            uint32_t nbFreeVars = fourBytesToInteger<uint32_t>(&instructions()[mIp]);
-            mIp += 4;
+            auto const index = fetchOperand<uint32_t>(ip);
+            auto const consPtr = mStack[bp + index].as<VMCons>();
+            ASSERT(consPtr);
+            push(opCode == kGET_LOCAL_CAR ? consPtr->car() : consPtr->cdr());
+            VM_DISPATCH();
+        }
+        VM_CASE(kJUMP_IF_LOCAL_NOT_NULL):
+        {
+            auto const target = fetchOperand<uint32_t>(ip);
+            auto const index = fetchOperand<uint32_t>(ip);
+            if (!mStack[bp + index].isNull())
+            {
+                ip = code + target;
+            }
+            VM_DISPATCH();
+        }
+        VM_CASE(kADD_ICONST):
+        VM_CASE(kSUB_ICONST):
+        {
+            auto const rhs = fetchOperand<int32_t>(ip);
+            auto const lhs = popOperand();
+            auto const add = opCode == kADD_ICONST;
+            if (lhs.isInt())
+            {
+                if (auto const result = fixnum(add ? int64_t{lhs.asInt()} + rhs : int64_t{lhs.asInt()} - rhs))
+                {
+                    push(*result);
+                    VM_DISPATCH();
+                }
+            }
+            arithmetic(add ? kADD : kSUB, lhs, Int{rhs});
+            VM_DISPATCH();
+        }
+        VM_CASE(kCURRENT_FUNCTION):
+        {
+            push(mCallStack.back().closure());
+            VM_DISPATCH();
+        }
+        VM_CASE(kCLOSURE):
+        {
+            collectIfNeeded();
+            auto const index = fetchOperand<uint32_t>(ip);
+            auto const nbFreeVars = fetchOperand<uint32_t>(ip);
             auto freeVars = std::vector<Object>(nbFreeVars);
             for (size_t i = nbFreeVars; i > 0; --i)
             {
-                freeVars[i-1] = operandStack().top();
-                operandStack().pop();
+                freeVars[i-1] = popOperand();
             }
-            auto const funcSym = mCode.constantPool.at(index);
-            auto const closurePtr = std::make_shared<Closure>(std::get<FunctionSymbol>(funcSym), freeVars);
-            operandStack().push(closurePtr);
-            break;
+            auto const funcSym = constants->at(index).as<FunctionSymbol>();
+            ASSERT(funcSym);
+            push(mHeap.make<Closure>(funcSym, std::move(freeVars)));
+            VM_DISPATCH();
         }
-        case kGET_FREE:
+        VM_CASE(kGET_FREE):
         {
-            uint32_t index = fourBytesToInteger<uint32_t>(&instructions()[mIp]);
-            mIp += 4;
-
-            operandStack().push(mCallStack.top().closure()->freeVars().at(index));
-            break;
+            auto const index = fetchOperand<uint32_t>(ip);
+            push(mCallStack.back().closure()->freeVars().at(index));
+            VM_DISPATCH();
         }
-        case kIS_CONS:
+        VM_CASE(kIS_CONS):
         {
-            auto const obj = operandStack().top();
-            operandStack().pop();
-            auto const consPtrPtr = std::get_if<ConsPtr>(&obj);
-            operandStack().push(Bool{consPtrPtr != nullptr});
-            break;
+            auto const obj = popOperand();
+            push(Bool{obj.is<VMCons>()});
+            VM_DISPATCH();
         }
-        case kIS_NULL:
+        VM_CASE(kIS_NULL):
         {
-            auto const obj = operandStack().top();
-            operandStack().pop();
-            auto const nullPtr = std::get_if<VMNull>(&obj);
-            operandStack().push(Bool{nullPtr != nullptr});
-            break;
-        }
+            auto const obj = popOperand();
+            push(Bool{obj.isNull()});
+            VM_DISPATCH();
         }
-    }
+    VM_LOOP_END
 }
-} // namespace vm
\ No newline at end of file
+
+#if LISP_VM_THREADED
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#else
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+#undef VM_PROFILE
+#undef VM_CASE
+#undef VM_DISPATCH
+#undef VM_LOOP_BEGIN
+#undef VM_LOOP_END
+} // namespace vm
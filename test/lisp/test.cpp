@@ -2,6 +2,8 @@
 #include "lisp/parser.h"
 #include "gtest/gtest.h"
 #include <numeric>
+#include <cstdlib>
+#include <new>
 
 TEST(Lexer, 1)
 {
@@ -493,3 +495,256 @@ TEST(Parser, begin2)
     }
     EXPECT_TRUE(p.eof());
 }
+
+static void defineCountDownPrimitives(std::shared_ptr<Env> const& env)
+{
+    auto eq = [](std::vector<std::shared_ptr<Expr>> const& args)
+    {
+        ASSERT(args.size() == 2);
+        auto num1 = dynamic_cast<Number&>(*args.at(0));
+        auto num2 = dynamic_cast<Number&>(*args.at(1));
+        return std::shared_ptr<Expr>(new Bool(num1.get() == num2.get()));
+    };
+    Definition("=", ExprPtr{new PrimitiveProcedure{eq}}).eval(env);
+
+    auto sub = [](std::vector<std::shared_ptr<Expr>> const& args)
+    {
+        ASSERT(args.size() == 2);
+        auto num1 = dynamic_cast<Number&>(*args.at(0));
+        auto num2 = dynamic_cast<Number&>(*args.at(1));
+        return std::shared_ptr<Expr>(new Number(num1.get() - num2.get()));
+    };
+    Definition("-", ExprPtr{new PrimitiveProcedure{sub}}).eval(env);
+}
+
+TEST(Evaluator, tailCall)
+{
+    // Calls in tail position through if, begin and a nested lambda do not nest evaluations.
+    Lexer lex("(define (loop n) (if (= n 0) 'done (begin 1 ((lambda (m) (loop m)) (- n 1))))) (loop 100000)");
+    MetaParser p(lex);
+
+    auto env = std::make_shared<Env>();
+    defineCountDownPrimitives(env);
+
+    parse(p.sexpr())->eval(env);
+    EXPECT_EQ(parse(p.sexpr())->eval(env)->toString(), "'done");
+    EXPECT_TRUE(p.eof());
+
+    env->clear();
+}
+
+TEST(Evaluator, maxEvalDepth)
+{
+    Lexer lex("(define (count n) (if (= n 0) 0 (- (count (- n 1)) 1))) (count 10) (count 1000)");
+    MetaParser p(lex);
+
+    auto env = std::make_shared<Env>();
+    defineCountDownPrimitives(env);
+
+    auto const oldDepth = maxEvalDepth();
+    setMaxEvalDepth(100);
+    parse(p.sexpr())->eval(env);
+    EXPECT_EQ(parse(p.sexpr())->eval(env)->toString(), "-10");
+    auto deepCall = parse(p.sexpr());
+    EXPECT_THROW(deepCall->eval(env), std::runtime_error);
+    // The depth is restored after the error, the evaluator is still usable.
+    setMaxEvalDepth(oldDepth);
+    EXPECT_EQ(deepCall->eval(env)->toString(), "-1000");
+    EXPECT_TRUE(p.eof());
+
+    env->clear();
+}
+
+TEST(Evaluator, lexicalAddressing)
+{
+    std::initializer_list<std::pair<std::string, std::string> > expected = {
+        // Closures over procedure frames, shadowing.
+        {"(define (adder x) (lambda (y) (- y (- 0 x))))", "CompoundProcedure (x, (Sequence: Lambda), <procedure-env>)"},
+        {"((adder 1) 2)", "3"},
+        {"((lambda (x) ((lambda (x) x) 2)) 1)", "2"},
+        // Internal definitions referred to before they are defined.
+        {"(define (outer n) (define (even? n) (if (= n 0) #t (odd? (- n 1)))) (define (odd? n) (if (= n 0) #f (even? (- n 1)))) (even? n))", "CompoundProcedure (n, (Sequence: Definition ( even? : Lambda ) Definition ( odd? : Lambda ) (App:even? n)), <procedure-env>)"},
+        {"(outer 10)", "true"},
+        // Assignment of a variable of an enclosing frame.
+        {"(define (counter) (define n 0) (lambda () (set! n (- n 1)) n))", "CompoundProcedure ((Sequence: Definition ( n : 0 ) Lambda), <procedure-env>)"},
+        {"(define c (counter))", "CompoundProcedure ((Sequence: Assignment ( n : (App:- n 1) ) n), <procedure-env>)"},
+        {"(c)", "-1"},
+        {"(c)", "-2"},
+        {"(define (g) (define a b) (define b 1) a)", "CompoundProcedure ((Sequence: Definition ( a : b ) Definition ( b : 1 ) a), <procedure-env>)"},
+    };
+
+    Lexer lex(std::accumulate(expected.begin(), expected.end(), std::string{}, [](auto const& s, auto const& e) { return s + e.first; }));
+    MetaParser p(lex);
+
+    auto env = std::make_shared<Env>();
+    defineCountDownPrimitives(env);
+
+    for (auto s : expected)
+    {
+        EXPECT_EQ(analyze(parse(p.sexpr()))->eval(env)->toString(), s.second);
+    }
+    EXPECT_TRUE(p.eof());
+
+    // b is bound in the frame of g but not defined yet.
+    Lexer lex2("(g)");
+    MetaParser p2(lex2);
+    EXPECT_THROW(analyze(parse(p2.sexpr()))->eval(env), std::runtime_error);
+
+    env->clear();
+}
+
+// Counts the allocations made through the global operator new, for checking that evaluation does not allocate.
+static size_t& allocationCount()
+{
+    static size_t count = 0;
+    return count;
+}
+
+void* operator new(std::size_t size)
+{
+    ++allocationCount();
+    if (auto ptr = std::malloc(size == 0 ? 1 : size))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+// Once inlined, GCC sees the free of memory coming from operator new and cannot tell it is the replaced one.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+#pragma GCC diagnostic pop
+
+TEST(Evaluator, constantsDoNotAllocate)
+{
+    Lexer lex("1 1.5 \"abc\" #t '() 'a '(1 (2 b)) + (+ 1 2) (+ 0.5 0.25)");
+    MetaParser p(lex);
+
+    auto env = std::make_shared<Env>();
+    auto add = [](std::vector<std::shared_ptr<Expr>> const& args)
+    {
+        auto result = std::accumulate(args.begin(), args.end(), 0.0, [](auto p, std::shared_ptr<Expr> const& arg)
+        {
+            auto num = dynamic_cast<Number&>(*arg);
+            return p + num.get();
+        }
+        );
+        return number(result);
+    };
+    Definition("+", ExprPtr{new PrimitiveProcedure{add}}).eval(env);
+
+    std::vector<ExprPtr> constants;
+    for (size_t i = 0; i < 8; ++i)
+    {
+        constants.push_back(analyze(parse(p.sexpr())));
+    }
+    for (auto const& c : constants)
+    {
+        auto const before = allocationCount();
+        auto const value = c->eval(env);
+        EXPECT_EQ(allocationCount(), before) << c->toString();
+    }
+    // Small integer results are shared too, other numbers are not.
+    auto const smallSum = analyze(parse(p.sexpr()));
+    EXPECT_EQ(smallSum->eval(env), number(3));
+    EXPECT_EQ(smallSum->eval(env), smallSum->eval(env));
+    auto const sum = analyze(parse(p.sexpr()));
+    EXPECT_EQ(sum->eval(env)->toString(), "0.75");
+    EXPECT_NE(sum->eval(env), sum->eval(env));
+    EXPECT_TRUE(p.eof());
+
+    env->clear();
+}
+
+TEST(Parser, registerSpecialForm)
+{
+    // (test-unless pred action) is (if pred null action)
+    registerSpecialForm("test-unless", [](ExprPtr const& cdr)
+    {
+        auto [pred, rest] = deCons(cdr);
+        return ExprPtr{new If(parse(pred), null(), parse(listBack(rest)))};
+    });
+    EXPECT_EQ(intern("test-unless"), intern(std::string{"test-"} + "unless"));
+    EXPECT_NE(intern("test-unless"), intern("if"));
+
+    Lexer lex("(test-unless #f 1) (test-unless #t 1)");
+    MetaParser p(lex);
+    auto env = std::make_shared<Env>();
+    auto e = parse(p.sexpr());
+    EXPECT_EQ(e->toString(), "(if false () 1)");
+    EXPECT_EQ(e->eval(env)->toString(), "1");
+    EXPECT_EQ(parse(p.sexpr())->eval(env)->toString(), "()");
+    EXPECT_TRUE(p.eof());
+}
+
+TEST(Parser, internedNames)
+{
+    Lexer lex("(define abc 'abc) 'abc");
+    MetaParser p(lex);
+    auto env = std::make_shared<Env>();
+    auto const def = parse(p.sexpr());
+    auto const defPtr = dynamic_cast<Definition const*>(def.get());
+    ASSERT_TRUE(defPtr);
+    EXPECT_EQ(defPtr->id(), intern("abc"));
+    def->eval(env);
+    // The variable and the symbol named abc share one id.
+    auto const value = env->lookupVariableValue(intern("abc"));
+    EXPECT_EQ(dynamic_cast<Symbol const&>(*value).id(), intern("abc"));
+    EXPECT_TRUE(value->equalTo(parse(p.sexpr())->eval(env)));
+    env->clear();
+}
+
+TEST(Evaluator, consPool)
+{
+    auto const& stats = consPool().stats();
+    auto const allocations = stats.allocations;
+    auto const inUse = stats.cellsInUse;
+    {
+        // The Cons and its control block fit in one cell.
+        auto const cell = makeCons(number(1), null());
+        EXPECT_EQ(stats.allocations, allocations + 1);
+        EXPECT_EQ(stats.cellsInUse, inUse + 1);
+        EXPECT_EQ(cell->toString(), "(1)");
+    }
+    EXPECT_EQ(stats.cellsInUse, inUse);
+    auto const recycled = stats.recycled;
+    auto const cell = makeCons(number(2), null());
+    EXPECT_EQ(stats.recycled, recycled + 1);
+}
+
+TEST(Evaluator, macroExpansionCache)
+{
+    Lexer lex("(define twice (macro (x) `(+ ,x ,x))) (twice (f 1)) (twice (f 1)) (twice (f -0)) (twice (f 0))"
+              "(g (twice (f 1))) (g '(1 \"a\" (b)))");
+    MetaParser p(lex);
+    auto macroEnv = std::make_shared<Env>();
+    EXPECT_EQ(expandMacros(p.sexpr(), macroEnv), null());
+    auto const& macro = dynamic_cast<MacroProcedure const&>(*macroEnv->lookupVariableValue(intern("twice")));
+    // Calls with the same forms share one expansion.
+    auto const expansion = expandMacros(p.sexpr(), macroEnv);
+    EXPECT_EQ(expansion->toString(), "(+ (f 1) (f 1))");
+    EXPECT_EQ(expandMacros(p.sexpr(), macroEnv), expansion);
+    EXPECT_EQ(macro.nbExpansions(), 1U);
+    // Numbers are the same forms when they have the same bits.
+    EXPECT_EQ(expandMacros(p.sexpr(), macroEnv)->toString(), "(+ (f -0) (f -0))");
+    EXPECT_EQ(expandMacros(p.sexpr(), macroEnv)->toString(), "(+ (f 0) (f 0))");
+    EXPECT_EQ(macro.nbExpansions(), 3U);
+    auto const nested = expandMacros(p.sexpr(), macroEnv);
+    EXPECT_EQ(nested->toString(), "(g (+ (f 1) (f 1)))");
+    EXPECT_EQ(dynamic_cast<Cons const&>(*dynamic_cast<Cons const&>(*nested).cdr()).car(), expansion);
+    EXPECT_EQ(macro.nbExpansions(), 3U);
+    // Forms without macro calls are returned as they are.
+    auto const plain = p.sexpr();
+    EXPECT_EQ(expandMacros(plain, macroEnv), plain);
+    EXPECT_TRUE(p.eof());
+    macroEnv->clear();
+}
@@ -1,5 +1,7 @@
 #include "gtest/gtest.h"
 #include "lisp/compiler.h"
+#include "lisp/image.h"
+#include "lisp/bytecode.h"
 #include "lisp/metaParser.h"
 #include "lisp/parser.h"
 #include <numeric>
@@ -138,7 +140,7 @@ TEST(Compiler, lambda0)
     Compiler c{};
     ExprPtr num{new Number{5.5}};
     std::shared_ptr<Sequence> seq{new Sequence{{num}}};
-    ExprPtr func{new Lambda{Params{std::make_pair(std::vector<std::string>{}, false)}, seq}};
+    ExprPtr func{new Lambda{Params{std::make_pair(std::vector<SymbolId>{}, false)}, seq}};
     auto const name = "getNum";
     ExprPtr def{new Definition{name, func}};
     c.compile(def);
@@ -158,7 +160,7 @@ TEST(Compiler, lambda1)
     Compiler c{};
     ExprPtr iVar{new Variable{"i"}};
     std::shared_ptr<Sequence> seq{new Sequence{{iVar}}};
-    ExprPtr func{new Lambda{Params{std::make_pair(std::vector<std::string>{"i"}, false)}, seq}};
+    ExprPtr func{new Lambda{Params{std::make_pair(std::vector<SymbolId>{intern("i")}, false)}, seq}};
     auto const name = "identity";
     ExprPtr def{new Definition{name, func}};
     c.compile(def);
@@ -179,7 +181,7 @@ TEST(Compiler, lambda2)
     ExprPtr num{new Number{5.5}};
     ExprPtr iVar{new Variable{"i"}};
     std::shared_ptr<Sequence> seq{new Sequence{{iVar}}};
-    ExprPtr func{new Lambda{Params{std::make_pair(std::vector<std::string>{"i"}, false)}, seq}};
+    ExprPtr func{new Lambda{Params{std::make_pair(std::vector<SymbolId>{intern("i")}, false)}, seq}};
     auto const name = "identity";
     ExprPtr def{new Definition{name, func}};
     c.compile(def);
@@ -203,7 +205,7 @@ TEST(Compiler, lambda3)
     ExprPtr plusVar{new Variable{"+"}};
     ExprPtr doubleApp{new Application{plusVar, {iVar, iVar}}};
     std::shared_ptr<Sequence> seq{new Sequence{{doubleApp}}};
-    ExprPtr func{new Lambda{Params{std::make_pair(std::vector<std::string>{"i"}, false)}, seq}};
+    ExprPtr func{new Lambda{Params{std::make_pair(std::vector<SymbolId>{intern("i")}, false)}, seq}};
     auto const name = "double";
     ExprPtr def{new Definition{name, func}};
     c.compile(def);
@@ -225,7 +227,7 @@ TEST(Compiler, Variadiclambda)
     ExprPtr num{new Number{5.5}};
     ExprPtr iVar{new Variable{"i"}};
     std::shared_ptr<Sequence> seq{new Sequence{{iVar}}};
-    ExprPtr func{new Lambda{Params{std::make_pair(std::vector<std::string>{"i"}, true)}, seq}};
+    ExprPtr func{new Lambda{Params{std::make_pair(std::vector<SymbolId>{intern("i")}, true)}, seq}};
     auto const name = "list";
     ExprPtr def{new Definition{name, func}};
     c.compile(def);
@@ -261,19 +263,42 @@ TEST(Compiler, consCar)
     EXPECT_EQ(output, "5.5\n");
 }
 
-auto sourceToBytecode(std::string const& source)
+auto compileSource(std::string const& source, CompilerOptions const& options = {})
 {
     Lexer lex(source);
     MetaParser p(lex);
     
-    Compiler c{};
+    auto c = std::make_unique<Compiler>(options);
     while (!p.eof())
     {
         auto e = parse(p.sexpr());
-        c.compile(e);
+        c->compile(e);
     }
 
-    return c.code();
+    return c;
+}
+
+auto sourceToBytecode(std::string const& source, CompilerOptions const& options = {})
+{
+    return compileSource(source, options)->code();
+}
+
+// What the code of source prints, and the compiler of source for its stats. The op codes run are counted in profile
+// when given.
+auto compileAndRun(std::string const& source, CompilerOptions const& options = {}, vm::OpCodeProfile* profile = nullptr)
+{
+    auto c = compileSource(source, options);
+    vm::VM vm{c->code()};
+    testing::internal::CaptureStdout();
+    if (profile)
+    {
+        vm.runProfiled(*profile);
+    }
+    else
+    {
+        vm.run();
+    }
+    return std::make_pair(testing::internal::GetCapturedStdout(), std::move(c));
 }
 
 TEST(Compiler, square)
@@ -413,3 +438,454 @@ TEST(Compiler, splicing2)
     std::string output = testing::internal::GetCapturedStdout();
     EXPECT_EQ(output, "(1 ('quasiquote ('quasiquote ('quasiquote ('unquote ('unquote-splicing ('unquote '+ 1 2)))))) 4)\n");
 }
+
+TEST(Compiler, deepRecursion)
+{
+    std::string const source = "(define (range n) (if (= n 0) '() (cons n (range (- n 1)))))"
+                               "(define (len lst) (if (null? lst) 0 (+ 1 (len (cdr lst)))))"
+                               "(print (len (range 10000)))";
+    auto code = sourceToBytecode(source);
+    vm::VM vm{code};
+    testing::internal::CaptureStdout();
+    vm.run();
+    std::string output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(output, "10000\n");
+}
+
+TEST(Compiler, stackOverflow)
+{
+    std::string const source = "(define (f n) (+ 1 (f n))) (f 1)";
+    auto code = sourceToBytecode(source);
+    vm::VM vm{code, 100};
+    EXPECT_THROW(vm.run(), std::runtime_error);
+}
+
+TEST(Compiler, tailCall)
+{
+    std::string const source = "(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))"
+                               "(define (count lst acc) (if (null? lst) acc (count (cdr lst) (+ acc 1))))"
+                               "(print (count (build 300000 '()) 0))";
+    auto code = sourceToBytecode(source);
+    vm::VM vm{code, 10};
+    testing::internal::CaptureStdout();
+    vm.run();
+    std::string output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(output, "300000\n");
+}
+
+TEST(Compiler, variadicTailCall)
+{
+    std::string const source = "(define (f n . rest) (if (= n 0) rest (f (- n 1) n))) (define (g) (f 2 7 8)) (print (g))";
+    auto code = sourceToBytecode(source);
+    vm::VM vm{code, 10};
+    testing::internal::CaptureStdout();
+    vm.run();
+    std::string output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(output, "(1)\n");
+}
+
+TEST(Compiler, garbageCollection)
+{
+    // Each round builds a fresh list and drops it: the heap stays bounded by what a round keeps alive.
+    std::string const source = "(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))"
+                               "(define (count lst acc) (if (null? lst) acc (count (cdr lst) (+ acc 1))))"
+                               "(define (repeat n lst) (if (= n 0) lst (repeat (- n 1) (build 10000 '()))))"
+                               "(print (count (repeat 50 '()) 0))";
+    auto code = sourceToBytecode(source);
+    vm::VM vm{code};
+    testing::internal::CaptureStdout();
+    vm.run();
+    std::string output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(output, "10000\n");
+    auto const& stats = vm.gcStats();
+    EXPECT_GT(stats.collections, 0U);
+    EXPECT_GT(stats.bytesFreed, 0U);
+    EXPECT_LT(stats.bytesInUse, stats.bytesAllocated / 10);
+    EXPECT_LE(stats.maxPause, stats.totalPause);
+}
+
+TEST(Compiler, fixnum)
+{
+    std::string const source = "(print (+ 2147483646 1))"
+                               "(print (+ 2147483647 1))"
+                               "(print (* 65536 65536))"
+                               "(print (- (- 0 2147483647) 1))"
+                               "(print (- (- (- 0 2147483647) 1)))"
+                               "(print (% 17 5))"
+                               "(print (% -17 5))"
+                               "(print (/ 12 4))"
+                               "(print (/ 7 2))"
+                               "(print (+ 1 0.5))"
+                               "(print (< 2 3))"
+                               "(print (< 1.5 1))"
+                               "(print (= 1 1.0))"
+                               "(print (= 2 (/ 6 3)))";
+    // The arithmetic runs in the VM instead of being folded.
+    CompilerOptions options{};
+    options.astOptimizer = false;
+    auto code = sourceToBytecode(source, options);
+    // Only 0.5 and 1.5 are not fixnums.
+    EXPECT_EQ(code.constantPool.size(), 2U);
+    vm::VM vm{code};
+    testing::internal::CaptureStdout();
+    vm.run();
+    std::string output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(output, "2147483647\n2.14748e+09\n4.29497e+09\n-2147483648\n2.14748e+09\n2\n-2\n3\n3.5\n1.5\ntrue\nfalse\ntrue\ntrue\n");
+}
+
+TEST(Compiler, constantPool)
+{
+    std::string const source = "(define (f x) (if (eq? x 'a) \"yes\" (if (eq? x 'b) \"no\" \"yes\")))"
+                               "(print (cons 'a (cons 'a (cons 1.5 (cons 1.5 (cons \"yes\" (cons (f 'a) (cons (f 'b) (cons (f 'c) '())))))))))";
+    // f is called, not inlined.
+    CompilerOptions options{};
+    options.inliner = false;
+    auto const [output, c] = compileAndRun(source, options);
+    auto const code = c->code();
+    // The function, 'a, 1.5, "yes", 'b and 'c at the top level.
+    EXPECT_EQ(code.constantPool.size(), 6U);
+    auto const funcSym = code.constantPool.at(0).as<vm::FunctionSymbol>();
+    ASSERT_NE(funcSym, nullptr);
+    // 'a, "yes", 'b and "no" in f.
+    EXPECT_EQ(funcSym->constantPool().size(), 4U);
+    EXPECT_EQ(c->constantPoolStats().references, 14U);
+    EXPECT_EQ(c->constantPoolStats().entries, 10U);
+    EXPECT_EQ(output, "('a 'a 1.5 1.5 \"yes\" \"yes\" \"no\" \"yes\")\n");
+}
+
+TEST(Compiler, peephole)
+{
+    std::string const source = "(define (sign x) (if (< x 0) (- 1) (if (not (< 0 x)) 0 1)))"
+                               "(define (count-signs n acc) (if (< n -3) acc (count-signs (- n 1) (cons (sign n) acc))))"
+                               "(print (count-signs 3 '()))";
+    auto const run = [&source](bool peephole)
+    {
+        // Constants are left for the peephole optimizer to fold.
+        CompilerOptions options{};
+        options.astOptimizer = false;
+        options.peephole = peephole;
+        auto const [output, c] = compileAndRun(source, options);
+        return std::make_pair(output, c->peepholeStats());
+    };
+    auto const [output, stats] = run(true);
+    EXPECT_EQ(output, run(false).first);
+    EXPECT_EQ(output, "(-1 -1 -1 0 1 1 1)\n");
+    EXPECT_GT(stats.constantsFolded, 0U);
+    EXPECT_GT(stats.jumpsThreaded, 0U);
+    EXPECT_GT(stats.branchesInverted, 0U);
+    EXPECT_LT(stats.bytesAfter, stats.bytesBefore);
+}
+
+TEST(Compiler, superinstructions)
+{
+    std::string const source = "(define (range n) (if (= n 0) '() (cons n (range (- n 1)))))"
+                               "(define (len lst acc) (if (null? lst) acc (len (cdr lst) (+ acc 1))))"
+                               "(define (sum lst) (if (null? lst) 0 (+ (car lst) (sum (cdr lst)))))"
+                               "(define (countdown n) (if (< n 1) n (countdown (- n 2))))"
+                               "(define lst (range 100))"
+                               "(print (len lst 0))"
+                               "(print (sum lst))"
+                               "(print (countdown 7))";
+    auto const run = [&source](bool superinstructions)
+    {
+        CompilerOptions options{};
+        options.superinstructions = superinstructions;
+        vm::OpCodeProfile profile{};
+        auto const output = compileAndRun(source, options, &profile).first;
+        return std::make_pair(output, profile);
+    };
+    auto const [output, profile] = run(true);
+    auto const [plainOutput, plainProfile] = run(false);
+    EXPECT_EQ(output, plainOutput);
+    EXPECT_EQ(output, "100\n5050\n-1\n");
+    EXPECT_GT(profile.count(vm::kJUMP_IF_LOCAL_NOT_NULL), 0U);
+    EXPECT_GT(profile.count(vm::kGET_LOCAL_CDR), 0U);
+    EXPECT_GT(profile.count(vm::kSUB_ICONST), 0U);
+    EXPECT_EQ(plainProfile.count(vm::kJUMP_IF_LOCAL_NOT_NULL), 0U);
+    // Traversing the lists takes about half the dispatches.
+    EXPECT_LT(profile.dispatches() * 10, plainProfile.dispatches() * 7);
+}
+
+TEST(Compiler, astOptimizer)
+{
+    auto const optimize = [](std::string const& source)
+    {
+        Lexer lex(source);
+        MetaParser p(lex);
+        AstOptimizerStats stats{};
+        auto const result = AstOptimizer{stats}.optimize(parse(p.sexpr()));
+        return std::make_pair(result->toString(), stats);
+    };
+    EXPECT_EQ(optimize("(+ 1 2 (* 3 4) x 5)").first, "(App:+ 15 x 5)");
+    EXPECT_EQ(optimize("(if #t (begin (begin 1 2) (+ 1 2)) x)").first, "(Sequence: 1 2 3)");
+    EXPECT_EQ(optimize("(if 'false x y)").first, "y");
+    EXPECT_EQ(optimize("(if 'a x y)").first, "x");
+    EXPECT_EQ(optimize("(if (< 2 1) x (if (not (= 1 1.0)) y z))").first, "z");
+    EXPECT_EQ(optimize("(if x (% 1 0) (/ 1 0))").first, "(if x (App:% 1 0) (App:/ 1 0))");
+    auto const [str, stats] = optimize("(begin (define (f x) (begin (if #f x (- 3)))) (f 1))");
+    EXPECT_EQ(stats.constantsFolded, 1U);
+    EXPECT_EQ(stats.branchesRemoved, 1U);
+    EXPECT_EQ(stats.sequencesFlattened, 1U);
+
+    // Folding computes what the VM would.
+    std::string const source = "(print (+ 2147483646 1))"
+                               "(print (+ 2147483647 1))"
+                               "(print (* 65536 65536))"
+                               "(print (- (- 0 2147483647) 1))"
+                               "(print (- (- (- 0 2147483647) 1)))"
+                               "(print (- 0))"
+                               "(print (* 0 -5))"
+                               "(print (% -17 5))"
+                               "(print (/ 12 4))"
+                               "(print (/ 7 2))"
+                               "(print (/ 0 -5))"
+                               "(print (+ 1 0.5))"
+                               "(print (= 1 1.0))"
+                               "(print (eq? #t #f))"
+                               "(print (+ \"ab\" \"cd\"))"
+                               "(define (f x) (if (< 1 2) (+ x (* 2 3)) (car x)))"
+                               "(print (f 1))";
+    auto const run = [](std::string const& source, bool astOptimizer)
+    {
+        CompilerOptions options{};
+        options.astOptimizer = astOptimizer;
+        return compileAndRun(source, options).first;
+    };
+    auto const output = run(source, true);
+    EXPECT_EQ(output, run(source, false));
+    EXPECT_EQ(output, "2147483647\n2.14748e+09\n4.29497e+09\n-2147483648\n2.14748e+09\n0\n0\n-2\n3\n3.5\n0\n1.5\ntrue\nfalse\n\"abcd\"\n7\n");
+
+    // Parameters and internal definitions named like primitive ops are not folded.
+    EXPECT_EQ(optimize("(lambda (+) (+ 1 2))").first, "Lambda");
+    EXPECT_EQ(optimize("(lambda (x) (+ 1 2))").second.constantsFolded, 1U);
+    std::string const shadowing = "(print ((lambda (+) (+ 1 2)) *))"
+                                  "(define (f -) (- 5))"
+                                  "(print (f (lambda (x) x)))"
+                                  "(define (g not) (if (not #t) 1 2))"
+                                  "(print (g (lambda (x) x)))"
+                                  "(define (h x) (define (* a b) (+ a b)) (* 2 3))"
+                                  "(print (h 0))"
+                                  "(define (k -) (lambda () (- 5)))"
+                                  "(print ((k (lambda (x) x))))";
+    auto const shadowingOutput = run(shadowing, true);
+    EXPECT_EQ(shadowingOutput, run(shadowing, false));
+    EXPECT_EQ(shadowingOutput, "2\n5\n1\n5\n5\n");
+}
+
+TEST(Compiler, inliner)
+{
+    std::string const source = "(define (cadr x) (car (cdr x)))"
+                               "(define (> x y) (< y x))"
+                               "(define (<= x y) (not (> x y)))"
+                               "(define (sub x y) (- x y))"
+                               "(define (second lst) (cadr lst))"
+                               "(define (call-local cadr) (cadr '(1 2)))"
+                               "(define (g x) (+ x 1))"
+                               "(define (h x) (g x))"
+                               "(define (g x) (* x 10))"
+                               "(print (second '(1 2 3)))"
+                               "(print (cadr (cadr '(1 (2 3)))))"
+                               "(print (call-local (lambda (l) (car l))))"
+                               "(print (> (begin (print 1) 2) 1))"
+                               "(print (<= 3 (begin (print 2) 3)))"
+                               "(print (sub (begin (print 3) 5) (begin (print 4) 3)))"
+                               "(print (h 1))"
+                               "(print (g 1))";
+    auto const run = [](std::string const& source, bool inliner)
+    {
+        CompilerOptions options{};
+        options.inliner = inliner;
+        options.superinstructions = false;
+        auto const [output, c] = compileAndRun(source, options);
+        return std::make_tuple(output, c->code(), c->inlinedCalls());
+    };
+    auto const [output, code, inlinedCalls] = run(source, true);
+    EXPECT_EQ(output, std::get<0>(run(source, false)));
+    EXPECT_EQ(output, "2\n3\n1\n1\ntrue\n2\ntrue\n3\n4\n2\n2\n10\n");
+    // In the definitions: > in <=, cadr in second, g in h. At the top level: second and its cadr, both cadrs,
+    // >, <= and its >, the new g. Not h, the g its body calls is not the current one anymore, nor sub, both its
+    // arguments have effects.
+    EXPECT_EQ(inlinedCalls, 11U);
+    auto const secondPtr = code.constantPool.at(4).as<vm::FunctionSymbol>();
+    ASSERT_NE(secondPtr, nullptr);
+    EXPECT_EQ(secondPtr->name(), "second");
+    auto const expected = vm::LinkedInstructions{vm::kGET_LOCAL, 0, vm::kCDR, vm::kCAR, vm::kRET};
+    EXPECT_EQ(secondPtr->linkedInstructions(), expected);
+
+    // The primitive ops of an inlined body are the ones it was defined with, not the locals of the caller.
+    std::string const shadowing = "(define (sq x) (* x x))"
+                                  "(define (k *) (print 0) (sq 3))"
+                                  "(print (k +))"
+                                  "(define (snd x) (car (cdr x)))"
+                                  "(define (f car) (print 0) (snd car))"
+                                  "(print (f '(1 2 3)))";
+    auto const [shadowingOutput, shadowingCode, shadowingInlinedCalls] = run(shadowing, true);
+    EXPECT_EQ(shadowingOutput, std::get<0>(run(shadowing, false)));
+    EXPECT_EQ(shadowingOutput, "0\n9\n0\n2\n");
+    EXPECT_EQ(shadowingInlinedCalls, 2U);
+}
+
+TEST(Compiler, variadicPrimitives)
+{
+    std::string const source = "(define (fold f acc lst) (if (null? lst) acc (fold f (f acc (car lst)) (cdr lst))))"
+                               "(define (apply3 f) (f 1 2 3))"
+                               "(define (shadow list) (list 1))"
+                               "(print (- 10 1 2))"
+                               "(print (+))"
+                               "(print (* 2))"
+                               "(print (list 1 (+ 1 1) 3))"
+                               "(print (list* 1 2 '(3)))"
+                               "(print (append '(1) '() '(2 3) 4))"
+                               "(print (fold - 10 '(1 2 3)))"
+                               "(print (fold * 1 '(1 2 3 4)))"
+                               "(print (apply3 +))"
+                               "(print (apply3 list))"
+                               "(print (apply3 list*))"
+                               "(print (shadow (lambda (x) (- x))))";
+    auto code = sourceToBytecode(source);
+    vm::VM vm{code};
+    testing::internal::CaptureStdout();
+    vm.run();
+    std::string output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(output, "7\n0\n2\n(1 2 3)\n(1 2 3)\n(1 2 3 . 4)\n4\n24\n6\n(1 2 3)\n(1 2 . 3)\n-1\n");
+    // The builtins are called with the arguments on the stack: arithmetic does not allocate rest lists.
+    auto const bytesAllocated = [](std::string const& calls)
+    {
+        vm::VM vm{sourceToBytecode("(define (apply3 f) (f 1 2 3))" + calls)};
+        vm.run();
+        return vm.gcStats().bytesAllocated;
+    };
+    EXPECT_EQ(bytesAllocated("(apply3 +)"), bytesAllocated("(apply3 +) (apply3 -) (apply3 *) (apply3 +)"));
+}
+
+std::shared_ptr<Env> setUpEnvironment();
+
+TEST(Compiler, image)
+{
+    std::string const prelude = "(define twice (macro (x) `(+ ,x ,x)))"
+                                "(define (square x) (* x x))"
+                                "(define (len lst) (if (null? lst) 0 (+ 1 (len (cdr lst)))))"
+                                "(define greeting \"hi\")"
+                                "(define quarter 0.25)";
+    std::string const program = "(print (twice (square 3)))"
+                                "(print (len (list 'a 'b (twice quarter))))"
+                                "(print greeting)";
+    auto const compileForms = [](Compiler& c, std::string const& source, std::shared_ptr<Env> const& macroEnv,
+                                 std::vector<PreludeForm>* forms)
+    {
+        Lexer lex(source);
+        MetaParser p(lex);
+        while (!p.eof())
+        {
+            auto me = p.sexpr();
+            auto ee = expandMacros(me, macroEnv);
+            if (forms)
+            {
+                auto const macroDefinition = parseMacroDefinition(me) != nullptr;
+                forms->push_back({macroDefinition ? me : ee, macroDefinition});
+            }
+            c.compile(parse(ee));
+        }
+    };
+    auto const run = [](vm::ByteCode const& code)
+    {
+        vm::VM vm{code};
+        testing::internal::CaptureStdout();
+        vm.run();
+        return testing::internal::GetCapturedStdout();
+    };
+
+    auto const macroEnv = setUpEnvironment()->extend(Params{}, {});
+    Compiler c;
+    std::vector<PreludeForm> forms;
+    compileForms(c, prelude, macroEnv, &forms);
+    auto const image = writeImage(forms, c, prelude);
+    ASSERT_EQ(forms.size(), 5U);
+    EXPECT_TRUE(forms.front().macroDefinition);
+
+    // The restored compiler goes on compiling as the one that wrote the image, its macros replayed from the forms.
+    auto const restoredMacroEnv = setUpEnvironment()->extend(Params{}, {});
+    Compiler restored;
+    auto const restoredForms = readImage(image, prelude, &restored);
+    ASSERT_TRUE(restoredForms.has_value());
+    ASSERT_EQ(restoredForms->size(), forms.size());
+    for (size_t i = 0; i < forms.size(); ++i)
+    {
+        EXPECT_EQ(restoredForms->at(i).macroDefinition, forms.at(i).macroDefinition);
+        EXPECT_EQ(restoredForms->at(i).expr->toString(), forms.at(i).expr->toString());
+        if (restoredForms->at(i).macroDefinition)
+        {
+            expandMacros(restoredForms->at(i).expr, restoredMacroEnv);
+        }
+    }
+    compileForms(c, program, macroEnv, nullptr);
+    compileForms(restored, program, restoredMacroEnv, nullptr);
+    EXPECT_EQ(restored.code().instructions, c.code().instructions);
+    EXPECT_EQ(restored.inlinedCalls(), c.inlinedCalls());
+    EXPECT_EQ(run(restored.code()), "18\n3\n\"hi\"\n");
+    EXPECT_EQ(run(restored.code()), run(c.code()));
+
+    // Images only match their source and the options they were written with.
+    EXPECT_FALSE(readImage(image, prelude + "(define x 1)").has_value());
+    Compiler peephole{CompilerOptions{true, true}};
+    EXPECT_FALSE(readImage(image, prelude, &peephole).has_value());
+    EXPECT_THROW(readImage(image.substr(0, image.size() / 2), prelude), std::runtime_error);
+    // Corrupt bytes are caught by the checksum, even where they would still read.
+    auto corrupt = image;
+    corrupt[image.size() / 2] = static_cast<char>(corrupt[image.size() / 2] ^ 1);
+    EXPECT_THROW(readImage(corrupt, prelude), std::runtime_error);
+    EXPECT_THROW(readImage("not an image", prelude), std::runtime_error);
+}
+
+TEST(Compiler, bytecodeFile)
+{
+    auto code = sourceToBytecode("(define (adder n) (lambda (x) (+ x n)))"
+                                 "(define (fold f acc lst) (if (null? lst) acc (fold f (f acc (car lst)) (cdr lst))))"
+                                 "(print (list ((adder 1) 2) \"s\" 'q 2.5 -7))"
+                                 "(print (fold - 10 '(1 2 3)))"
+                                 "adder");
+    code.instructions.push_back(vm::kPRINT);
+    auto const run = [](vm::ByteCode const& code)
+    {
+        vm::VM vm{code};
+        testing::internal::CaptureStdout();
+        vm.run();
+        return testing::internal::GetCapturedStdout();
+    };
+    auto const bytes = vm::writeByteCode(code);
+    auto const read = vm::readByteCode(bytes);
+    EXPECT_EQ(read.instructions, code.instructions);
+    EXPECT_EQ(read.constantPool.size(), code.constantPool.size());
+    EXPECT_EQ(run(read), "(3 \"s\" 'q 2.5 -7)\n4\nClosure adder\n");
+    EXPECT_EQ(run(read), run(code));
+
+    // Without debug info, functions are anonymous.
+    auto const stripped = vm::writeByteCode(code, /* debugInfo = */ false);
+    EXPECT_LT(stripped.size(), bytes.size());
+    EXPECT_EQ(run(vm::readByteCode(stripped)), "(3 \"s\" 'q 2.5 -7)\n4\nClosure \n");
+
+    auto corrupt = bytes;
+    corrupt.back() = static_cast<char>(corrupt.back() ^ 1);
+    EXPECT_THROW(vm::readByteCode(corrupt), std::runtime_error);
+    EXPECT_THROW(vm::readByteCode(bytes.substr(0, bytes.size() - 1)), std::runtime_error);
+    EXPECT_THROW(vm::readByteCode(std::string{"LISPIMG"} + bytes.substr(7)), std::runtime_error);
+
+    // Well formed, but indexing out of range: a local past the frame of the function, a global that is never set, a
+    // constant past the pool.
+    auto const outOfRange = [](vm::Instructions function, vm::Instructions topLevel)
+    {
+        vm::ByteCode crafted;
+        crafted.constantPool.push_back(
+            crafted.constants->make<vm::FunctionSymbol>("f", size_t{1}, false, size_t{1}, std::move(function)));
+        crafted.instructions = {vm::kCLOSURE, 0, 0, 0, 0, 0, 0, 0, 0, vm::kSET_GLOBAL, 0, 0, 0, 0};
+        crafted.instructions.insert(crafted.instructions.end(), topLevel.begin(), topLevel.end());
+        return vm::writeByteCode(crafted);
+    };
+    EXPECT_NO_THROW(vm::readByteCode(outOfRange({vm::kGET_LOCAL, 0, 0, 0, 1, vm::kRET}, {vm::kGET_GLOBAL, 0, 0, 0, 0})));
+    EXPECT_THROW(vm::readByteCode(outOfRange({vm::kGET_LOCAL, 0, 0, 0, 2, vm::kRET}, {})), std::runtime_error);
+    EXPECT_THROW(vm::readByteCode(outOfRange({vm::kSET_LOCAL, 0, 0, 1, 0, vm::kRET}, {})), std::runtime_error);
+    EXPECT_THROW(vm::readByteCode(outOfRange({vm::kTRUE, vm::kRET}, {vm::kGET_LOCAL, 0, 0, 0, 0})), std::runtime_error);
+    EXPECT_THROW(vm::readByteCode(outOfRange({vm::kTRUE, vm::kRET}, {vm::kGET_GLOBAL, 0, 0, 0, 1})), std::runtime_error);
+    EXPECT_THROW(vm::readByteCode(outOfRange({vm::kCONST, 0, 0, 0, 0, vm::kRET}, {})), std::runtime_error);
+    EXPECT_THROW(vm::readByteCode(outOfRange({vm::kTRUE, vm::kRET}, {vm::kCONST, 0, 0, 0, 1})), std::runtime_error);
+}
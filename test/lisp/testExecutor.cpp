@@ -0,0 +1,99 @@
+#include "gtest/gtest.h"
+#include "lisp/executor.h"
+#include "lisp/metaParser.h"
+#include "lisp/parser.h"
+
+std::shared_ptr<Env> setUpEnvironment();
+
+auto executorEnvironment()
+{
+    auto env = setUpEnvironment();
+    auto sub = [](std::vector<std::shared_ptr<Expr>> const& args)
+    {
+        ASSERT(args.size() == 2);
+        auto num1 = dynamic_cast<Number&>(*args.at(0));
+        auto num2 = dynamic_cast<Number&>(*args.at(1));
+        return std::shared_ptr<Expr>(new Number(num1.get() - num2.get()));
+    };
+    env->defineVariable("-", ExprPtr{new PrimitiveProcedure{sub}});
+    return env;
+}
+
+// Runs source with the executors and with eval, expecting the same value.
+auto executeAndEval(std::string const& source)
+{
+    std::string executed;
+    std::string evaluated;
+    {
+        Lexer lex(source);
+        MetaParser p(lex);
+        auto env = executorEnvironment();
+        while (!p.eof())
+        {
+            executed = executeTrampoline(*makeExecutor(parse(p.sexpr())), env)->toString();
+        }
+        env->clear();
+    }
+    {
+        Lexer lex(source);
+        MetaParser p(lex);
+        auto env = executorEnvironment();
+        while (!p.eof())
+        {
+            evaluated = parse(p.sexpr())->eval(env)->toString();
+        }
+        env->clear();
+    }
+    EXPECT_EQ(executed, evaluated);
+    return executed;
+}
+
+TEST(Executor, constants)
+{
+    EXPECT_EQ(executeAndEval("1.5"), "1.5");
+    EXPECT_EQ(executeAndEval("\"abc\""), "\"abc\"");
+    EXPECT_EQ(executeAndEval("#f"), "false");
+    EXPECT_EQ(executeAndEval("'(1 a)"), "(1 'a)");
+}
+
+TEST(Executor, if)
+{
+    EXPECT_EQ(executeAndEval("(if (< 1 2) 1 2)"), "1");
+    EXPECT_EQ(executeAndEval("(if (< 2 1) 1 2)"), "2");
+    // Not a shared boolean.
+    EXPECT_EQ(executeAndEval("(if 0 1 2)"), "1");
+}
+
+TEST(Executor, application)
+{
+    EXPECT_EQ(executeAndEval("((lambda () 1))"), "1");
+    EXPECT_EQ(executeAndEval("(define (f a b c d e) (- a (- b (- c (- d e))))) (f 1 2 3 4 5)"), "3");
+    EXPECT_EQ(executeAndEval("(define (f a . rest) rest) (f 1 2 3)"), "(2 3)");
+    EXPECT_EQ(executeAndEval("(define (f . rest) rest) (f)"), "()");
+    EXPECT_EQ(executeAndEval("(define (fact n) (if (= n 0) 1 (* n (fact (- n 1))))) (fact 5)"), "120");
+    // Macros get their operands unevaluated.
+    EXPECT_EQ(executeAndEval("((macro (x) 'x) (car 1))"), "x");
+    EXPECT_EQ(executeAndEval("(define m (macro (x y) y)) (m (car 1) 2)"), "2");
+}
+
+TEST(Executor, closures)
+{
+    EXPECT_EQ(executeAndEval("(define (adder x) (lambda (y) (+ x y))) ((adder 1) 2)"), "3");
+    EXPECT_EQ(executeAndEval("(define (counter) (define n 0) (lambda () (set! n (+ n 1)) n)) (define c (counter)) (c) (c)"), "2");
+    EXPECT_EQ(executeAndEval("(define x 1) (define (f) `(x ,x)) (f)"), "('x 1)");
+}
+
+TEST(Executor, arity)
+{
+    Lexer lex("(define (f a b) a) (f 1)");
+    MetaParser p(lex);
+    auto env = executorEnvironment();
+    executeTrampoline(*makeExecutor(parse(p.sexpr())), env);
+    EXPECT_THROW(executeTrampoline(*makeExecutor(parse(p.sexpr())), env), std::runtime_error);
+    env->clear();
+}
+
+TEST(Executor, tailCall)
+{
+    EXPECT_EQ(executeAndEval("(define (loop n) (if (= n 0) 'done (begin 1 ((lambda (m) (loop m)) (- n 1))))) (loop 30000)"), "'done");
+}
@@ -1,5 +1,6 @@
 #include "gtest/gtest.h"
 #include "lisp/vm.h"
+#include "lisp/peephole.h"
 #include <numeric>
 
 TEST(VM, add)
@@ -8,7 +9,7 @@ TEST(VM, add)
     vm::VM vm{vm::ByteCode{instructions, {}}};
     vm.run();
     auto result = vm.peekOperandStack();
-    EXPECT_EQ(std::get<vm::Int>(result).value, 3);
+    EXPECT_EQ(vm::get<vm::Int>(result).value, 3);
 }
 
 TEST(VM, print)
@@ -24,7 +25,9 @@ TEST(VM, print)
 TEST(VM, str)
 {
     std::vector<vm::Byte> const instructions = {vm::kCONST, 0, 0, 0, 0, vm::kPRINT};
-    vm::VM vm{vm::ByteCode{instructions, {vm::String{"some str: 123"}}}};
+    vm::ByteCode code{instructions, {}};
+    code.constantPool.push_back(code.constants->string("some str: 123"));
+    vm::VM vm{code};
     testing::internal::CaptureStdout();
     vm.run();
     std::string output = testing::internal::GetCapturedStdout();
@@ -34,9 +37,201 @@ TEST(VM, str)
 TEST(VM, cons)
 {
     std::vector<vm::Byte> const instructions = {vm::kCONST, 0, 0, 0, 0, vm::kCONST, 0, 0, 0, 1, vm::kCONS, vm::kCAR, vm::kPRINT};
-    vm::VM vm{vm::ByteCode{instructions, {vm::String{"some str: 123"}, vm::Int{12345}}}};
+    vm::ByteCode code{instructions, {}};
+    code.constantPool.push_back(code.constants->string("some str: 123"));
+    code.constantPool.push_back(vm::Int{12345});
+    vm::VM vm{code};
     testing::internal::CaptureStdout();
     vm.run();
     std::string output = testing::internal::GetCapturedStdout();
     EXPECT_EQ(output, "\"some str: 123\"\n");
 }
+
+TEST(VM, object)
+{
+    static_assert(sizeof(vm::Object) == 8);
+    EXPECT_EQ(vm::get<vm::Double>(vm::Object{vm::Double{-1.5}}).value, -1.5);
+    EXPECT_EQ(vm::get<vm::Int>(vm::Object{vm::Int{-7}}).value, -7);
+    EXPECT_TRUE(vm::get<vm::Bool>(vm::Object{vm::Bool{true}}).value);
+    EXPECT_TRUE(vm::Object{vm::vmNull}.isNull());
+    EXPECT_TRUE(vm::Object{vm::Double{std::nan("")}}.isDouble());
+    EXPECT_FALSE(vm::Object{vm::Int{1}} == vm::Object{vm::Double{1}});
+    vm::Heap heap;
+    EXPECT_EQ(vm::get<vm::String>(vm::Object{heap.string("abc")}).value, "abc");
+    EXPECT_THROW(vm::get<vm::Symbol>(vm::Object{heap.string("abc")}), std::runtime_error);
+}
+
+TEST(VM, symbol)
+{
+    vm::Object const a{vm::Symbol{intern("a")}};
+    EXPECT_TRUE(a.isSymbol());
+    EXPECT_FALSE(a.isHeap());
+    // Same name, same bits: no string is compared.
+    EXPECT_TRUE(a.sameBits(vm::Object{vm::Symbol{intern("a")}}));
+    EXPECT_FALSE(a == vm::Object{vm::Symbol{intern("b")}});
+    EXPECT_EQ(symbolName(vm::get<vm::Symbol>(a).value), "a");
+    std::vector<vm::Byte> const instructions = {vm::kCONST, 0, 0, 0, 0, vm::kCONST, 0, 0, 0, 1, vm::kEQUAL, vm::kPRINT, vm::kCONST, 0, 0, 0, 0, vm::kPRINT};
+    vm::VM vm{vm::ByteCode{instructions, {vm::Symbol{intern("a")}, vm::Symbol{intern("a")}}}};
+    testing::internal::CaptureStdout();
+    vm.run();
+    std::string output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(output, "true\n'a\n");
+}
+
+TEST(VM, heapCollect)
+{
+    vm::Heap heap;
+    auto const lst = heap.cons(heap.string("abc"), vm::vmNull);
+    auto const garbage = heap.cons(heap.string("def"), vm::Object{lst});
+    unused(garbage);
+    EXPECT_EQ(heap.stats().objectsInUse, 4U);
+    heap.collect([lst](vm::Heap& h) { h.mark(lst); });
+    EXPECT_EQ(heap.stats().collections, 1U);
+    EXPECT_EQ(heap.stats().objectsInUse, 2U);
+    EXPECT_EQ(heap.stats().bytesInUse, heap.stats().bytesAllocated - heap.stats().bytesFreed);
+    EXPECT_EQ(vm::get<vm::String>(lst->car()).value, "abc");
+    EXPECT_TRUE(vm::Object{lst} == vm::Object{heap.cons(heap.string("abc"), vm::vmNull)});
+}
+
+TEST(VM, heapCollectLongList)
+{
+    // Neither marking nor freeing recurses along the list.
+    vm::Heap heap;
+    vm::Object lst = vm::vmNull;
+    for (int32_t i = 0; i < 1000000; ++i)
+    {
+        lst = heap.cons(vm::Int{i}, lst);
+    }
+    heap.collect([lst](vm::Heap& h) { h.mark(lst); });
+    EXPECT_EQ(heap.stats().objectsInUse, 1000000U);
+    heap.collect([](vm::Heap&) {});
+    EXPECT_EQ(heap.stats().objectsInUse, 0U);
+    EXPECT_EQ(heap.stats().bytesInUse, 0U);
+}
+
+TEST(VM, consPool)
+{
+    auto const& stats = vm::VMCons::pool().stats();
+    auto const inUse = stats.cellsInUse;
+    auto const chunks = stats.chunks;
+    {
+        vm::Heap heap;
+        vm::Object lst = vm::vmNull;
+        for (int32_t i = 0; i < 10000; ++i)
+        {
+            lst = heap.cons(vm::Int{i}, lst);
+        }
+        EXPECT_EQ(stats.cellsInUse, inUse + 10000);
+        // Cells are packed in chunks, not allocated one by one.
+        EXPECT_LT(stats.chunks - chunks, 10U);
+    }
+    EXPECT_EQ(stats.cellsInUse, inUse);
+}
+
+TEST(VM, closureSharesFunctionSymbol)
+{
+    std::vector<vm::Byte> const instructions = {vm::kCLOSURE, 0, 0, 0, 0, 0, 0, 0, 0};
+    vm::ByteCode code{instructions, {}};
+    auto const funcSym = code.constants->make<vm::FunctionSymbol>("f", size_t{0}, false, size_t{0}, vm::Instructions{vm::kTRUE, vm::kRET});
+    code.constantPool.push_back(funcSym);
+    vm::VM vm{code};
+    vm.run();
+    auto const closure = vm::get<vm::ClosurePtr>(vm.peekOperandStack());
+    EXPECT_EQ(&closure->funcSym(), funcSym);
+    // Constants are pinned, collecting the VM heap keeps them.
+    vm.collectGarbage();
+    EXPECT_EQ(vm.gcStats().objectsInUse, 1U);
+    EXPECT_EQ(closure->funcSym().name(), "f");
+}
+
+TEST(VM, link)
+{
+    std::vector<vm::Byte> const instructions = {vm::kTRUE, vm::kJUMP_IF_NOT_TRUE, 0, 0, 0, 17, vm::kICONST, 0xFF, 0xFF, 0xFF, 0xFE,
+                                                vm::kJUMP, 0, 0, 0, 22, vm::kPOP, vm::kICONST, 0, 0, 0, 3, vm::kPRINT};
+    auto const linked = vm::link(instructions);
+    // Jump targets are word offsets.
+    auto const expected = vm::LinkedInstructions{vm::kTRUE, vm::kJUMP_IF_NOT_TRUE, 8, vm::kICONST, 0xFFFFFFFE,
+                                                 vm::kJUMP, 10, vm::kPOP, vm::kICONST, 3, vm::kPRINT};
+    EXPECT_EQ(linked, expected);
+    vm::VM vm{vm::ByteCode{instructions, {}}};
+    testing::internal::CaptureStdout();
+    vm.run();
+    std::string output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(output, "-2\n");
+    EXPECT_THROW(vm::link({vm::kCONST, 0, 0}), std::runtime_error);
+}
+
+TEST(VM, peephole)
+{
+    std::vector<vm::Byte> instructions = {vm::kGET_LOCAL, 0, 0, 0, 1, vm::kSET_LOCAL, 0, 0, 0, 1,
+                                          vm::kJUMP, 0, 0, 0, 15, vm::kICONST, 0, 0, 0, 5, vm::kMINUS,
+                                          vm::kTRUE, vm::kNOT, vm::kJUMP_IF_NOT_TRUE, 0, 0, 0, 34, vm::kICONST, 0, 0, 0, 1, vm::kPRINT,
+                                          vm::kJUMP, 0, 0, 0, 40, vm::kPOP};
+    std::vector<vm::Object> constantPool;
+    vm::PeepholeStats stats{};
+    vm::optimize(instructions, constantPool, stats);
+    auto const expected = std::vector<vm::Byte>{vm::kICONST, 0xFF, 0xFF, 0xFF, 0xFB, vm::kTRUE, vm::kJUMP_IF_TRUE, 0, 0, 0, 17,
+                                                vm::kICONST, 0, 0, 0, 1, vm::kPRINT};
+    EXPECT_EQ(instructions, expected);
+    EXPECT_EQ(stats.constantsFolded, 1U);
+    EXPECT_EQ(stats.jumpsThreaded, 1U);
+    EXPECT_EQ(stats.branchesInverted, 1U);
+    EXPECT_EQ(stats.jumpsRemoved, 2U);
+    EXPECT_EQ(stats.deadInstructions, 1U);
+    EXPECT_EQ(stats.loadStoresRemoved, 1U);
+    EXPECT_EQ(stats.bytesBefore, 40U);
+    EXPECT_EQ(stats.bytesAfter, expected.size());
+
+    // Negated doubles reuse the entries of the pool holding them.
+    std::vector<vm::Byte> doubles = {vm::kCONST, 0, 0, 0, 0, vm::kMINUS, vm::kCONST, 0, 0, 0, 0, vm::kMINUS,
+                                     vm::kCONST, 0, 0, 0, 2, vm::kMINUS};
+    std::vector<vm::Object> doublePool{vm::Double{1.5}, vm::Double{-0.0}, vm::Double{0.0}};
+    vm::PeepholeStats doubleStats{};
+    vm::optimize(doubles, doublePool, doubleStats);
+    EXPECT_EQ(doubleStats.constantsFolded, 3U);
+    ASSERT_EQ(doublePool.size(), 4U);
+    EXPECT_EQ(doublePool.back().asDouble(), -1.5);
+    auto const expectedDoubles = std::vector<vm::Byte>{vm::kCONST, 0, 0, 0, 3, vm::kCONST, 0, 0, 0, 3,
+                                                       vm::kCONST, 0, 0, 0, 1};
+    EXPECT_EQ(doubles, expectedDoubles);
+}
+
+TEST(VM, superinstructions)
+{
+    std::vector<vm::Byte> instructions = {vm::kGET_LOCAL, 0, 0, 0, 0, vm::kIS_NULL, vm::kJUMP_IF_NOT_TRUE, 0, 0, 0, 28,
+                                          vm::kGET_LOCAL, 0, 0, 0, 1, vm::kCDR, vm::kCURRENT_FUNCTION, vm::kTAIL_CALL, 0, 0, 0, 1,
+                                          vm::kICONST, 0, 0, 0, 1, vm::kSUB, vm::kGET_GLOBAL, 0, 0, 0, 2, vm::kCALL, 0, 0, 0, 1,
+                                          vm::kRET};
+    EXPECT_EQ(vm::selectSuperinstructions(instructions), 4U);
+    // kSUB is a jump target, it is not fused with the kICONST before it.
+    auto const expected = std::vector<vm::Byte>{vm::kJUMP_IF_LOCAL_NOT_NULL, 0, 0, 0, 24, 0, 0, 0, 0,
+                                                vm::kGET_LOCAL_CDR, 0, 0, 0, 1, vm::kCURRENT_FUNCTION_TAIL_CALL, 0, 0, 0, 1,
+                                                vm::kICONST, 0, 0, 0, 1, vm::kSUB, vm::kGET_GLOBAL_CALL, 0, 0, 0, 2, 0, 0, 0, 1,
+                                                vm::kRET};
+    EXPECT_EQ(instructions, expected);
+    // Only the jump target is a word offset once linked.
+    auto const linked = vm::link(instructions);
+    EXPECT_EQ(linked.at(1), 9U);
+    EXPECT_EQ(linked.at(2), 0U);
+}
+
+TEST(VM, builtin)
+{
+    // (print (append (list 1 2) '(3))) with list called as a builtin, (print (- 10 (- 1) 4)) likewise.
+    std::vector<vm::Byte> const instructions = {vm::kICONST, 0, 0, 0, 1, vm::kICONST, 0, 0, 0, 2, vm::kCONST, 0, 0, 0, 0,
+                                                vm::kCALL, 0, 0, 0, 2, vm::kICONST, 0, 0, 0, 3, vm::kNULL, vm::kCONS,
+                                                vm::kAPPEND, vm::kPRINT,
+                                                vm::kICONST, 0, 0, 0, 10, vm::kICONST, 0, 0, 0, 1, vm::kCONST, 0, 0, 0, 1,
+                                                vm::kCALL, 0, 0, 0, 1, vm::kICONST, 0, 0, 0, 4, vm::kCONST, 0, 0, 0, 1,
+                                                vm::kCALL, 0, 0, 0, 3, vm::kPRINT};
+    vm::ByteCode code{instructions, {}};
+    code.constantPool.push_back(code.constants->make<vm::Builtin>("list", std::nullopt, vm::kCONS, true, vm::vmNull, true));
+    code.constantPool.push_back(code.constants->make<vm::Builtin>("-", vm::kMINUS, vm::kSUB, false, std::nullopt, false));
+    vm::VM vm{code};
+    testing::internal::CaptureStdout();
+    vm.run();
+    std::string output = testing::internal::GetCapturedStdout();
+    EXPECT_EQ(output, "(1 2 3)\n7\n");
+    // Two cells for the list, one for (3) and two for the copy append makes.
+    EXPECT_EQ(vm.gcStats().objectsInUse, 5U);
+}